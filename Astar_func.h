@@ -1,111 +1,829 @@
-void AStar (node* nodes, unsigned long source, unsigned long dest, unsigned long nnodes, char* name, int evaluation, double param) {
+/*** astar_kernel() is the A* loop of astar_search() for one evaluation mode. It is always inlined, and astar_search() calls it with a constant mode, so every mode gets its own loop with the key computed in place instead of going through evaluation_function(); the query constants (1-w and w in mode 2, e in mode 3) are hoisted out of the loop. In mode 3 the dynamic weight term of a node depends only on the node for a given query, so it is folded into h when the node is first reached, reusing the chord bound to the destination that h already needs: h then holds h + e·(1-d/N)·h and every key, including updates, costs the same as in mode 1. ***/
+static inline __attribute__((always_inline)) bool astar_kernel (const graph* g, SearchContext* ctx, unsigned long source_index, unsigned long dest_index, const int mode, const bool resume, double param, unsigned long* expanded_nodes) {
     
-    unsigned long source_index = (unsigned long)binary_search(nodes, source, 0, nnodes-1);           // find index of source in nodes vector
-    unsigned long dest_index   = (unsigned long)binary_search(nodes, dest, 0, nnodes-1);             // find index of destination in nodes vector
-    
-    printf("A* will compute the route:\n");
-    printf("\tfrom: ID %lu\tlatitude %.7f\tlongitude %.7f\n", nodes[source_index].id, nodes[source_index].lat, nodes[source_index].lon);
-    printf("\tto:   ID %lu\tlatitude %.7f\tlongitude %.7f\n\n", nodes[dest_index].id, nodes[dest_index].lat, nodes[dest_index].lon);
-    
-// progress stores g, h, index in nodes vector and queue location for all nodes
-    AStarStatus* progress = NULL;
-    if ((progress = (AStarStatus*) malloc(nnodes*sizeof(AStarStatus))) == NULL) ExitError("when allocating memory for the progress vector", 19);
-    unsigned long i;
-    for (i = 0; i < nnodes; i++) {
-        progress[i].whq = 0;                                                                  // all nodes start neither in OPEN nor CLOSED list
-        progress[i].g = INFINITY;                                                             // all nodes start with INF g function
-    }
-    progress[source_index].whq = 1;                                                           // put source node in the OPEN list
-    progress[source_index].g = 0;                                                             // g(source) = 0
-    progress[source_index].h = haversine( nodes[source_index], nodes[dest_index]);            // h(source) = heuristic distance to destination
-
-// OPEN list and auxiliary
-    struct open_node* OPEN = NULL;                                                         
-    if ((OPEN = (open_node*) malloc(sizeof(open_node))) == NULL) ExitError("when allocating memory for the OPEN list", 20);
-    struct open_node* AUX = NULL;
-// to start, only element in the OPEN list is the source node
-    OPEN->index = source_index;
-    OPEN->f = evaluation_function (evaluation, param, progress, nodes, source_index, source_index, dest_index);
-    OPEN->next = NULL;
+    AStarStatus* progress = ctx->progress;
+    OpenList* OPEN = &ctx->OPEN;
+    const double g_weight = (mode == 2) ? 1 - param : 1;           // key of a node: g_weight·g + h_weight·h
+    const double h_weight = (mode == 2) ? param : 1;
+    bool reopen = (g->lm != NULL);              // the landmark heuristic is only consistent up to rounding: CLOSED nodes may be reopened
+
+// OPEN list: to start, only element in the OPEN list is the source node (a resumed search goes on from the OPEN list it has, see resume_astar_search())
+    if (!resume) {
+        touch_node(ctx, source_index);
+        progress[source_index].g = 0;                                                             // g(source) = 0
+        progress[source_index].h = heuristic(g, source_index, dest_index);                // h(source) = heuristic distance to destination
+        if (mode == 3) progress[source_index].h += param * dynamic_extra(g, source_index, source_index, dest_index, progress[source_index].h) * progress[source_index].h;
+        push_to_OPEN (source_index, h_weight*progress[source_index].h, progress, OPEN);
+    }
     unsigned long cur_index;                    // index of current node (that with minimal f) extracted from OPEN list
-    unsigned short succ_count;                  // counter over the success of the node being expanded
+    uint64_t succ_count;                        // counter over the successors of the node being expanded
     unsigned long succ_index;                   // index in nodes vector of the successor being processed
     double successor_current_cost;              // cost of successor (g) if we were to reach it from the current node
-    double w;                                   // distance (in straight line) from current node to successor
+    double w;                                   // length of the edge from current node to successor
+    const overlay_table* penalties = g->penalties ? &g->penalties->edges : NULL;  // edge overlay pinned for the search, NULL if none
     unsigned long expanded_nodes_counter = 0;   // counter of the number of expanded nodes
-    clock_t start, end;                         // to get CPU time of running the algorithm
-    double cpu_time_used;
-    printf("Running A*...\n\n");
-    start = clock();                            // get time before executing the A* loop
-    while (OPEN != NULL) {
-        cur_index = OPEN->index;
+    bool found = false;                         // whether destination has been reached
+    while (OPEN->size > 0) {
+        cur_index = pop_from_OPEN(OPEN, progress);                                  // extract node with minimal f from OPEN list
         expanded_nodes_counter += 1;
+        if (search_expired(ctx, expanded_nodes_counter)) break;                     // out of time: give up as if not found
+        TRACE(TRACE_EXPAND, ctx, cur_index);
         if (cur_index == dest_index) {                                              // we have reached destination -> break
-            printf("A* algorithm has reached the destination node (ID %lu).\n\n", nodes[cur_index].id);
+            found = true;
             break;
         }
-        for (succ_count = 0; succ_count < nodes[cur_index].nsucc; succ_count++) {   // generate successors
-            succ_index = (nodes[cur_index].successors)[succ_count];                 // find index of generated successor
-            w = haversine( nodes[cur_index], nodes[succ_index] );                   // weight of edge from current node to successor
+        progress[cur_index].whq = 2;                                                // move current node from OPEN to CLOSE list
+        ctx->stats.relaxed += g->first[cur_index+1] - g->first[cur_index];
+        for (succ_count = g->first[cur_index]; succ_count < g->first[cur_index+1]; succ_count++) {   // generate successors
+            succ_index = g->targets[succ_count];                                    // find index of generated successor
+            w = edge_weight(g->weights, penalties, succ_count);                      // weight of edge from current node to successor, precomputed by write_main
             successor_current_cost = progress[cur_index].g + w;                     // successor cost if we were to reach successor from the current node
-        /* successor is in the OPEN list */
+        /* successor is in the OPEN list: its key is updated in place by push_to_OPEN() */
             if ( progress[succ_index].whq == 1 ) {
                 if ( progress[succ_index].g <= successor_current_cost ) continue;   // successor cost is lower than if reached from the current node: go to next successor
-                else delete_from_OPEN(succ_index, progress, OPEN);                  // delete successor from OPEN list, it will be re-inserted later with updated values
             }
         /* successor is in the CLOSE list: assuming we are using a monotone heuristic, nodes in the CLOSE list are never re-expanded. */
-            else if ( progress[succ_index].whq == 2 ) continue;
+            else if ( progress[succ_index].whq == 2 ) {
+                if ( !reopen || progress[succ_index].g <= successor_current_cost || progress[succ_index].h == INFINITY ) continue;
+            }
         /* successor not in OPEN nor CLOSE list */
-            else progress[succ_index].h = haversine( nodes[succ_index], nodes[dest_index] ); // compute h function of successor
+            else {
+                if ( successor_current_cost == INFINITY ) continue;                 // blocked edge, see edge_overlay
+                touch_node(ctx, succ_index);                                        // first time the successor is reached in this search
+                progress[succ_index].h = heuristic(g, succ_index, dest_index);      // compute h function of successor
+                if ( progress[succ_index].h == INFINITY ) {                         // destination cannot be reached from the successor
+                    progress[succ_index].g = successor_current_cost;
+                    progress[succ_index].whq = 2;
+                    continue;
+                }
+                if (mode == 3) progress[succ_index].h += param * dynamic_extra(g, succ_index, source_index, dest_index, progress[succ_index].h) * progress[succ_index].h;
+            }
             
             progress[succ_index].g = successor_current_cost;                        // set successor cost as that coming from the current node
             progress[succ_index].parent = cur_index;                                // set successor parent as current node
-            insert_to_OPEN (succ_index, progress, OPEN, nodes, evaluation, param, source_index, dest_index);
+            push_to_OPEN (succ_index, g_weight*successor_current_cost + h_weight*progress[succ_index].h, progress, OPEN);
         }
-        progress[cur_index].whq = 2;                                                // move current node from OPEN to CLOSE list
-    // select next element in OPEN list and free memory allocated for the current node 
-        AUX = OPEN->next;   free(OPEN);     OPEN = AUX;                                                                                                                      
     }
-    end = clock();                                                                      // get time after ending the A* loop
-    if (OPEN == NULL) ExitError("OPEN list is empty before reaching destination", 23);  // destination has not been reached
+    *expanded_nodes = expanded_nodes_counter;
+    return found;
+}
 
-    while (OPEN != NULL) {                                                              // free the remainder of the OPEN list
-        AUX = OPEN->next;   free(OPEN);     OPEN = AUX;
+/*** astar_search() runs the A* loop from source_index to dest_index on the search context ctx, without printing anything. On return the progress vector of ctx holds g, h and parent of every node reached, so the path can be rebuilt from dest_index (in mode 3, h is the heuristic itself only along that path, see astar_kernel()). It returns false if the OPEN list empties before reaching the destination, or if the deadline of ctx passes first (ctx->expired is then set). The number of expanded nodes is stored in expanded_nodes and the number of edges scanned in ctx->stats.relaxed. ***/
+bool astar_search (const graph* g, SearchContext* ctx, unsigned long source_index, unsigned long dest_index, int evaluation, double param, unsigned long* expanded_nodes) {
+    
+    reset_search_context(ctx);
+    bool found = false;
+    if (evaluation == 1) found = astar_kernel(g, ctx, source_index, dest_index, 1, false, param, expanded_nodes);
+    else if (evaluation == 2) found = astar_kernel(g, ctx, source_index, dest_index, 2, false, param, expanded_nodes);
+    else if (evaluation == 3) {
+        found = astar_kernel(g, ctx, source_index, dest_index, 3, false, param, expanded_nodes);
+        if (found) {                                                    // give the nodes of the path their heuristic back for the output
+            unsigned long cur_index;
+            for (cur_index = dest_index; cur_index != source_index; cur_index = ctx->progress[cur_index].parent)
+                ctx->progress[cur_index].h = heuristic(g, cur_index, dest_index);
+            ctx->progress[source_index].h = heuristic(g, source_index, dest_index);
+        }
     }
-    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;                          // compute time to execute A*
-    printf("The optimal distance has been found to be %.5f km.\n\n", progress[dest_index].g);
-    printf("A* has expanded %lu nodes.\n\n", expanded_nodes_counter);
-    printf("The A* loop has taken %.6f seconds to complete.\n\n", cpu_time_used);
-       
-// count the number of nodes in the path
+    else ExitError("Invalid choice of evaluation function.", 22);
+    return found;
+}
+
+/*** dijkstra_search() settles every node reachable from source_index, following successors (reverse == false) or predecessors (reverse == true). On return progress[v].g in ctx is the distance from the source to v (to the source from v if reverse), INFINITY for nodes that are not connected. It returns the number of settled nodes. ***/
+unsigned long dijkstra_search (const graph* g, SearchContext* ctx, unsigned long source_index, bool reverse) {
+    
+    reset_search_context(ctx);
+    AStarStatus* progress = ctx->progress;
+    OpenList* OPEN = &ctx->OPEN;
+    const uint64_t* first = reverse ? g->rfirst : g->first;
+    const edge_target* targets = reverse ? g->rtargets : g->targets;
+    const double* weights = reverse ? g->rweights : g->weights;
+    const overlay_table* penalties = g->penalties == NULL ? NULL : reverse ? &g->penalties->redges : &g->penalties->edges;
+    touch_node(ctx, source_index);
+    progress[source_index].g = 0;
+    progress[source_index].h = 0;                                               // no heuristic: f = g
+    insert_to_OPEN (source_index, progress, OPEN, g, 1, 0, source_index, source_index);
+    unsigned long settled = 0;
+    while (OPEN->size > 0) {
+        unsigned long cur_index = pop_from_OPEN(OPEN, progress);
+        settled += 1;
+        progress[cur_index].whq = 2;
+        uint64_t succ_count;
+        for (succ_count = first[cur_index]; succ_count < first[cur_index+1]; succ_count++) {
+            unsigned long succ_index = targets[succ_count];
+            double successor_current_cost = progress[cur_index].g + edge_weight(weights, penalties, succ_count);
+            if ( progress[succ_index].whq == 1 ) {
+                if ( progress[succ_index].g <= successor_current_cost ) continue;
+            }
+            else if ( progress[succ_index].whq == 2 ) continue;
+            else {
+                if ( successor_current_cost == INFINITY ) continue;             // blocked edge, see edge_overlay
+                touch_node(ctx, succ_index);
+                progress[succ_index].h = 0;
+            }
+            progress[succ_index].g = successor_current_cost;
+            progress[succ_index].parent = cur_index;
+            insert_to_OPEN (succ_index, progress, OPEN, g, 1, 0, source_index, source_index);
+        }
+    }
+    return settled;
+}
+
+/*** bidirectional_potential() is the forward potential of the bidirectional search: the average of the chord bound to the destination and minus the chord bound from the source. Using it forwards and its opposite backwards keeps both searches consistent, so the usual stopping criterion of bidirectional Dijkstra on reduced costs applies. ***/
+double bidirectional_potential (const graph* g, unsigned long v, unsigned long source_index, unsigned long dest_index) {
+    return 0.5 * (distance_bound(g, v, dest_index) - distance_bound(g, source_index, v));
+}
+
+/*** join_bidirectional_path() continues the parent chain of the forward search from the meeting node to the destination, following the backward search. g is accumulated in path order, so the distance found at the destination is computed exactly as a forward search would, and h is set back to the chord bound to the destination for the output. ***/
+void join_bidirectional_path (const graph* g, SearchContext* fwd, SearchContext* bwd, unsigned long meeting, unsigned long source_index, unsigned long dest_index) {
+    AStarStatus* progress = fwd->progress;
+    unsigned long cur_index = meeting;
+    const overlay_table* penalties = g->penalties ? &g->penalties->edges : NULL;
+    while (cur_index != dest_index) {
+        unsigned long next = bwd->progress[cur_index].parent;      // in the backward search the parent is the next node towards the destination
+        double w = INFINITY;
+        uint64_t k;
+        for (k = g->first[cur_index]; k < g->first[cur_index+1]; k++)
+            if (g->targets[k] == next) w = fmin(w, edge_weight(g->weights, penalties, k));
+        if (progress[next].whq == 0 && progress[next].g == INFINITY) touch_node(fwd, next);
+        progress[next].g = progress[cur_index].g + w;
+        progress[next].parent = cur_index;
+        cur_index = next;
+    }
+// walk back from the destination to recompute h of every node in the path
     cur_index = dest_index;
-    unsigned long path_len = 0;
     while (cur_index != source_index) {
-        path_len += 1;
+        progress[cur_index].h = distance_bound(g, cur_index, dest_index);
         cur_index = progress[cur_index].parent;
     }
-    path_len += 1;
-    printf("The computed path has %lu nodes.\n\n", path_len);
+    progress[source_index].h = distance_bound(g, source_index, dest_index);
+}
+
+/*** bidirectional_search() finds a shortest path between source_index and dest_index with a forward search on fwd and a backward search, along the reverse adjacency, on bwd. The side with fewer nodes in OPEN is expanded next, and the search stops once the sum of the minimal keys of both OPEN lists reaches the best connection found so far. On success the path is joined into fwd (see join_bidirectional_path()), so that it can be read exactly like the result of astar_search(). ***/
+bool bidirectional_search (const graph* g, SearchContext* fwd, SearchContext* bwd, unsigned long source_index, unsigned long dest_index, unsigned long* expanded_nodes) {
     
-// store a vector with the indices of the nodes that make up the path
-    unsigned long* path = NULL;
-    if ((path = (unsigned long*) malloc(path_len*sizeof(unsigned long))) == NULL) ExitError("when allocating memory for the path vector", 24);
-    path += path_len - 1;
-    cur_index = dest_index;
-    while (cur_index != source_index) { 
-        *path = cur_index;
-        cur_index = progress[cur_index].parent;
-        path -= 1;
+    reset_search_context(fwd);
+    reset_search_context(bwd);
+    touch_node(fwd, source_index);
+    fwd->progress[source_index].g = 0;
+    fwd->progress[source_index].h = bidirectional_potential(g, source_index, source_index, dest_index);
+    insert_to_OPEN (source_index, fwd->progress, &fwd->OPEN, g, 1, 0, source_index, dest_index);
+    touch_node(bwd, dest_index);
+    bwd->progress[dest_index].g = 0;
+    bwd->progress[dest_index].h = -bidirectional_potential(g, dest_index, source_index, dest_index);
+    insert_to_OPEN (dest_index, bwd->progress, &bwd->OPEN, g, 1, 0, source_index, dest_index);
+    
+    double best = (source_index == dest_index) ? 0 : INFINITY;     // length of the shortest connection found so far
+    unsigned long meeting = source_index;                           // node where that connection joins both searches
+    unsigned long expanded_nodes_counter = 0;
+    while (fwd->OPEN.size > 0 && bwd->OPEN.size > 0) {
+        if (fwd->OPEN.heap[0].f + bwd->OPEN.heap[0].f >= best) break;  // no shorter connection can be found
+        bool forward = fwd->OPEN.size <= bwd->OPEN.size;
+        SearchContext* ctx = forward ? fwd : bwd;
+        SearchContext* other = forward ? bwd : fwd;
+        const uint64_t* first = forward ? g->first : g->rfirst;
+        const edge_target* targets = forward ? g->targets : g->rtargets;
+        const double* weights = forward ? g->weights : g->rweights;
+        const overlay_table* penalties = g->penalties == NULL ? NULL : forward ? &g->penalties->edges : &g->penalties->redges;
+        double sign = forward ? 1 : -1;
+        AStarStatus* progress = ctx->progress;
+        
+        unsigned long cur_index = pop_from_OPEN(&ctx->OPEN, progress);
+        expanded_nodes_counter += 1;
+        if (search_expired(fwd, expanded_nodes_counter)) { *expanded_nodes = expanded_nodes_counter; return false; }
+        TRACE(TRACE_EXPAND, ctx, cur_index);
+        progress[cur_index].whq = 2;
+        fwd->stats.relaxed += first[cur_index+1] - first[cur_index];
+        uint64_t succ_count;
+        for (succ_count = first[cur_index]; succ_count < first[cur_index+1]; succ_count++) {
+            unsigned long succ_index = targets[succ_count];
+            double successor_current_cost = progress[cur_index].g + edge_weight(weights, penalties, succ_count);
+            if ( progress[succ_index].whq == 1 ) {
+                if ( progress[succ_index].g <= successor_current_cost ) continue;
+            }
+            else if ( progress[succ_index].whq == 2 ) continue;
+            else {
+                if ( successor_current_cost == INFINITY ) continue;             // blocked edge, see edge_overlay
+                touch_node(ctx, succ_index);
+                progress[succ_index].h = sign * bidirectional_potential(g, succ_index, source_index, dest_index);
+            }
+            progress[succ_index].g = successor_current_cost;
+            progress[succ_index].parent = cur_index;
+            insert_to_OPEN (succ_index, progress, &ctx->OPEN, g, 1, 0, source_index, dest_index);
+            if (other->progress[succ_index].g + successor_current_cost < best) { // successor has been reached from the other side too
+                best = other->progress[succ_index].g + successor_current_cost;
+                meeting = succ_index;
+            }
+        }
+    }
+    *expanded_nodes = expanded_nodes_counter;
+    if (best == INFINITY) return false;
+    join_bidirectional_path(g, fwd, bwd, meeting, source_index, dest_index);
+    return true;
+}
+
+/*** Parallel bidirectional search (mode 6): the forward and the backward search of bidirectional_search() run at the same time on two threads, the caller's and one started for the query. The searches only share the g values of their progress vectors, the best connection and the minimal key of each OPEN list. A relaxed g is stored, and the g of the other side then loaded, with sequentially consistent atomics, so that for every node labelled by both sides at least one of them sees the label of the other, and the stopping test uses values that can only be stale in the safe direction (a smaller key of the other side, a longer best connection). Both sides stop once their own minimal key plus that of the other side reaches the best connection, which keeps the result optimal. ***/
+typedef struct {
+    const graph* g;
+    SearchContext* side[2];         // forward and backward contexts
+    unsigned long source_index, dest_index;
+    double best;                    // length of the shortest connection found so far (atomic, written under lock)
+    unsigned long meeting;          // node where that connection joins both searches
+    double top[2];                  // minimal key of the OPEN list of each side (atomic), INFINITY once it is empty
+    bool stop;                      // a side has given up at the deadline (atomic)
+    unsigned long expanded[2];
+    pthread_mutex_t lock;           // guards the updates of best and meeting
+} parallel_search;
+
+/*** parallel_side() runs one side of the parallel bidirectional search: d = 0 forwards along the adjacency, d = 1 backwards along the reverse adjacency ***/
+void parallel_side (parallel_search* search, int d) {
+    const graph* g = search->g;
+    SearchContext* ctx = search->side[d];
+    AStarStatus* progress = ctx->progress;
+    AStarStatus* other = search->side[1-d]->progress;
+    const uint64_t* first = d == 0 ? g->first : g->rfirst;
+    const edge_target* targets = d == 0 ? g->targets : g->rtargets;
+    const double* weights = d == 0 ? g->weights : g->rweights;
+    const overlay_table* penalties = g->penalties == NULL ? NULL : d == 0 ? &g->penalties->edges : &g->penalties->redges;
+    double sign = d == 0 ? 1 : -1, key, other_top, best;
+    unsigned long expanded_nodes_counter = 0;
+    while (!__atomic_load_n(&search->stop, __ATOMIC_RELAXED)) {
+        key = (ctx->OPEN.size > 0) ? ctx->OPEN.heap[0].f : INFINITY;
+        __atomic_store(&search->top[d], &key, __ATOMIC_SEQ_CST);
+        __atomic_load(&search->top[1-d], &other_top, __ATOMIC_SEQ_CST);
+        __atomic_load(&search->best, &best, __ATOMIC_SEQ_CST);
+        if (key + other_top >= best) break;                         // no shorter connection can be found (also when this side is empty)
+        
+        unsigned long cur_index = pop_from_OPEN(&ctx->OPEN, progress);
+        expanded_nodes_counter += 1;
+        if (search_expired(ctx, expanded_nodes_counter)) { __atomic_store_n(&search->stop, true, __ATOMIC_RELAXED); break; }
+        TRACE(TRACE_EXPAND, ctx, cur_index);
+        progress[cur_index].whq = 2;
+        ctx->stats.relaxed += first[cur_index+1] - first[cur_index];
+        uint64_t succ_count;
+        for (succ_count = first[cur_index]; succ_count < first[cur_index+1]; succ_count++) {
+            unsigned long succ_index = targets[succ_count];
+            double successor_current_cost = progress[cur_index].g + edge_weight(weights, penalties, succ_count), other_g;
+            if ( progress[succ_index].whq == 1 ) {
+                if ( progress[succ_index].g <= successor_current_cost ) continue;
+            }
+            else if ( progress[succ_index].whq == 2 ) continue;
+            else {
+                if ( successor_current_cost == INFINITY ) continue;             // blocked edge, see edge_overlay
+                touch_node(ctx, succ_index);
+                progress[succ_index].h = sign * bidirectional_potential(g, succ_index, search->source_index, search->dest_index);
+            }
+            __atomic_store(&progress[succ_index].g, &successor_current_cost, __ATOMIC_SEQ_CST);
+            progress[succ_index].parent = cur_index;
+            insert_to_OPEN (succ_index, progress, &ctx->OPEN, g, 1, 0, search->source_index, search->dest_index);
+            __atomic_load(&other[succ_index].g, &other_g, __ATOMIC_SEQ_CST);
+            if (other_g + successor_current_cost < best) {               // successor has been reached from the other side too
+                pthread_mutex_lock(&search->lock);
+                if (other_g + successor_current_cost < search->best) {
+                    double connection = other_g + successor_current_cost;
+                    __atomic_store(&search->best, &connection, __ATOMIC_SEQ_CST);
+                    search->meeting = succ_index;
+                }
+                __atomic_load(&search->best, &best, __ATOMIC_SEQ_CST);
+                pthread_mutex_unlock(&search->lock);
+            }
+        }
+    }
+    search->expanded[d] = expanded_nodes_counter;
+}
+
+void* parallel_backward (void* arg) {
+    parallel_side((parallel_search*) arg, 1);
+    return NULL;
+}
+
+/*** parallel_bidirectional_search() answers the query of bidirectional_search() with both sides running at the same time, see parallel_side(). The backward side runs on a thread created for the query, so the mode pays off on long queries. The deadline of fwd applies to both sides; the statistics of bwd are added to those of fwd by run_search(). On success the path is joined into fwd as in bidirectional_search(). ***/
+bool parallel_bidirectional_search (const graph* g, SearchContext* fwd, SearchContext* bwd, unsigned long source_index, unsigned long dest_index, unsigned long* expanded_nodes) {
+    
+    reset_search_context(fwd);
+    reset_search_context(bwd);
+    bwd->deadline = fwd->deadline;
+    touch_node(fwd, source_index);
+    fwd->progress[source_index].g = 0;
+    fwd->progress[source_index].h = bidirectional_potential(g, source_index, source_index, dest_index);
+    insert_to_OPEN (source_index, fwd->progress, &fwd->OPEN, g, 1, 0, source_index, dest_index);
+    touch_node(bwd, dest_index);
+    bwd->progress[dest_index].g = 0;
+    bwd->progress[dest_index].h = -bidirectional_potential(g, dest_index, source_index, dest_index);
+    insert_to_OPEN (dest_index, bwd->progress, &bwd->OPEN, g, 1, 0, source_index, dest_index);
+    
+    parallel_search search;
+    search.g = g;
+    search.side[0] = fwd;
+    search.side[1] = bwd;
+    search.source_index = source_index;
+    search.dest_index = dest_index;
+    search.best = (source_index == dest_index) ? 0 : INFINITY;
+    search.meeting = source_index;
+    search.top[0] = fwd->OPEN.heap[0].f;
+    search.top[1] = bwd->OPEN.heap[0].f;
+    search.stop = false;
+    search.expanded[0] = search.expanded[1] = 0;
+    pthread_mutex_init(&search.lock, NULL);
+    pthread_t backward;
+    if (pthread_create(&backward, NULL, parallel_backward, &search) != 0) ExitError("when creating the thread of the backward search", 55);
+    parallel_side(&search, 0);
+    pthread_join(backward, NULL);
+    pthread_mutex_destroy(&search.lock);
+    
+    *expanded_nodes = search.expanded[0] + search.expanded[1];
+    if (bwd->expired) fwd->expired = true;
+    if (fwd->expired || search.best == INFINITY) return false;
+    join_bidirectional_path(g, fwd, bwd, search.meeting, source_index, dest_index);
+    return true;
+}
+
+/*** ch_find_edge() returns the edge of the hierarchy between u and v, which is stored with the end of lower rank: in the upward list of u if rank(u) < rank(v), in the downward list of v otherwise. ***/
+const CHEdge* ch_find_edge (const ch_graph* ch, unsigned long u, unsigned long v) {
+    uint64_t k;
+    if (ch->rank[u] < ch->rank[v]) {
+        for (k = ch->up_first[u]; k < ch->up_first[u+1]; k++) if (ch->up[k].node == v) return &ch->up[k];
+    }
+    else {
+        for (k = ch->down_first[v]; k < ch->down_first[v+1]; k++) if (ch->down[k].node == u) return &ch->down[k];
+    }
+    ExitError("the contraction hierarchy is missing an edge of a shortcut", 41);
+    return NULL;
+}
+
+/*** ch_unpack_edge() writes into fwd the original nodes of the hierarchy edge u->v, after u and up to v: every node gets its predecessor as parent and g is accumulated along the original edges, exactly as a forward search along the same path would. Shortcuts are expanded with an explicit stack of edges still to be unpacked, the top being the next one along the path. ***/
+void ch_unpack_edge (const graph* g, SearchContext* fwd, unsigned long u, unsigned long v, unsigned long dest_index, unsigned long** stack, unsigned long* capacity) {
+    const ch_graph* ch = g->ch;
+    AStarStatus* progress = fwd->progress;
+    unsigned long top = 0;
+    (*stack)[top++] = u; (*stack)[top++] = v;
+    while (top > 0) {
+        unsigned long to = (*stack)[--top];
+        unsigned long from = (*stack)[--top];
+        const CHEdge* edge = ch_find_edge(ch, from, to);
+        if (edge->middle == CH_NO_MIDDLE) {
+            if (progress[to].whq == 0 && progress[to].g == INFINITY) touch_node(fwd, to);
+            progress[to].g = progress[from].g + edge->weight;
+            progress[to].parent = from;
+            progress[to].h = heuristic(g, to, dest_index);
+            continue;
+        }
+        if (top + 4 > *capacity) {
+            *capacity *= 2;
+            if ((*stack = (unsigned long*) realloc(*stack, *capacity*sizeof(unsigned long))) == NULL) ExitError("when allocating memory to unpack a path", 42);
+        }
+        (*stack)[top++] = edge->middle; (*stack)[top++] = to;        // second half, unpacked after the first one
+        (*stack)[top++] = from; (*stack)[top++] = edge->middle;
+    }
+}
+
+/*** ch_search() finds a shortest path with the contraction hierarchy attached to g: a forward search from the source along upward edges and a backward search from the destination along downward edges, each stopping once its minimal key reaches the best connection, with stall-on-demand (a node is not expanded if a higher node reached by the same search gives it a shorter distance). The path through the meeting node is then unpacked into fwd with ch_unpack_edge(), so that it can be read exactly like the result of astar_search(). ***/
+bool ch_search (const graph* g, SearchContext* fwd, SearchContext* bwd, unsigned long source_index, unsigned long dest_index, unsigned long* expanded_nodes) {
+    
+    const ch_graph* ch = g->ch;
+    reset_search_context(fwd);
+    reset_search_context(bwd);
+    SearchContext* side[2] = {fwd, bwd};
+    unsigned long start[2] = {source_index, dest_index};
+    int d;
+    for (d = 0; d < 2; d++) {
+        touch_node(side[d], start[d]);
+        side[d]->progress[start[d]].g = 0;
+        side[d]->progress[start[d]].h = 0;
+        insert_to_OPEN (start[d], side[d]->progress, &side[d]->OPEN, g, 1, 0, start[d], start[d]);
+    }
+    double best = INFINITY;
+    unsigned long meeting = source_index;
+    unsigned long expanded_nodes_counter = 0;
+    while (true) {
+        bool can_forward = fwd->OPEN.size > 0 && fwd->OPEN.heap[0].f < best;
+        bool can_backward = bwd->OPEN.size > 0 && bwd->OPEN.heap[0].f < best;
+        if (!can_forward && !can_backward) break;
+        d = (can_forward && (!can_backward || fwd->OPEN.heap[0].f <= bwd->OPEN.heap[0].f)) ? 0 : 1;
+        AStarStatus* progress = side[d]->progress;
+        AStarStatus* other = side[1-d]->progress;
+        const uint64_t* first = d == 0 ? ch->up_first : ch->down_first;           // edges followed by this search
+        const CHEdge* edges = d == 0 ? ch->up : ch->down;
+        const uint64_t* stall_first = d == 0 ? ch->down_first : ch->up_first;     // edges from higher nodes into cur_index for this search
+        const CHEdge* stall_edges = d == 0 ? ch->down : ch->up;
+        
+        unsigned long cur_index = pop_from_OPEN(&side[d]->OPEN, progress);
+        progress[cur_index].whq = 2;
+        expanded_nodes_counter += 1;
+        if (search_expired(fwd, expanded_nodes_counter)) { *expanded_nodes = expanded_nodes_counter; return false; }
+        TRACE(TRACE_EXPAND, side[d], cur_index);
+        if (progress[cur_index].g + other[cur_index].g < best) {
+            best = progress[cur_index].g + other[cur_index].g;
+            meeting = cur_index;
+        }
+        uint64_t k;
+        bool stalled = false;
+        for (k = stall_first[cur_index]; k < stall_first[cur_index+1] && !stalled; k++)
+            if (progress[stall_edges[k].node].g + stall_edges[k].weight < progress[cur_index].g) stalled = true;
+        if (stalled) continue;
+        fwd->stats.relaxed += first[cur_index+1] - first[cur_index];
+        for (k = first[cur_index]; k < first[cur_index+1]; k++) {
+            unsigned long succ_index = edges[k].node;
+            double successor_current_cost = progress[cur_index].g + edges[k].weight;
+            if ( progress[succ_index].whq == 1 ) {
+                if ( progress[succ_index].g <= successor_current_cost ) continue;
+            }
+            else if ( progress[succ_index].whq == 2 ) continue;
+            else {
+                touch_node(side[d], succ_index);
+                progress[succ_index].h = 0;
+            }
+            progress[succ_index].g = successor_current_cost;
+            progress[succ_index].parent = cur_index;
+            insert_to_OPEN (succ_index, progress, &side[d]->OPEN, g, 1, 0, start[d], start[d]);
+        }
+    }
+    *expanded_nodes = expanded_nodes_counter;
+    if (best == INFINITY) return false;
+    
+// nodes of the hierarchy along the path: source ... meeting ... destination
+    unsigned long capacity = 64, hops_capacity = 64, length = 0, cur_index;
+    unsigned long* hops = NULL;
+    unsigned long* stack = NULL;
+    if ((hops = (unsigned long*) malloc(hops_capacity*sizeof(unsigned long))) == NULL ||
+        (stack = (unsigned long*) malloc(capacity*sizeof(unsigned long))) == NULL) ExitError("when allocating memory to unpack a path", 42);
+    for (cur_index = meeting; ; cur_index = fwd->progress[cur_index].parent) {
+        if (length == hops_capacity) {
+            hops_capacity *= 2;
+            if ((hops = (unsigned long*) realloc(hops, hops_capacity*sizeof(unsigned long))) == NULL) ExitError("when allocating memory to unpack a path", 42);
+        }
+        hops[length++] = cur_index;
+        if (cur_index == source_index) break;
+    }
+    unsigned long i;
+    for (i = 0; i < length/2; i++) { unsigned long tmp = hops[i]; hops[i] = hops[length-1-i]; hops[length-1-i] = tmp; }
+    for (cur_index = meeting; cur_index != dest_index; ) {
+        cur_index = bwd->progress[cur_index].parent;                // in the backward search the parent is the next node towards the destination
+        if (length == hops_capacity) {
+            hops_capacity *= 2;
+            if ((hops = (unsigned long*) realloc(hops, hops_capacity*sizeof(unsigned long))) == NULL) ExitError("when allocating memory to unpack a path", 42);
+        }
+        hops[length++] = cur_index;
+    }
+    
+// unpack every edge of the hierarchy into the original path, written into fwd from the source on
+    fwd->progress[source_index].g = 0;
+    fwd->progress[source_index].h = heuristic(g, source_index, dest_index);
+    for (i = 0; i + 1 < length; i++) ch_unpack_edge(g, fwd, hops[i], hops[i+1], dest_index, &stack, &capacity);
+    free(hops);
+    free(stack);
+    return true;
+}
+
+/*** one_to_many_search() runs Dijkstra from source_index until every node of targets is settled and writes the distance to targets[j] in distances[j], INFINITY if it cannot be reached, so that a whole row of a distance matrix costs one search. Targets are flagged in ctx->marks for the duration of the search. It returns the number of settled nodes. ***/
+unsigned long one_to_many_search (const graph* g, SearchContext* ctx, unsigned long source_index, const unsigned long* targets, unsigned long ntargets, double* distances) {
+    
+    if (ctx->marks == NULL && (ctx->marks = (uint8_t*) calloc(ctx->nnodes, sizeof(uint8_t))) == NULL) ExitError("when allocating memory for the target flags", 19);
+    unsigned long j, remaining = 0;                 // distinct targets not settled yet
+    for (j = 0; j < ntargets; j++) if (!ctx->marks[targets[j]]) { ctx->marks[targets[j]] = 1; remaining += 1; }
+    reset_search_context(ctx);
+    AStarStatus* progress = ctx->progress;
+    OpenList* OPEN = &ctx->OPEN;
+    const overlay_table* penalties = g->penalties ? &g->penalties->edges : NULL;
+    touch_node(ctx, source_index);
+    progress[source_index].g = 0;
+    progress[source_index].h = 0;                                               // no heuristic: f = g
+    insert_to_OPEN (source_index, progress, OPEN, g, 1, 0, source_index, source_index);
+    unsigned long settled = 0;
+    while (OPEN->size > 0 && remaining > 0) {
+        unsigned long cur_index = pop_from_OPEN(OPEN, progress);
+        settled += 1;
+        progress[cur_index].whq = 2;
+        if (ctx->marks[cur_index]) remaining -= 1;
+        ctx->stats.relaxed += g->first[cur_index+1] - g->first[cur_index];
+        uint64_t succ_count;
+        for (succ_count = g->first[cur_index]; succ_count < g->first[cur_index+1]; succ_count++) {
+            unsigned long succ_index = g->targets[succ_count];
+            double successor_current_cost = progress[cur_index].g + edge_weight(g->weights, penalties, succ_count);
+            if ( progress[succ_index].whq == 1 ) {
+                if ( progress[succ_index].g <= successor_current_cost ) continue;
+            }
+            else if ( progress[succ_index].whq == 2 ) continue;
+            else {
+                if ( successor_current_cost == INFINITY ) continue;             // blocked edge, see edge_overlay
+                touch_node(ctx, succ_index);
+                progress[succ_index].h = 0;
+            }
+            progress[succ_index].g = successor_current_cost;
+            progress[succ_index].parent = cur_index;
+            insert_to_OPEN (succ_index, progress, OPEN, g, 1, 0, source_index, source_index);
+        }
+    }
+    for (j = 0; j < ntargets; j++) {
+        distances[j] = progress[targets[j]].whq == 2 ? progress[targets[j]].g : INFINITY;
+        ctx->marks[targets[j]] = 0;
+    }
+    return settled;
+}
+
+/*** ch_upward_search() settles the whole search space of start in the contraction hierarchy attached to g: along upward edges (forward) or along downward edges from their lower end (backward, as the backward side of ch_search()), with the same stall-on-demand. On return the nodes in ctx->touched with whq == 2 have been settled and their g is the distance from start (to start if backward) through the hierarchy; for stalled nodes it is only an upper bound, which is enough to combine two search spaces. It returns the number of settled nodes. ***/
+unsigned long ch_upward_search (const graph* g, SearchContext* ctx, unsigned long start, bool forward) {
+    
+    const ch_graph* ch = g->ch;
+    const uint64_t* first = forward ? ch->up_first : ch->down_first;
+    const CHEdge* edges = forward ? ch->up : ch->down;
+    const uint64_t* stall_first = forward ? ch->down_first : ch->up_first;
+    const CHEdge* stall_edges = forward ? ch->down : ch->up;
+    reset_search_context(ctx);
+    AStarStatus* progress = ctx->progress;
+    touch_node(ctx, start);
+    progress[start].g = 0;
+    progress[start].h = 0;
+    insert_to_OPEN (start, progress, &ctx->OPEN, g, 1, 0, start, start);
+    unsigned long settled = 0;
+    while (ctx->OPEN.size > 0) {
+        unsigned long cur_index = pop_from_OPEN(&ctx->OPEN, progress);
+        progress[cur_index].whq = 2;
+        settled += 1;
+        uint64_t k;
+        bool stalled = false;
+        for (k = stall_first[cur_index]; k < stall_first[cur_index+1] && !stalled; k++)
+            if (progress[stall_edges[k].node].g + stall_edges[k].weight < progress[cur_index].g) stalled = true;
+        if (stalled) continue;
+        ctx->stats.relaxed += first[cur_index+1] - first[cur_index];
+        for (k = first[cur_index]; k < first[cur_index+1]; k++) {
+            unsigned long succ_index = edges[k].node;
+            double successor_current_cost = progress[cur_index].g + edges[k].weight;
+            if ( progress[succ_index].whq == 1 ) {
+                if ( progress[succ_index].g <= successor_current_cost ) continue;
+            }
+            else if ( progress[succ_index].whq == 2 ) continue;
+            else {
+                touch_node(ctx, succ_index);
+                progress[succ_index].h = 0;
+            }
+            progress[succ_index].g = successor_current_cost;
+            progress[succ_index].parent = cur_index;
+            insert_to_OPEN (succ_index, progress, &ctx->OPEN, g, 1, 0, start, start);
+        }
+    }
+    return settled;
+}
+
+/*** run_search() answers a query with the chosen evaluation mode: modes 1 to 3 run astar_search() on fwd, mode 4 runs bidirectional_search() on fwd and bwd, mode 5 runs ch_search() on fwd and bwd (it needs a contraction hierarchy attached to g) and mode 6 runs parallel_bidirectional_search() on fwd and bwd. The deadline of fwd applies to all of them; a search that reaches it returns false with fwd->expired set. If g has an edge overlay, the query runs on the snapshot that is current when it starts. In every case the path can then be read from the parent chain of fwd, and the statistics of the query from fwd->stats. ***/
+bool run_search (const graph* g, SearchContext* fwd, SearchContext* bwd, unsigned long source_index, unsigned long dest_index, int evaluation, double param, unsigned long* expanded_nodes) {
+    double start = monotonic_seconds();
+    graph view;
+    overlay_snapshot* snapshot;
+    edge_overlay* overlay = g->overlay;
+    g = pin_overlay(g, &view, &snapshot);                           // the whole query runs on one snapshot of the edge overlay
+    TRACE(TRACE_START, fwd, source_index);
+    bool found;
+    if (evaluation == 4) found = bidirectional_search(g, fwd, bwd, source_index, dest_index, expanded_nodes);
+    else if (evaluation == 6) {
+        found = parallel_bidirectional_search(g, fwd, bwd, source_index, dest_index, expanded_nodes);
+        fwd->stats.relaxed += bwd->stats.relaxed;
+    }
+    else if (evaluation == 5) {
+        if (g->ch == NULL) ExitError("evaluation with contraction hierarchies needs a hierarchy file", 43);
+        found = ch_search(g, fwd, bwd, source_index, dest_index, expanded_nodes);
+    }
+    else found = astar_search(g, fwd, source_index, dest_index, evaluation, param, expanded_nodes);
+    SearchStats* stats = &fwd->stats;
+    stats->seconds = monotonic_seconds() - start;
+    stats->expanded = *expanded_nodes;
+    stats->decrease_keys = fwd->OPEN.decrease_keys;
+    stats->peak_open = fwd->OPEN.peak_size;
+    stats->bytes_allocated = search_context_bytes(fwd);
+    if (evaluation >= 4) {
+        stats->decrease_keys += bwd->OPEN.decrease_keys;
+        stats->peak_open += bwd->OPEN.peak_size;
+        stats->bytes_allocated += search_context_bytes(bwd);
     }
-    if (cur_index == source_index) *path = cur_index;
+    unpin_overlay(overlay, snapshot);
+    TRACE(TRACE_END, fwd, dest_index);
+    return found;
+}
+
+/*** resume_astar_search() answers a mode-1 query from source_index to dest_index on a context that holds an A* search from the same source on the same weights, as left by an earlier call with any destination: the nodes it has closed have their final g, since the chord bound is consistent for every destination, and its OPEN list holds the frontier. If the destination is closed it is answered at once. Otherwise the frontier is re-keyed with the chord bound to the new destination and the search goes on, settling only the nodes a fresh search would settle that are not settled yet. The distance is that of a fresh search; the path is an optimal one, but where several paths tie it may not be the one a fresh search returns, since the parents of settled nodes depend on the destinations the search was resumed for. The destination, once found, is put back in OPEN unexpanded, so that the search can be resumed again. g must have no landmarks (see search_cache). On return the path to the destination has its h for this destination, as after astar_search(). ***/
+bool resume_astar_search (const graph* g, SearchContext* ctx, unsigned long source_index, unsigned long dest_index, unsigned long* expanded_nodes) {
+    AStarStatus* progress = ctx->progress;
+    OpenList* OPEN = &ctx->OPEN;
+    bool found = true;
+    *expanded_nodes = 0;
+    if (progress[dest_index].whq != 2) {
+        unsigned long k, cur_index;
+        for (k = 0; k < OPEN->size; k++) {
+            cur_index = OPEN->heap[k].index;
+            progress[cur_index].h = distance_bound(g, cur_index, dest_index);
+            OPEN->heap[k].f = progress[cur_index].g + progress[cur_index].h;
+        }
+        for (k = OPEN->size / 2; k > 0; k--) open_sift_down(OPEN, progress, k - 1);
+        found = astar_kernel(g, ctx, source_index, dest_index, 1, true, 0, expanded_nodes);
+        if (found) {                                                    // taken out of OPEN but not expanded
+            progress[dest_index].whq = 0;
+            push_to_OPEN(dest_index, progress[dest_index].g + progress[dest_index].h, progress, OPEN);
+        }
+    }
+    if (found) {                                                        // closed nodes keep the h of the destination they were reached for
+        unsigned long cur_index;
+        for (cur_index = dest_index; cur_index != source_index; cur_index = progress[cur_index].parent)
+            progress[cur_index].h = distance_bound(g, cur_index, dest_index);
+        progress[source_index].h = distance_bound(g, source_index, dest_index);
+    }
+    return found;
+}
+
+/*** Search cache: the A* searches of recent sources are kept, each in its own search context, so that a later mode-1 query from the same source resumes the search with resume_astar_search() instead of starting over, and costs no expansion at all if the destination is already settled. Entries are kept while their contexts fit in a memory budget, and evicted least recently used first. Cached searches use the chord bound even if landmarks are loaded, since a landmark bound can close nodes as dead ends for one destination that lead to another. Every entry keeps pinned the snapshot of the edge overlay its search runs on. Entries found on another snapshot than the one of a query are emptied at once, releasing their pin, and are reused before new ones are allocated. The cache can be shared by threads: an entry serves one query at a time, and a query whose source has a busy entry runs without the cache. ***/
+typedef struct {
+    SearchContext ctx;
+    unsigned long source;           // position of the source of the search
+    bool valid;                     // ctx holds a search from source that can be resumed
+    bool busy;                      // a query is running on the entry
+    overlay_snapshot* snapshot;     // snapshot of the edge overlay the search runs on, NULL for the weights of the graph
+    unsigned long last_used;        // clock of the cache when the entry was last taken
+    unsigned long bytes;            // memory of ctx when the entry was last released
+} cached_search;
+
+typedef struct {
+    cached_search** entries;
+    unsigned long nentries, capacity;
+    unsigned long budget;           // bytes the contexts of the entries may take
+    unsigned long bytes;            // bytes they take, as of their last release
+    unsigned long clock;
+    unsigned long hits, misses, bypasses;   // queries resumed, started over and run without the cache
+    pthread_mutex_t lock;           // guards the cache and every entry that is not busy
+} search_cache;
+
+void init_search_cache (search_cache* cache, unsigned long budget) {
+    cache->entries = NULL;
+    cache->nentries = cache->capacity = 0;
+    cache->budget = budget;
+    cache->bytes = 0;
+    cache->clock = 0;
+    cache->hits = cache->misses = cache->bypasses = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+/*** drop_cached_search() removes entry k of the cache and frees it; the cache must be locked and the entry not busy ***/
+void drop_cached_search (search_cache* cache, const graph* g, unsigned long k) {
+    cached_search* entry = cache->entries[k];
+    cache->entries[k] = cache->entries[--cache->nentries];
+    cache->bytes -= entry->bytes;
+    unpin_overlay(g->overlay, entry->snapshot);
+    free_search_context(&entry->ctx);
+    free(entry);
+}
+
+void free_search_cache (search_cache* cache, const graph* g) {
+    while (cache->nentries > 0) drop_cached_search(cache, g, cache->nentries - 1);
+    free(cache->entries);
+    cache->entries = NULL;
+    pthread_mutex_destroy(&cache->lock);
+}
+
+/*** run_cached_search() answers a mode-1 query through the cache: it resumes the search of the entry of source_index if it has one, or starts one in an emptied entry, a new one, or the least recently used one if the budget is spent. It returns the entry, whose context holds the result (found, and the parent chain to dest_index) and the statistics of the query until release_cached_search(). If no entry can be used, because the one of this source is busy or the budget does not hold one search state, it runs the query with run_search() on fwd and bwd and returns NULL. The deadline of fwd applies either way. ***/
+cached_search* run_cached_search (search_cache* cache, const graph* g, SearchContext* fwd, SearchContext* bwd, unsigned long source_index, unsigned long dest_index, bool* found, unsigned long* expanded_nodes) {
+    double start = monotonic_seconds();
+    graph view;
+    overlay_snapshot* snapshot;
+    edge_overlay* overlay = g->overlay;
+    const graph* pinned = pin_overlay(g, &view, &snapshot);
+
+    pthread_mutex_lock(&cache->lock);
+    cached_search *entry = NULL, *idle = NULL, *lru = NULL;
+    bool source_busy = false;
+    unsigned long k;
+    for (k = 0; k < cache->nentries; k++) {
+        cached_search* e = cache->entries[k];
+        if (e->busy) { source_busy |= (e->source == source_index); continue; }
+        if (e->valid && e->snapshot != snapshot) {                  // computed on other costs: release its pin now rather than at eviction
+            unpin_overlay(overlay, e->snapshot);
+            e->snapshot = NULL;
+            e->valid = false;
+        }
+        if (e->valid && e->source == source_index) entry = e;
+        if (!e->valid) idle = e;
+        if (lru == NULL || e->last_used < lru->last_used) lru = e;
+    }
+    bool resume = (entry != NULL);
+    if (entry == NULL && !source_busy) {
+        if (idle != NULL) entry = idle;
+        else if (cache->bytes + g->nnodes*sizeof(AStarStatus) <= cache->budget) {
+            if (cache->nentries == cache->capacity) {
+                cache->capacity = cache->capacity ? 2*cache->capacity : 16;
+                if ((cache->entries = (cached_search**) realloc(cache->entries, cache->capacity*sizeof(cached_search*))) == NULL) ExitError("when allocating memory for the search cache", 62);
+            }
+            if ((entry = (cached_search*) malloc(sizeof(cached_search))) == NULL) ExitError("when allocating memory for the search cache", 62);
+            init_search_context(&entry->ctx, g);
+            entry->valid = false;
+            entry->snapshot = NULL;
+            entry->bytes = search_context_bytes(&entry->ctx);
+            cache->bytes += entry->bytes;
+            cache->entries[cache->nentries++] = entry;
+        }
+        else entry = lru;
+    }
+    if (entry == NULL) {
+        cache->bypasses += 1;
+        pthread_mutex_unlock(&cache->lock);
+        unpin_overlay(overlay, snapshot);
+        *found = run_search(g, fwd, bwd, source_index, dest_index, 1, 0, expanded_nodes);
+        return NULL;
+    }
+    if (resume) cache->hits += 1;
+    else cache->misses += 1;
+    entry->source = source_index;
+    entry->busy = true;
+    entry->last_used = ++cache->clock;
+    pthread_mutex_unlock(&cache->lock);
+
+// start a search from the source, on the snapshot pinned for this query, unless there is one to resume
+    SearchContext* ctx = &entry->ctx;
+    if (resume) unpin_overlay(overlay, snapshot);                   // the entry holds a pin on the same snapshot
+    else {
+        unpin_overlay(overlay, entry->snapshot);
+        entry->snapshot = snapshot;
+        reset_search_context(ctx);
+        touch_node(ctx, source_index);
+        ctx->progress[source_index].g = 0;
+        ctx->progress[source_index].h = 0;
+        push_to_OPEN(source_index, 0, ctx->progress, &ctx->OPEN);
+    }
+    graph chord = *pinned;
+    chord.lm = NULL;
+    memset(&ctx->stats, 0, sizeof(SearchStats));
+    ctx->OPEN.decrease_keys = 0;
+    ctx->OPEN.peak_size = ctx->OPEN.size;
+    ctx->deadline = fwd->deadline;
+    ctx->expired = false;
+    *found = resume_astar_search(&chord, ctx, source_index, dest_index, expanded_nodes);
+    SearchStats* stats = &ctx->stats;
+    stats->seconds = monotonic_seconds() - start;
+    stats->expanded = *expanded_nodes;
+    stats->decrease_keys = ctx->OPEN.decrease_keys;
+    stats->peak_open = ctx->OPEN.peak_size;
+    stats->bytes_allocated = search_context_bytes(ctx);
+    fwd->expired = ctx->expired;
+    return entry;
+}
+
+/*** release_cached_search() gives back an entry returned by run_cached_search() (nothing if entry is NULL) and evicts the least recently used entries while the cache is over its budget, which may include this one. ***/
+void release_cached_search (search_cache* cache, const graph* g, cached_search* entry) {
+    if (entry == NULL) return;
+    pthread_mutex_lock(&cache->lock);
+    entry->busy = false;
+    entry->valid = !entry->ctx.expired;                             // the node taken out of OPEN at the deadline was not expanded
+    cache->bytes -= entry->bytes;
+    entry->bytes = search_context_bytes(&entry->ctx);
+    cache->bytes += entry->bytes;
+    while (cache->bytes > cache->budget) {
+        unsigned long k, victim = cache->nentries;
+        for (k = 0; k < cache->nentries; k++)
+            if (!cache->entries[k]->busy && (victim == cache->nentries || cache->entries[k]->last_used < cache->entries[victim]->last_used)) victim = k;
+        if (victim == cache->nentries) break;
+        drop_cached_search(cache, g, victim);
+    }
+    pthread_mutex_unlock(&cache->lock);
+}
+
+/*** AStar() routes from the node with id source to the node with id dest, checks the path and writes it to the route file (see path_to_file()). Progress is printed with report() and the statistics of the search are returned. ***/
+SearchStats AStar (const graph* g, unsigned long source, unsigned long dest, const char* name, int evaluation, double param) {
+    
+    unsigned long source_index = (unsigned long)find_node(g, source);                                 // find index of source in the graph
+    unsigned long dest_index   = (unsigned long)find_node(g, dest);                                   // find index of destination in the graph
+    
+    report("A* will compute the route:\n");
+    report("\tfrom: ID %lu\tlatitude %.7f\tlongitude %.7f\n", (unsigned long)g->ids[source_index], g->lat[source_index], g->lon[source_index]);
+    report("\tto:   ID %lu\tlatitude %.7f\tlongitude %.7f\n\n", (unsigned long)g->ids[dest_index], g->lat[dest_index], g->lon[dest_index]);
+    
+// the search context stores g, h, parent and queue location for all nodes, and the OPEN list
+    SearchContext ctx, bwd;
+    init_search_context(&ctx, g);
+    if (evaluation >= 4) init_search_context(&bwd, g);                 // the bidirectional and hierarchy searches also need a backward context
+    AStarStatus* progress = ctx.progress;
+    unsigned long expanded_nodes_counter = 0;   // counter of the number of expanded nodes
+    report("Running A*...\n\n");
+    bool found = run_search(g, &ctx, &bwd, source_index, dest_index, evaluation, param, &expanded_nodes_counter);
+    SearchStats stats = ctx.stats;              // wall time and counts of the search
+    if (!found) ExitError("OPEN list is empty before reaching destination", 23);   // destination has not been reached
+    report("A* algorithm has reached the destination node (ID %lu).\n\n", (unsigned long)g->ids[dest_index]);
+
+    report("The optimal %s has been found to be %.5f %s.\n\n", g->profile ? "cost" : "distance", progress[dest_index].g, g->profile ? "min" : "km");
+    report("A* has expanded %lu nodes.\n\n", expanded_nodes_counter);
+    report("A* has relaxed %lu edges, with %lu decrease-keys and at most %lu nodes in OPEN, using %lu bytes of search state.\n\n",
+           stats.relaxed, stats.decrease_keys, stats.peak_open, stats.bytes_allocated);
+    report("The A* loop has taken %.6f seconds to complete.\n\n", stats.seconds);
+       
+// read the path from the parent chain, once
+    PathBuffer path;
+    init_path_buffer(&path);
+    build_path(progress, g->nnodes, source_index, dest_index, &path);
+    report("The computed path has %lu nodes.\n\n", path.length);
     
-// check that the path makes sense: if node v follows node u, then u is in the adjacency list of v.
-    bool check = is_path_correct(path, nodes);
+// check that the path makes sense: if node v follows node u, then v is in the adjacency list of u.
+    bool check = is_path_correct(&path, g, source_index, dest_index);
     if (!check) ExitError("the computed path is not correct", 25);
     
 // write results to a csv file
-    path_to_file(nodes, path, path_len, progress, name, evaluation, param);
+    path_to_file(g, &path, progress, name, evaluation, param);
     
-    free(path);
-    free(progress);
+    free_path_buffer(&path);
+    free_search_context(&ctx);
+    if (evaluation >= 4) free_search_context(&bwd);
+    return stats;
 }
@@ -5,254 +5,1557 @@
 #include <stdbool.h>
 #include <math.h>
 #include <time.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
 
 /*** MACROS ***/
 #define R 6371          // Earth radius in km
 #define pi 4*atan(1)    // pi number
 
-/*** structure to represent a node ***/
+/*** hash table from node id to the position of the node in the graph, used by the converter to resolve the nodes of every way. Open addressing with linear probing; empty slots hold ID_INDEX_EMPTY as position. ***/
+#define ID_INDEX_EMPTY UINT64_MAX
 typedef struct {
-    unsigned long id;           // Node identification
-    unsigned short namelen;     // Length of name in number of characters
-    char* name;                 // Node name (missing for most nodes)
-    double lat, lon;            // Node position
-    unsigned short nsucc;       // Number of node successors; i. e. length of successors
-    unsigned long* successors;  // List of successors
-} node;
-
-/*** memory models and queues for Astar ***/
-typedef char Queue;
+    uint64_t id;
+    uint64_t index;
+} id_slot;
+
+typedef struct {
+    id_slot* slots;
+    uint64_t mask;              // number of slots minus one (a power of two)
+} IdIndex;
+
+/*** Binary graph file: a fixed header followed by contiguous sections, each aligned to GRAPH_ALIGN bytes. Adjacency is stored in CSR form: the successors of node i are targets[first[i]] ... targets[first[i+1]-1]. weights[k] is the length in km of the edge to targets[k] and attrs[k] the road class and maxspeed of its way, so that cost profiles can weigh the edges without converting the map again. The reverse adjacency (rfirst, rtargets, rweights, rattrs) lists for every node the nodes that have it as a successor, for searches that run towards the source. Names are stored the same way in a blob without terminators. The nodes are also indexed by position in a uniform grid of cells over their bounding box (see node_grid), to find the nodes nearest to a point. All values are in native byte order. ***/
+#define GRAPH_MAGIC "ASTARGR"   // 8 bytes including the terminating NUL
+#define GRAPH_VERSION 7
+#define GRAPH_ALIGN 64
+
+/*** Node indices in the adjacency are stored in 32 bits: they are read for every edge relaxed, and the search state limits graphs to fewer than MAX_SEARCH_NODES (2^30) nodes, which write_main and load_graph() enforce, so the upper half of a 64-bit index would always be zero. Edge positions (first, rfirst) stay in 64 bits. ***/
+typedef uint32_t edge_target;
+
+/*** GRAPH_SECTION() places a section of bytes bytes at the next aligned offset and records its position in header->field. It is used by the layout functions of all binary files. ***/
+#define GRAPH_SECTION(field, bytes) \
+    offset = (offset + GRAPH_ALIGN - 1) / GRAPH_ALIGN * GRAPH_ALIGN; header->field = offset; offset += (bytes);
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // sizeof(GraphFileHeader), checked when loading
+    uint64_t nnodes;            // number of nodes
+    uint64_t nedges;            // total number of successors
+    uint64_t nameslen;          // total length of all names
+    uint64_t grid_rows;         // cells of the node grid along the latitude
+    uint64_t grid_cols;         // and along the longitude
+    double grid_min_lat;        // south-west corner of the grid, in degrees
+    double grid_min_lon;
+    double grid_cell_lat;       // size of a cell in degrees
+    double grid_cell_lon;
+    uint64_t ids_offset;        // uint64_t[nnodes]: node ids, in the order of the csv file
+    uint64_t index_ids_offset;  // uint64_t[nnodes+1]: node ids in Eytzinger order (slot 0 unused), to find nodes by id
+    uint64_t index_pos_offset;  // uint64_t[nnodes+1]: position in the graph of the node in the same slot of index_ids
+    uint64_t lat_offset;        // double[nnodes]
+    uint64_t lon_offset;        // double[nnodes]
+    uint64_t unit_offset;       // point3[nnodes]: position of each node on the unit sphere
+    uint64_t first_offset;      // uint64_t[nnodes+1]: position of the first successor of each node in targets
+    uint64_t targets_offset;    // edge_target[nedges]: successor indices
+    uint64_t weights_offset;    // double[nedges]: edge lengths in km
+    uint64_t attrs_offset;      // EdgeAttr[nedges]: road class and maxspeed of the edge to targets[k]
+    uint64_t rfirst_offset;     // uint64_t[nnodes+1]: position of the first predecessor of each node in rtargets
+    uint64_t rtargets_offset;   // edge_target[nedges]: predecessor indices
+    uint64_t rweights_offset;   // double[nedges]: length of the edge from rtargets[k]
+    uint64_t rattrs_offset;     // EdgeAttr[nedges]: road class and maxspeed of the edge from rtargets[k]
+    uint64_t name_first_offset; // uint64_t[nnodes+1]: position of the first character of each name in names
+    uint64_t names_offset;      // char[nameslen]
+    uint64_t grid_first_offset; // uint64_t[grid_rows*grid_cols+1]: position of the first node of each cell in grid_nodes, cells row by row
+    uint64_t grid_nodes_offset; // uint64_t[nnodes]: the nodes of every cell
+    uint64_t file_size;         // total size of the file in bytes
+} GraphFileHeader;
+
+/*** Road classes, from the highway field of the ways (a _link suffix is dropped, so motorway_link is a motorway). Unknown or missing values are ROAD_OTHER. ***/
+enum roadClass {ROAD_OTHER, ROAD_MOTORWAY, ROAD_TRUNK, ROAD_PRIMARY, ROAD_SECONDARY, ROAD_TERTIARY, ROAD_UNCLASSIFIED, ROAD_RESIDENTIAL, ROAD_SERVICE, ROAD_LIVING_STREET, ROAD_CLASSES};
+const char* road_class_names[ROAD_CLASSES] = {"other", "motorway", "trunk", "primary", "secondary", "tertiary", "unclassified", "residential", "service", "living_street"};
+
+/*** attributes of an edge, taken from its way: 2 bytes per edge ***/
+typedef struct {
+    uint8_t road_class;         // enum roadClass
+    uint8_t maxspeed;           // km/h, 0 if unknown (capped at 255)
+} EdgeAttr;
+
+/*** position of a node on the unit sphere: (cos(lat)cos(lon), cos(lat)sin(lon), sin(lat)) ***/
+typedef struct {
+    double x, y, z;
+} point3;
+
+/*** Landmark file (written by landmarks_main): for K landmarks L, the shortest distance from L to every node and from every node to L. The table is stored node by node, so that the 2K distances of a node are contiguous: row v is d(L_0,v) ... d(L_K-1,v), d(v,L_0) ... d(v,L_K-1), in km as floats (INFINITY if there is no path). ***/
+#define LANDMARK_MAGIC "ASTARLM"
+#define LANDMARK_VERSION 1
+#define LANDMARK_SLACK 9.5367431640625e-07  // 2^-20: relative slack that covers the rounding of the distances to float
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // sizeof(LandmarkFileHeader)
+    uint64_t nnodes;            // must match the graph
+    uint64_t nedges;            // must match the graph
+    uint64_t nlandmarks;        // K
+    uint64_t landmarks_offset;  // uint64_t[K]: node index of each landmark
+    uint64_t table_offset;      // float[nnodes*2K]
+    uint64_t file_size;
+} LandmarkFileHeader;
+
+typedef struct {
+    unsigned long nlandmarks;
+    const uint64_t* landmarks;
+    const float* table;
+    void* map;
+    size_t map_size;
+} landmarks;
+
+/*** Contraction hierarchy file (written by ch_main): the rank of every node in the contraction order and the edges of the hierarchy, original or shortcut. up lists, for every node v, the edges v->w with rank(w) > rank(v); down lists, for every node v, the edges u->v with rank(u) > rank(v), storing u. A shortcut replaces the two edges through its middle node, which has a lower rank than both ends; original edges have middle CH_NO_MIDDLE. ***/
+#define CH_MAGIC "ASTARCH"
+#define CH_VERSION 1
+#define CH_NO_MIDDLE UINT64_MAX
+
+typedef struct {
+    uint64_t node;              // other end of the edge
+    uint64_t middle;            // node bypassed by a shortcut, CH_NO_MIDDLE for original edges
+    double weight;              // length in km
+} CHEdge;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;       // sizeof(CHFileHeader)
+    uint64_t nnodes;            // must match the graph
+    uint64_t nedges;            // must match the graph
+    uint64_t nup;               // number of upward edges
+    uint64_t ndown;             // number of downward edges
+    uint64_t rank_offset;       // uint64_t[nnodes]
+    uint64_t up_first_offset;   // uint64_t[nnodes+1]
+    uint64_t up_offset;         // CHEdge[nup]
+    uint64_t down_first_offset; // uint64_t[nnodes+1]
+    uint64_t down_offset;       // CHEdge[ndown]
+    uint64_t file_size;
+} CHFileHeader;
+
+typedef struct {
+    const uint64_t* rank;
+    const uint64_t* up_first;
+    const CHEdge* up;
+    const uint64_t* down_first;
+    const CHEdge* down;
+    void* map;
+    size_t map_size;
+} ch_graph;
+
+/*** Cost profile (a text file read by load_profile()): a speed in km/h for every road class, so that edges cost the minutes it takes to drive them instead of their length. Lines are "<road class> <speed>", with the class names of road_class_names; classes not listed keep the speed of default_road_speeds. A line "maxspeed yes" lowers the speed of every edge to the maxspeed of its way when that is known and lower. Lines starting with # are skipped. ***/
+const double default_road_speeds[ROAD_CLASSES] = {30, 120, 100, 80, 70, 60, 50, 40, 20, 10};
+
+typedef struct {
+    double speed[ROAD_CLASSES]; // km/h, positive
+    bool use_maxspeed;
+    double* weights;            // minutes per edge, in the order of the adjacency of the graph
+    double* rweights;           // the same in the order of the reverse adjacency
+    const double* lengths;      // weights and rweights of the graph before the profile was applied
+    const double* rlengths;
+} cost_profile;
+
+/*** Live edge overlay: changes to the costs of edges while the graph is loaded, for road closures and congestion, without converting the map again. Every edge gets a penalty added to its cost (0 if unchanged, never negative, so that the heuristics stay admissible) or is blocked (penalty INFINITY: the edge is never followed). The weights of the graph are never modified: changes are applied in batches by apply_overlay(), which publishes them as a snapshot, a small immutable hash table from the changed edges to their penalties. A search pins the current snapshot when it starts (see pin_overlay()) and adds its penalties to the weights it reads, so it never sees part of an update, and a snapshot is freed once the last search using it ends. While no edge is changed there is no snapshot and the searches only test a NULL pointer. Patch files (.patch) and the update requests of server_main have one change per line:
+         block <from id> <to id>             the edges from one node to the other cannot be used
+         penalty <from id> <to id> <cost>    the edges cost that much more (in km, or in the unit of the cost profile)
+         clear <from id> <to id>             the edges get their cost back
+         reset                               every edge gets its cost back
+     Edges are directed: a two-way road is closed with a line for each direction. Lines starting with # are skipped. ***/
+enum overlayLine {OVERLAY_SKIP, OVERLAY_EDGE, OVERLAY_RESET};
+
+typedef struct {
+    unsigned long from, to;     // node positions
+    double penalty;             // INFINITY to block the edges, 0 to clear them
+} overlay_change;
+
+#define OVERLAY_EMPTY UINT64_MAX    // edge of a free slot of an overlay table
+
+typedef struct {
+    uint64_t edge;              // position of the edge in the adjacency (or in the reverse adjacency)
+    double penalty;
+} overlay_entry;
+
+typedef struct {
+    overlay_entry* slots;       // open addressing with linear probing, at most half full
+    uint64_t mask;              // number of slots - 1, a power of 2 minus 1
+    unsigned long count;        // edges in the table
+} overlay_table;
+
+typedef struct {
+    overlay_table edges;        // penalties of the changed edges, by position in the adjacency
+    overlay_table redges;       // the same by position in the reverse adjacency
+    unsigned long pins;         // searches running on the snapshot, plus one while it is the current one
+} overlay_snapshot;
+
+typedef struct {
+    bool attached;              // set by attach_overlay(), must start as false
+    unsigned long version;      // number of snapshots published
+    overlay_snapshot* current;  // NULL while no edge is changed
+    pthread_mutex_t update_lock; // serialises the updates
+    pthread_mutex_t pin_lock;   // guards current and the pins of the snapshots
+} edge_overlay;
+
+/*** Uniform grid over the bounding box of the nodes, for nearest-node queries: the nodes of cell (row, col) are nodes[first[c]] ... nodes[first[c+1]-1] with c = row*cols + col, and cell (0, 0) starts at the south-west corner. Cells are sized for about GRID_NODES_PER_CELL nodes each and to be roughly square on the ground. Longitudes do not wrap around at 180 degrees. ***/
+#define GRID_NODES_PER_CELL 2
+
+typedef struct {
+    unsigned long rows, cols;
+    double min_lat, min_lon;    // degrees
+    double cell_lat, cell_lon;  // degrees, positive
+    const uint64_t* first;
+    const uint64_t* nodes;
+} node_grid;
+
+/*** structure to represent the graph while routing. All arrays point into the read-only mapping of the binary file. ***/
+typedef struct {
+    unsigned long nnodes;
+    unsigned long nedges;
+    const uint64_t* ids;
+    const uint64_t* index_ids;  // id index in Eytzinger order, see find_node()
+    const uint64_t* index_pos;
+    const double* lat;
+    const double* lon;
+    const point3* unit;
+    const uint64_t* first;
+    const edge_target* targets;
+    const double* weights;      // edge costs: lengths in km, or the costs of a profile, see load_profile()
+    const EdgeAttr* attrs;
+    const uint64_t* rfirst;
+    const edge_target* rtargets;
+    const double* rweights;
+    const EdgeAttr* rattrs;
+    const uint64_t* name_first;
+    const char* names;
+    node_grid grid;             // spatial index of the nodes, see nearest_nodes()
+    void* map;                  // start of the mapping, NULL if the graph is not mapped
+    size_t map_size;
+    const landmarks* lm;        // landmark distances used to strengthen the heuristic, NULL if none are loaded
+    const ch_graph* ch;         // contraction hierarchy for evaluation mode 5, NULL if none is loaded
+    const cost_profile* profile; // cost profile the weights come from, NULL if they are lengths in km
+    edge_overlay* overlay;      // live changes to the edge costs, NULL if none; searches run on its snapshot, see pin_overlay()
+    const overlay_snapshot* penalties; // snapshot of the overlay pinned for a search, added to the weights; NULL if none
+    double bound_scale;         // cost of the straight line between two points of the unit sphere: R for lengths, less for a profile
+} graph;
+
+/*** memory models and queues for Astar. The search state is packed, since one entry is read or written for every node reached: node positions are 32 bits and the queue flag shares a word with the heap position, so an entry takes 24 bytes. Distances stay in double precision, so results do not change. ***/
+typedef uint32_t node_index;                // position of a node in the graph, in search state
+#define MAX_SEARCH_NODES (1UL << 30)        // limit of the 30-bit heap positions
 enum whichQueue {NONE, OPEN, CLOSED};
 
 typedef struct {
     double g, h;                // Dijkstra and heuristic function, such that f = g + h (minimize f)
-    unsigned long parent;       // position in nodes vector of predecessor node
-    Queue whq;                  // which 
+    node_index parent;          // position in the graph of predecessor node
+    uint32_t heap_pos : 30;     // position of the node in the OPEN heap (only meaningful while the node is in OPEN)
+    uint32_t whq : 2;           // which queue the node is in: 0 none, 1 OPEN, 2 CLOSED
 } AStarStatus;
 
 /*** structure to represent a node in the OPEN list ***/
-typedef struct open_node {
+typedef struct {
     double f;
-    unsigned long index;
-    struct open_node* next;
+    uint32_t stamp;             // insertion order, used to break ties in f
+    node_index index;
 } open_node;
 
+/*** OPEN list: binary min-heap ordered by (f, stamp), indexed through AStarStatus.heap_pos so that keys can be updated in place ***/
+typedef struct {
+    open_node* heap;            // heap[0] is the node with minimal f
+    unsigned long size;         // number of nodes in the OPEN list
+    unsigned long capacity;     // allocated length of heap
+    uint32_t next_stamp;        // stamp given to the next node inserted or updated
+    unsigned long decrease_keys;    // keys updated in place since the last reset
+    unsigned long peak_size;        // largest size since the last reset
+} OpenList;
+
 /*** Standard function to exit with error ***/
 void ExitError(const char *miss, int errcode) {
     fprintf (stderr, "\nERROR: %s.\nStopping...\n\n", miss); exit(errcode);
 }
 
-/*** proces_node(): takes in nodes vector, line from .csv file that is being processed (must be of nodes type) and i position of node in nodes vector. It stores in nodes[i] the id, name, alt and lon. ***/
-void process_node(node* nodes, char* line, unsigned long i) {
-    char* field = NULL;
-    field = strsep(&line, "|");                                              // get first field (node)
-    if (*field != 'n') return;                                               // exit if we are not processing a node line
-    field = strsep(&line, "|");                                              // get second field (id)
-    char* ptr = NULL;                                                        // value of this pointer is set by the strtoul() function
-    nodes[i].id = strtoul(field, &ptr, 10);
-    field = strsep(&line, "|");                                              // get third field (name)
-    nodes[i].namelen = strlen(field);
-    if ((nodes[i].name = (char*) malloc(nodes[i].namelen + 1)) == NULL) ExitError("when allocating memory for a node name", 4);
-    strcpy( nodes[i].name, field );
-    unsigned short count;
-    for (count = 4; count < 11; count++) field = strsep(&line, "|");         // get 10th field (lat)
-    nodes[i].lat = atof(field);
-    field = strsep(&line, "|");                                              // get 11th field (lon)
-    nodes[i].lon = atof(field);
-}
-
-/*** binary_search() returns the position of node with id in vector nodes. Boundary indices are specified, typically low = 0 and high = nnodes. If node with id is not in the nodes vector, function returns -1. ***/
-signed long binary_search(node* nodes, unsigned long id, unsigned long low, unsigned long high) {
-    if ( nodes[low].id == id ) return (signed long)low;
-    if ( nodes[high].id == id ) return (signed long)high;
-    signed long index = (high + low)/2;
-    unsigned long guess = nodes[index].id;
-    while ( (high-low) > 1 ) {
-        if (guess == id) { return index; }
-        if (guess > id) { high = index; }
-        if (guess < id) { low = index; }
-        index = (high + low)/2;
-        guess = nodes[index].id;
-    }
-    return -1;  // return -1 if element is not in vector
-}
-
-/*** update_nsuccs() updates nsuccdim with the information provided in a line (must be of way type) of the .csv file. ***/
-void update_nsuccs(unsigned short* nsuccdim, char* line, node* nodes, unsigned long nnodes) {
-    bool oneway = false;                            // by default, way is bidirectional
-    char* field = strsep(&line, "|");               // read first field of line
-    if (*field != 'w') return;                      // if line is not way: exit
-    unsigned short count;
-    for (count = 2; count < 9; count++) field = strsep(&line, "|");       // get 8th field: oneway                  
-    if (*field == 'o') oneway = true;                // change way to unidirectional if it is so
-    field = strsep(&line, "|");                      // unimportant 9th field
+/*** graph_layout() fills in the section offsets and the file size of a header whose counts (nnodes, nedges, nameslen, grid_rows, grid_cols) are already set. The writer uses it to place the sections and the loader to validate a file. ***/
+void graph_layout(GraphFileHeader* header) {
+    uint64_t offset = sizeof(GraphFileHeader);
+    GRAPH_SECTION(ids_offset,        header->nnodes * sizeof(uint64_t))
+    GRAPH_SECTION(index_ids_offset,  (header->nnodes + 1) * sizeof(uint64_t))
+    GRAPH_SECTION(index_pos_offset,  (header->nnodes + 1) * sizeof(uint64_t))
+    GRAPH_SECTION(lat_offset,        header->nnodes * sizeof(double))
+    GRAPH_SECTION(lon_offset,        header->nnodes * sizeof(double))
+    GRAPH_SECTION(unit_offset,       header->nnodes * sizeof(point3))
+    GRAPH_SECTION(first_offset,      (header->nnodes + 1) * sizeof(uint64_t))
+    GRAPH_SECTION(targets_offset,    header->nedges * sizeof(edge_target))
+    GRAPH_SECTION(weights_offset,    header->nedges * sizeof(double))
+    GRAPH_SECTION(attrs_offset,      header->nedges * sizeof(EdgeAttr))
+    GRAPH_SECTION(rfirst_offset,     (header->nnodes + 1) * sizeof(uint64_t))
+    GRAPH_SECTION(rtargets_offset,   header->nedges * sizeof(edge_target))
+    GRAPH_SECTION(rweights_offset,   header->nedges * sizeof(double))
+    GRAPH_SECTION(rattrs_offset,     header->nedges * sizeof(EdgeAttr))
+    GRAPH_SECTION(name_first_offset, (header->nnodes + 1) * sizeof(uint64_t))
+    GRAPH_SECTION(names_offset,      header->nameslen)
+    GRAPH_SECTION(grid_first_offset, (header->grid_rows * header->grid_cols + 1) * sizeof(uint64_t))
+    GRAPH_SECTION(grid_nodes_offset, header->nnodes * sizeof(uint64_t))
+    header->file_size = offset;
+}
+
+/*** write_section() pads the binary file with zeros up to offset and writes bytes of data there (data may be NULL to only pad). ***/
+void write_section(FILE* fout, uint64_t offset, const void* data, uint64_t bytes) {
+    long position = ftell(fout);
+    if (position < 0 || (uint64_t)position > offset) ExitError("when positioning a section of the output binary data file", 14);
+    for (; (uint64_t)position < offset; position++) if (fputc(0, fout) == EOF) ExitError("when padding the output binary data file", 14);
+    if (bytes > 0 && fwrite(data, 1, bytes, fout) != bytes) ExitError("when writing a section of the output binary data file", 14);
+}
+
+/*** load_graph() maps the binary graph file read-only and sets the arrays of g to point into the mapping. No data is copied, so the graph can be queried right away and the pages are shared between processes mapping the same file. ***/
+void load_graph(const char* filename, graph* g) {
+    int fd;
+    if ((fd = open(filename, O_RDONLY)) < 0) ExitError("the data file does not exist or cannot be opened", 1);
+    struct stat st;
+    if (fstat(fd, &st) != 0) ExitError("when reading the size of the binary data file", 2);
+    if ((size_t)st.st_size < sizeof(GraphFileHeader)) ExitError("the binary data file is too short to be a graph file", 2);
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) ExitError("when mapping the binary data file", 3);
+    close(fd);
+    
+// Check that the header describes this file
+    const GraphFileHeader* stored = (const GraphFileHeader*) map;
+    if (memcmp(stored->magic, GRAPH_MAGIC, sizeof(stored->magic)) != 0) ExitError("the data file is not a graph file (wrong magic)", 2);
+    if (stored->version != GRAPH_VERSION || stored->header_size != sizeof(GraphFileHeader)) ExitError("the graph file version is not supported; rebuild it with write_main", 2);
+    GraphFileHeader expected = *stored;
+    graph_layout(&expected);
+    if (memcmp(&expected, stored, sizeof(GraphFileHeader)) != 0 || expected.file_size != (uint64_t)st.st_size)
+        ExitError("the header of the binary data file is inconsistent with its size", 2);
+    if (stored->nnodes >= MAX_SEARCH_NODES) ExitError("the graph file has too many nodes for the search state", 2);
+    
+    const char* base = (const char*) map;
+    g->nnodes     = stored->nnodes;
+    g->nedges     = stored->nedges;
+    g->ids        = (const uint64_t*) (base + stored->ids_offset);
+    g->index_ids  = (const uint64_t*) (base + stored->index_ids_offset);
+    g->index_pos  = (const uint64_t*) (base + stored->index_pos_offset);
+    g->lat        = (const double*)   (base + stored->lat_offset);
+    g->lon        = (const double*)   (base + stored->lon_offset);
+    g->unit       = (const point3*)   (base + stored->unit_offset);
+    g->first      = (const uint64_t*) (base + stored->first_offset);
+    g->targets    = (const edge_target*) (base + stored->targets_offset);
+    g->weights    = (const double*)   (base + stored->weights_offset);
+    g->attrs      = (const EdgeAttr*) (base + stored->attrs_offset);
+    g->rfirst     = (const uint64_t*) (base + stored->rfirst_offset);
+    g->rtargets   = (const edge_target*) (base + stored->rtargets_offset);
+    g->rweights   = (const double*)   (base + stored->rweights_offset);
+    g->rattrs     = (const EdgeAttr*) (base + stored->rattrs_offset);
+    g->name_first = (const uint64_t*) (base + stored->name_first_offset);
+    g->names      = base + stored->names_offset;
+    g->grid.rows     = stored->grid_rows;
+    g->grid.cols     = stored->grid_cols;
+    g->grid.min_lat  = stored->grid_min_lat;
+    g->grid.min_lon  = stored->grid_min_lon;
+    g->grid.cell_lat = stored->grid_cell_lat;
+    g->grid.cell_lon = stored->grid_cell_lon;
+    g->grid.first    = (const uint64_t*) (base + stored->grid_first_offset);
+    g->grid.nodes    = (const uint64_t*) (base + stored->grid_nodes_offset);
+    g->map        = map;
+    g->map_size   = (size_t)st.st_size;
+    g->lm         = NULL;
+    g->ch         = NULL;
+    g->profile    = NULL;
+    g->overlay    = NULL;
+    g->penalties  = NULL;
+    g->bound_scale = R;
+    if (g->nnodes == 0 || g->first[g->nnodes] != g->nedges || g->rfirst[g->nnodes] != g->nedges || g->name_first[g->nnodes] != stored->nameslen ||
+        g->grid.rows == 0 || g->grid.cols == 0 || !(g->grid.cell_lat > 0) || !(g->grid.cell_lon > 0) || g->grid.first[g->grid.rows * g->grid.cols] != g->nnodes)
+        ExitError("the binary data file is corrupted", 2);
+}
+
+void unload_graph(graph* g) {
+    if (g->map != NULL) munmap(g->map, g->map_size);
+    g->map = NULL;
+}
+
+/*** landmark_layout() fills in the section offsets and the file size of a landmark file header whose counts are already set. ***/
+void landmark_layout(LandmarkFileHeader* header) {
+    uint64_t offset = sizeof(LandmarkFileHeader);
+    GRAPH_SECTION(landmarks_offset, header->nlandmarks * sizeof(uint64_t))
+    GRAPH_SECTION(table_offset,     header->nnodes * 2 * header->nlandmarks * sizeof(float))
+    header->file_size = offset;
+}
+
+/*** load_landmarks() maps a landmark file read-only and attaches it to the graph it was computed for, so that the heuristic of every search on g uses it. ***/
+void load_landmarks(const char* filename, graph* g, landmarks* lm) {
+    int fd;
+    if ((fd = open(filename, O_RDONLY)) < 0) ExitError("the landmark file does not exist or cannot be opened", 35);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(LandmarkFileHeader)) ExitError("the landmark file is too short", 36);
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) ExitError("when mapping the landmark file", 37);
+    close(fd);
+    
+    const LandmarkFileHeader* stored = (const LandmarkFileHeader*) map;
+    if (memcmp(stored->magic, LANDMARK_MAGIC, sizeof(stored->magic)) != 0) ExitError("the landmark file has a wrong magic", 36);
+    if (stored->version != LANDMARK_VERSION || stored->header_size != sizeof(LandmarkFileHeader)) ExitError("the landmark file version is not supported; rebuild it with landmarks_main", 36);
+    if (stored->nnodes != g->nnodes || stored->nedges != g->nedges) ExitError("the landmark file was computed for a different graph", 36);
+    if (g->profile != NULL) ExitError("landmark distances are in km and cannot be used with a cost profile", 53);
+    LandmarkFileHeader expected = *stored;
+    landmark_layout(&expected);
+    if (memcmp(&expected, stored, sizeof(LandmarkFileHeader)) != 0 || expected.file_size != (uint64_t)st.st_size || stored->nlandmarks == 0)
+        ExitError("the header of the landmark file is inconsistent with its size", 36);
+    
+    lm->nlandmarks = stored->nlandmarks;
+    lm->landmarks  = (const uint64_t*) ((const char*) map + stored->landmarks_offset);
+    lm->table      = (const float*)    ((const char*) map + stored->table_offset);
+    lm->map        = map;
+    lm->map_size   = (size_t)st.st_size;
+    g->lm          = lm;
+}
+
+void unload_landmarks(graph* g, landmarks* lm) {
+    if (lm->map != NULL) munmap(lm->map, lm->map_size);
+    lm->map = NULL;
+    if (g->lm == lm) g->lm = NULL;
+}
+
+/*** ch_layout() fills in the section offsets and the file size of a contraction hierarchy file header whose counts are already set. ***/
+void ch_layout(CHFileHeader* header) {
+    uint64_t offset = sizeof(CHFileHeader);
+    GRAPH_SECTION(rank_offset,       header->nnodes * sizeof(uint64_t))
+    GRAPH_SECTION(up_first_offset,   (header->nnodes + 1) * sizeof(uint64_t))
+    GRAPH_SECTION(up_offset,         header->nup * sizeof(CHEdge))
+    GRAPH_SECTION(down_first_offset, (header->nnodes + 1) * sizeof(uint64_t))
+    GRAPH_SECTION(down_offset,       header->ndown * sizeof(CHEdge))
+    header->file_size = offset;
+}
+
+/*** load_ch() maps a contraction hierarchy file read-only and attaches it to the graph it was computed for. ***/
+void load_ch(const char* filename, graph* g, ch_graph* ch) {
+    int fd;
+    if ((fd = open(filename, O_RDONLY)) < 0) ExitError("the contraction hierarchy file does not exist or cannot be opened", 38);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CHFileHeader)) ExitError("the contraction hierarchy file is too short", 39);
+    void* map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) ExitError("when mapping the contraction hierarchy file", 40);
+    close(fd);
     
-    char* ptr = NULL;                                // value of this pointer is set by the strtoul() function
-    char* node_n = NULL;                             // string read from line of first node
-    char* node_m = NULL;                             // string read from line of second node
-    unsigned long id_n, id_m;                        // id's of first and second node
-    signed long n = -1, m;                           // position of first and second node in nodes vector
-    while ((n == -1) && ((node_n = strsep(&line, "|")) != NULL)) { // start to read line from a node that is in the nodes vector
-        id_n = strtoul(node_n, &ptr, 10);
-        n = binary_search(nodes, id_n, 0, nnodes-1);
-    }
-    while ((node_m = strsep(&line, "|")) != NULL) {  // read next node
-        id_m = strtoul(node_m, &ptr, 10);
-        m = binary_search(nodes, id_m, 0, nnodes-1);
-        if (m == -1) continue;                       // if adjacent node not in nodes vector -> get a new one
-        if (oneway == true) nsuccdim[n] += 1;
-        else { nsuccdim[n] += 1; nsuccdim[m] += 1; }
-        n = m;                                       // move on to next pair of adjacent nodes
-    }
-}
-
-/*** update_successors() reads a line of type way from the .csv file and updates the adjacency list accordingly. ***/
-void update_successors(char* line, node* nodes, unsigned long nnodes, unsigned short* counters) {
-    bool oneway = false;                            // by default, way is bidirectional
-    char* field = strsep(&line, "|");               // read first field of line
-    if (*field != 'w') return;                      // if line is not way: exit
-    unsigned short count;
-    for (count = 2; count < 9; count++) field = strsep(&line, "|");       // get 8th field: oneway                  
-    if (*field == 'o') oneway = true;                // change way to unidirectional if it is so
-    field = strsep(&line, "|");                      // unimportant 9th field
+    const CHFileHeader* stored = (const CHFileHeader*) map;
+    if (memcmp(stored->magic, CH_MAGIC, sizeof(stored->magic)) != 0) ExitError("the contraction hierarchy file has a wrong magic", 39);
+    if (stored->version != CH_VERSION || stored->header_size != sizeof(CHFileHeader)) ExitError("the contraction hierarchy file version is not supported; rebuild it with ch_main", 39);
+    if (stored->nnodes != g->nnodes || stored->nedges != g->nedges) ExitError("the contraction hierarchy file was computed for a different graph", 39);
+    if (g->profile != NULL) ExitError("the contraction hierarchy is built on lengths in km and cannot be used with a cost profile", 53);
+    if (g->overlay != NULL) ExitError("the contraction hierarchy is built on the costs of the map and cannot be used with an edge overlay", 58);
+    CHFileHeader expected = *stored;
+    ch_layout(&expected);
+    if (memcmp(&expected, stored, sizeof(CHFileHeader)) != 0 || expected.file_size != (uint64_t)st.st_size)
+        ExitError("the header of the contraction hierarchy file is inconsistent with its size", 39);
     
-    char* ptr = NULL;                                // value of this pointer is set by the strtoul() function
-    char* node_n = NULL;                             // string read from line of first node
-    char* node_m = NULL;                             // string read from line of second node
-    unsigned long id_n, id_m;                        // id's of first and second node
-    signed long n = -1, m;                           // position of first and second node in nodes vector
-    while ((n == -1) && ((node_n = strsep(&line, "|")) != NULL)) { // start to read line from a node that is in the nodes vector
-        id_n = strtoul(node_n, &ptr, 10);
-        n = binary_search(nodes, id_n, 0, nnodes-1);
-    }
-    unsigned short free_n, free_m;                   // position of first free successor nodes in the adjacency list of each node
-    while ((node_m = strsep(&line, "|")) != NULL) {  // read another node
-        id_m = strtoul(node_m, &ptr, 10);
-        m = binary_search(nodes, id_m, 0, nnodes-1);
-        if (m == -1) continue;                        // if adjacent node not in nodes vector -> get a new one
-        free_n = counters[n];                         // find free spot for successor of node_n
-        free_m = counters[m];                         // find free spot for successor of node_m 
-        if (oneway == true) { (nodes[n].successors)[free_n] = m;  counters[n] += 1; } // write successor  m(n) in adjacency list of n(m)
-        else {                                                                        // and increase the counters to next position in adjacency list
-            (nodes[n].successors)[free_n] = m;    counters[n] += 1;
-            (nodes[m].successors)[free_m] = n;    counters[m] += 1;
+    const char* base = (const char*) map;
+    ch->rank       = (const uint64_t*) (base + stored->rank_offset);
+    ch->up_first   = (const uint64_t*) (base + stored->up_first_offset);
+    ch->up         = (const CHEdge*)   (base + stored->up_offset);
+    ch->down_first = (const uint64_t*) (base + stored->down_first_offset);
+    ch->down       = (const CHEdge*)   (base + stored->down_offset);
+    ch->map        = map;
+    ch->map_size   = (size_t)st.st_size;
+    if (ch->up_first[g->nnodes] != stored->nup || ch->down_first[g->nnodes] != stored->ndown) ExitError("the contraction hierarchy file is corrupted", 39);
+    g->ch          = ch;
+}
+
+void unload_ch(graph* g, ch_graph* ch) {
+    if (ch->map != NULL) munmap(ch->map, ch->map_size);
+    ch->map = NULL;
+    if (g->ch == ch) g->ch = NULL;
+}
+
+/*** road_class_by_name() is the road class called name (of the given length), or -1 if there is none ***/
+signed int road_class_by_name(const char* name, size_t length) {
+    signed int c;
+    for (c = 0; c < ROAD_CLASSES; c++)
+        if (strlen(road_class_names[c]) == length && memcmp(road_class_names[c], name, length) == 0) return c;
+    return -1;
+}
+
+/*** profile_speed() is the speed in km/h of an edge with attributes attr under a profile ***/
+double profile_speed(const cost_profile* profile, EdgeAttr attr) {
+    double speed = profile->speed[attr.road_class < ROAD_CLASSES ? attr.road_class : ROAD_OTHER];
+    if (profile->use_maxspeed && attr.maxspeed > 0 && attr.maxspeed < speed) speed = attr.maxspeed;
+    return speed;
+}
+
+/*** load_profile() reads a cost profile and applies it to g: the cost of every edge, in minutes, is computed once into weights arrays of the profile, which replace those of the graph, so searches run exactly as fast as on lengths. bound_scale becomes R times the cost of a km at the highest speed of any edge, so that distance_bound() stays a lower bound on costs and the heuristics stay admissible. Landmarks and hierarchies are computed on lengths and cannot be combined with a profile. To route with several profiles at once, apply each one to its own copy of the graph structure (the mapping is shared). ***/
+void load_profile(const char* filename, graph* g, cost_profile* profile) {
+    FILE* fin;
+    if ((fin = fopen(filename, "r")) == NULL) ExitError("the cost profile does not exist or cannot be opened", 51);
+    if (g->attrs == NULL) ExitError("the graph has no edge attributes to apply a cost profile to", 52);
+    if (g->lm != NULL || g->ch != NULL || g->profile != NULL) ExitError("a cost profile cannot be combined with landmarks, a contraction hierarchy or another profile", 53);
+    if (g->overlay != NULL) ExitError("a cost profile must be loaded before the edge overlay", 53);
+    memcpy(profile->speed, default_road_speeds, sizeof(profile->speed));
+    profile->use_maxspeed = false;
+    char* line_buf = NULL;
+    size_t line_buf_size = 0;
+    while (getline(&line_buf, &line_buf_size, fin) >= 0) {
+        char key[64], value[64] = "";
+        if (*line_buf == '#' || sscanf(line_buf, "%63s %63s", key, value) < 1) continue;
+        if (strcmp(key, "maxspeed") == 0) {
+            profile->use_maxspeed = (strcmp(value, "yes") == 0);
+            continue;
+        }
+        signed int c = road_class_by_name(key, strlen(key));
+        char* end;
+        double speed = strtod(value, &end);
+        if (c < 0 || end == value || !(speed > 0)) {
+            fprintf(stderr, "Cost profile line: %s", line_buf);
+            ExitError("the cost profile has a line that is not a road class with a positive speed", 52);
+        }
+        profile->speed[c] = speed;
+    }
+    fclose(fin);
+    free(line_buf);
+
+    if ((profile->weights = (double*) malloc((g->nedges > 0 ? g->nedges : 1)*sizeof(double))) == NULL ||
+        (profile->rweights = (double*) malloc((g->nedges > 0 ? g->nedges : 1)*sizeof(double))) == NULL) ExitError("when allocating memory for a cost profile", 54);
+    double fastest = 0;
+    unsigned long e;
+    for (e = 0; e < g->nedges; e++) {
+        double speed = profile_speed(profile, g->attrs[e]);
+        profile->weights[e] = g->weights[e] * 60 / speed;
+        profile->rweights[e] = g->rweights[e] * 60 / profile_speed(profile, g->rattrs[e]);
+        if (speed > fastest) fastest = speed;
+    }
+    profile->lengths = g->weights;
+    profile->rlengths = g->rweights;
+    g->weights = profile->weights;
+    g->rweights = profile->rweights;
+    g->bound_scale = (fastest > 0) ? R * 60 / fastest : 0;
+    g->profile = profile;
+}
+
+/*** unload_profile() gives g its lengths back; profile must start emptied by init_extras(), so that it can always be called ***/
+void unload_profile(graph* g, cost_profile* profile) {
+    if (g->profile == profile) {
+        g->weights = profile->lengths;
+        g->rweights = profile->rlengths;
+        g->bound_scale = R;
+        g->profile = NULL;
+    }
+    free(profile->weights);
+    free(profile->rweights);
+    profile->weights = profile->rweights = NULL;
+}
+
+/*** init_id_index() allocates a table for n nodes, at most half full so that probe sequences stay short ***/
+void init_id_index(IdIndex* index, uint64_t n) {
+    uint64_t nslots = 16;
+    while (nslots < 2*n) nslots *= 2;
+    if ((index->slots = (id_slot*) malloc(nslots*sizeof(id_slot))) == NULL) ExitError("when allocating memory for the node id index", 15);
+    uint64_t k;
+    for (k = 0; k < nslots; k++) index->slots[k].index = ID_INDEX_EMPTY;
+    index->mask = nslots - 1;
+}
+
+void free_id_index(IdIndex* index) {
+    free(index->slots);
+    index->slots = NULL;
+}
+
+uint64_t id_hash(uint64_t id) {
+    return (id * 0x9E3779B97F4A7C15ULL) ^ (id >> 29);
+}
+
+/*** id_index_insert() stores the position of node id; if the id is already present the first position is kept ***/
+void id_index_insert(IdIndex* index, uint64_t id, uint64_t position) {
+    uint64_t k = id_hash(id) & index->mask;
+    while (index->slots[k].index != ID_INDEX_EMPTY) {
+        if (index->slots[k].id == id) return;
+        k = (k + 1) & index->mask;
+    }
+    index->slots[k].id = id;
+    index->slots[k].index = position;
+}
+
+/*** id_index_find() returns the position of node id, or -1 if there is no such node ***/
+signed long id_index_find(const IdIndex* index, uint64_t id) {
+    uint64_t k = id_hash(id) & index->mask;
+    while (index->slots[k].index != ID_INDEX_EMPTY) {
+        if (index->slots[k].id == id) return (signed long)index->slots[k].index;
+        k = (k + 1) & index->mask;
+    }
+    return -1;
+}
+
+/*** next_csv_field() returns the start of the field after the one at p in a line that ends at end (end itself if there is none) ***/
+const char* next_csv_field(const char* p, const char* end) {
+    const char* bar = (const char*) memchr(p, '|', end - p);
+    return bar == NULL ? end : bar + 1;
+}
+
+/*** csv_field_length() is the length of the field at p, which ends at the next '|' or at the end of the line ***/
+size_t csv_field_length(const char* p, const char* end) {
+    const char* bar = (const char*) memchr(p, '|', end - p);
+    return (bar == NULL ? end : bar) - p;
+}
+
+/*** parse_csv_id() reads the id in the field at p as strtoul() would: leading white space, then decimal digits (0 if there are none) ***/
+uint64_t parse_csv_id(const char* p, const char* end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n')) p++;
+    uint64_t id = 0;
+    while (p < end && *p >= '0' && *p <= '9') id = 10*id + (uint64_t)(*p++ - '0');
+    return id;
+}
+
+/*** parse_csv_double() reads the number in the field at p with atof(), from a terminated copy so that it never reads past end ***/
+double parse_csv_double(const char* p, const char* end) {
+    char buffer[64];
+    size_t length = csv_field_length(p, end);
+    if (length > sizeof(buffer) - 1) length = sizeof(buffer) - 1;
+    memcpy(buffer, p, length);
+    buffer[length] = '\0';
+    return atof(buffer);
+}
+
+/*** parse_road_class() reads the highway field at p as a road class, ROAD_OTHER if it is not one of road_class_names ***/
+uint8_t parse_road_class(const char* p, const char* end) {
+    size_t length = csv_field_length(p, end);
+    if (length > 5 && memcmp(p + length - 5, "_link", 5) == 0) length -= 5;
+    signed int c = road_class_by_name(p, length);
+    return (uint8_t)(c < 0 ? ROAD_OTHER : c);
+}
+
+/*** parse_maxspeed() reads the maxspeed field at p in km/h: its leading number, converted if it is followed by mph, and 0 if there is none ***/
+uint8_t parse_maxspeed(const char* p, const char* end) {
+    size_t length = csv_field_length(p, end), k = 0;
+    unsigned long speed = 0;
+    while (k < length && p[k] >= '0' && p[k] <= '9' && speed < 1000) speed = 10*speed + (unsigned long)(p[k++] - '0');
+    while (k < length && p[k] == ' ') k++;
+    if (k + 3 <= length && memcmp(p + k, "mph", 3) == 0) speed = (unsigned long)(speed * 1.609344 + 0.5);
+    return (uint8_t)(speed > 255 ? 255 : speed);
+}
+
+/*** Node id index: the ids sorted increasingly are laid out as an implicit binary search tree in breadth-first (Eytzinger) order, the root in slot 1 and the children of slot k in slots 2k and 2k+1. A search goes down one level per step without branches, and the first levels stay in cache; index_pos gives the position in the graph of the node in every slot. ***/
+#define ID_LOOKUP_BATCH 16      // lookups interleaved by find_nodes()
+
+/*** eytzinger_fill() places sorted[*next] ... in the subtree rooted at slot k of tree, in order ***/
+void eytzinger_fill(const id_slot* sorted, uint64_t n, uint64_t k, uint64_t* next, uint64_t* tree_ids, uint64_t* tree_pos) {
+    if (k > n) return;
+    eytzinger_fill(sorted, n, 2*k, next, tree_ids, tree_pos);
+    tree_ids[k] = sorted[*next].id;
+    tree_pos[k] = sorted[*next].index;
+    *next += 1;
+    eytzinger_fill(sorted, n, 2*k + 1, next, tree_ids, tree_pos);
+}
+
+int compare_id_slots(const void* a, const void* b) {
+    const id_slot* u = (const id_slot*) a;
+    const id_slot* v = (const id_slot*) b;
+    if (u->id != v->id) return u->id < v->id ? -1 : 1;
+    return u->index < v->index ? -1 : (u->index > v->index);
+}
+
+/*** build_id_index() fills tree_ids and tree_pos (n+1 elements each) with the index of the n ids of a graph, given in graph order. If an id is repeated the first node with it is found. ***/
+void build_id_index(const uint64_t* ids, uint64_t n, uint64_t* tree_ids, uint64_t* tree_pos) {
+    id_slot* sorted = NULL;
+    if ((sorted = (id_slot*) malloc((n > 0 ? n : 1)*sizeof(id_slot))) == NULL) ExitError("when allocating memory for the node id index", 15);
+    uint64_t i, next = 0;
+    bool in_order = true;
+    for (i = 0; i < n; i++) {
+        sorted[i].id = ids[i];
+        sorted[i].index = i;
+        if (i > 0 && ids[i] <= ids[i-1]) in_order = false;
+    }
+    if (!in_order) qsort(sorted, n, sizeof(id_slot), compare_id_slots);    // osm files are usually sorted already
+    tree_ids[0] = 0;
+    tree_pos[0] = 0;
+    eytzinger_fill(sorted, n, 1, &next, tree_ids, tree_pos);
+    free(sorted);
+}
+
+/*** eytzinger_position() finishes a search that ended at slot k (past the leaves): the last step to the left marks the first id not smaller than the one searched, which is then checked for equality ***/
+signed long eytzinger_position(const graph* g, uint64_t k, uint64_t id) {
+    k >>= __builtin_ffsll((long long)~k);
+    if (k == 0 || g->index_ids[k] != id) return -1;
+    return (signed long)g->index_pos[k];
+}
+
+/*** find_node() returns the position of node with id in the graph, or -1 if there is no such node. ***/
+signed long find_node(const graph* g, unsigned long id) {
+    const uint64_t* keys = g->index_ids;
+    uint64_t k = 1;
+    while (k <= g->nnodes) {
+        __builtin_prefetch(keys + 8*k);                     // the line with the descendants three levels down
+        k = 2*k + (keys[k] < id);
+    }
+    return eytzinger_position(g, k, id);
+}
+
+/*** find_nodes() resolves count ids at once into positions (-1 for unknown ids). Groups of ID_LOOKUP_BATCH searches go down the tree in lockstep, so that the cache misses of different searches overlap instead of being paid one after the other. ***/
+void find_nodes(const graph* g, const uint64_t* ids, signed long* positions, unsigned long count) {
+    const uint64_t* keys = g->index_ids;
+    uint64_t k[ID_LOOKUP_BATCH];
+    unsigned long base, lanes, j;
+    for (base = 0; base < count; base += ID_LOOKUP_BATCH) {
+        lanes = (count - base < ID_LOOKUP_BATCH) ? count - base : ID_LOOKUP_BATCH;
+        for (j = 0; j < lanes; j++) k[j] = 1;
+        bool active = true;
+        while (active) {
+            active = false;
+            for (j = 0; j < lanes; j++) {
+                if (k[j] > g->nnodes) continue;
+                k[j] = 2*k[j] + (keys[k[j]] < ids[base+j]);
+                __builtin_prefetch(keys + 8*k[j]);
+                active = true;
+            }
+        }
+        for (j = 0; j < lanes; j++) positions[base+j] = eytzinger_position(g, k[j], ids[base+j]);
+    }
+}
+
+/*** init_overlay_table() makes t an empty table with room for n edges ***/
+void init_overlay_table(overlay_table* t, unsigned long n) {
+    uint64_t nslots = 8, k;
+    while (nslots < 2*(uint64_t)n) nslots *= 2;
+    if ((t->slots = (overlay_entry*) malloc(nslots*sizeof(overlay_entry))) == NULL) ExitError("when allocating memory for an edge overlay", 59);
+    for (k = 0; k < nslots; k++) t->slots[k].edge = OVERLAY_EMPTY;
+    t->mask = nslots - 1;
+    t->count = 0;
+}
+
+/*** overlay_table_set() sets the penalty of an edge, adding it to t if it is not there yet; t must have room for it ***/
+void overlay_table_set(overlay_table* t, uint64_t edge, double penalty) {
+    uint64_t k = id_hash(edge) & t->mask;
+    while (t->slots[k].edge != OVERLAY_EMPTY && t->slots[k].edge != edge) k = (k + 1) & t->mask;
+    if (t->slots[k].edge == OVERLAY_EMPTY) t->count += 1;
+    t->slots[k].edge = edge;
+    t->slots[k].penalty = penalty;
+}
+
+/*** overlay_table_copy() sets in t the edges of from that have a penalty, and returns how many there are ***/
+unsigned long overlay_table_copy(overlay_table* t, const overlay_table* from) {
+    unsigned long copied = 0;
+    uint64_t k;
+    for (k = 0; k <= from->mask; k++)
+        if (from->slots[k].edge != OVERLAY_EMPTY && from->slots[k].penalty != 0) {
+            if (t != NULL) overlay_table_set(t, from->slots[k].edge, from->slots[k].penalty);
+            copied += 1;
         }
-        n = m;                                        // move on to next pair of adjacent nodes
+    return copied;
+}
+
+/*** overlay_penalty() is the penalty of an edge in t, 0 if it is not changed ***/
+double overlay_penalty(const overlay_table* t, uint64_t edge) {
+    uint64_t k = id_hash(edge) & t->mask;
+    while (t->slots[k].edge != OVERLAY_EMPTY) {
+        if (t->slots[k].edge == edge) return t->slots[k].penalty;
+        k = (k + 1) & t->mask;
     }
+    return 0;
+}
+
+/*** edge_weight() is the cost of edge e with its penalty, for the weights of one direction of the adjacency and the matching table of the pinned snapshot (NULL if there is none) ***/
+static inline double edge_weight(const double* weights, const overlay_table* penalties, uint64_t e) {
+    return penalties == NULL ? weights[e] : weights[e] + overlay_penalty(penalties, e);
 }
 
-/*** Haversine distance: great-circle distance between two points. ***/
-double haversine (node u, node v) {
-    double diff_lat = (u.lat - v.lat) * pi / 180.f;
-    double diff_lon = (u.lon - v.lon) * pi / 180.f;
-    double a = pow(sin(diff_lat/2), 2) + cos(u.lat * pi / 180.f) * cos(v.lat * pi / 180.f) * pow(sin(diff_lon/2), 2);
+/*** attach_overlay() gives g an empty edge overlay on its current weights, so a cost profile must be loaded first. overlay->attached must start as false, so that detach_overlay() can always be called. ***/
+void attach_overlay(graph* g, edge_overlay* overlay) {
+    if (g->ch != NULL) ExitError("the contraction hierarchy is built on the costs of the map and cannot be used with an edge overlay", 58);
+    overlay->version = 0;
+    overlay->current = NULL;
+    pthread_mutex_init(&overlay->update_lock, NULL);
+    pthread_mutex_init(&overlay->pin_lock, NULL);
+    overlay->attached = true;
+    g->overlay = overlay;
+}
+
+void free_overlay_snapshot(overlay_snapshot* snapshot) {
+    free(snapshot->edges.slots);
+    free(snapshot->redges.slots);
+    free(snapshot);
+}
+
+/*** unpin_overlay() releases a snapshot pinned by pin_overlay() (nothing if snapshot is NULL), freeing it if it is no longer the current one and no other search uses it ***/
+void unpin_overlay(edge_overlay* overlay, overlay_snapshot* snapshot) {
+    if (snapshot == NULL) return;
+    pthread_mutex_lock(&overlay->pin_lock);
+    bool unused = (--snapshot->pins == 0);
+    pthread_mutex_unlock(&overlay->pin_lock);
+    if (unused) free_overlay_snapshot(snapshot);
+}
+
+/*** pin_overlay() returns the graph a search should run on: g itself if it has no overlay or no edge is changed, otherwise view, filled in with g and the current snapshot as its penalties, which stay valid until unpin_overlay(g->overlay, *snapshot) whatever updates are published meanwhile. ***/
+const graph* pin_overlay(const graph* g, graph* view, overlay_snapshot** snapshot) {
+    *snapshot = NULL;
+    if (g->overlay == NULL) return g;
+    pthread_mutex_lock(&g->overlay->pin_lock);
+    if ((*snapshot = g->overlay->current) != NULL) (*snapshot)->pins += 1;
+    pthread_mutex_unlock(&g->overlay->pin_lock);
+    if (*snapshot == NULL) return g;
+    *view = *g;
+    view->penalties = *snapshot;
+    view->overlay = NULL;                       // the view is already pinned
+    return view;
+}
+
+/*** apply_overlay() sets the penalties of count changes, after clearing every edge if reset, and publishes them in one snapshot, so that a search sees all of them or none. Searches that started before keep the snapshot they pinned. The new snapshot is built from the previous one, so it takes time linear in the number of changed edges, not in the size of the graph. It returns the version of the overlay, which counts the snapshots published. ***/
+unsigned long apply_overlay(edge_overlay* overlay, const graph* g, const overlay_change* changes, unsigned long count, bool reset) {
+    pthread_mutex_lock(&overlay->update_lock);
+    const overlay_snapshot* old = reset ? NULL : overlay->current;      // only updates replace current, and they hold update_lock
+    unsigned long k, nedges = 0, nredges = 0;
+    uint64_t e;
+    for (k = 0; k < count; k++) {
+        for (e = g->first[changes[k].from]; e < g->first[changes[k].from+1]; e++) nedges += (g->targets[e] == changes[k].to);
+        for (e = g->rfirst[changes[k].to]; e < g->rfirst[changes[k].to+1]; e++) nredges += (g->rtargets[e] == changes[k].from);
+    }
+// work tables: the old penalties, then the changes on top of them, clearings included
+    overlay_table edges, redges;
+    init_overlay_table(&edges, nedges + (old ? old->edges.count : 0));
+    init_overlay_table(&redges, nredges + (old ? old->redges.count : 0));
+    if (old != NULL) {
+        overlay_table_copy(&edges, &old->edges);
+        overlay_table_copy(&redges, &old->redges);
+    }
+    for (k = 0; k < count; k++) {
+        for (e = g->first[changes[k].from]; e < g->first[changes[k].from+1]; e++)
+            if (g->targets[e] == changes[k].to) overlay_table_set(&edges, e, changes[k].penalty);
+        for (e = g->rfirst[changes[k].to]; e < g->rfirst[changes[k].to+1]; e++)
+            if (g->rtargets[e] == changes[k].from) overlay_table_set(&redges, e, changes[k].penalty);
+    }
+// the snapshot keeps only the edges left with a penalty
+    overlay_snapshot* snapshot = NULL;
+    unsigned long changed = overlay_table_copy(NULL, &edges);
+    if (changed > 0) {
+        if ((snapshot = (overlay_snapshot*) malloc(sizeof(overlay_snapshot))) == NULL) ExitError("when allocating memory for an edge overlay", 59);
+        init_overlay_table(&snapshot->edges, changed);
+        init_overlay_table(&snapshot->redges, changed);
+        overlay_table_copy(&snapshot->edges, &edges);
+        overlay_table_copy(&snapshot->redges, &redges);
+        snapshot->pins = 1;
+    }
+    free(edges.slots);
+    free(redges.slots);
+    pthread_mutex_lock(&overlay->pin_lock);
+    overlay_snapshot* previous = overlay->current;
+    overlay->current = snapshot;
+    unsigned long version = ++overlay->version;
+    bool unused = (previous != NULL && --previous->pins == 0);
+    pthread_mutex_unlock(&overlay->pin_lock);
+    if (unused) free_overlay_snapshot(previous);
+    pthread_mutex_unlock(&overlay->update_lock);
+    return version;
+}
+
+/*** parse_overlay_line() reads a line of a patch file (see edge_overlay) into change. It returns OVERLAY_EDGE, OVERLAY_RESET, OVERLAY_SKIP for comments and blank lines, or -1 with reason set to bad_request, unknown_node or no_edge. ***/
+int parse_overlay_line(const graph* g, const char* line, overlay_change* change, const char** reason) {
+    char action[16];
+    unsigned long from, to;
+    double penalty = 0;
+    int fields = sscanf(line, "%15s %lu %lu %lf", action, &from, &to, &penalty);
+    if (fields < 1 || action[0] == '#') return OVERLAY_SKIP;
+    if (fields == 1 && strcmp(action, "reset") == 0) return OVERLAY_RESET;
+    if (fields == 3 && strcmp(action, "block") == 0) change->penalty = INFINITY;
+    else if (fields == 3 && strcmp(action, "clear") == 0) change->penalty = 0;
+    else if (fields == 4 && strcmp(action, "penalty") == 0 && penalty >= 0 && penalty < INFINITY) change->penalty = penalty;
+    else { *reason = "bad_request"; return -1; }
+    signed long from_index = find_node(g, from), to_index = find_node(g, to);
+    if (from_index == -1 || to_index == -1) { *reason = "unknown_node"; return -1; }
+    change->from = (unsigned long)from_index;
+    change->to = (unsigned long)to_index;
+    uint64_t e;
+    for (e = g->first[from_index]; e < g->first[from_index+1]; e++) if (g->targets[e] == (unsigned long)to_index) return OVERLAY_EDGE;
+    *reason = "no_edge";
+    return -1;
+}
+
+/*** read_overlay_patch() applies the changes of a patch file to the overlay of g in one snapshot, or none of them if a line is not valid: the line and the reason are then printed to stderr. It returns the new version of the overlay, or 0 with reason set if nothing was applied. ***/
+unsigned long read_overlay_patch(const char* filename, const graph* g, const char** reason) {
+    FILE* fin;
+    if ((fin = fopen(filename, "r")) == NULL) { *reason = "bad_patch"; return 0; }
+    overlay_change* changes = NULL;
+    unsigned long count = 0, capacity = 0;
+    bool reset = false, valid = true;
+    char* line_buf = NULL;
+    size_t line_buf_size = 0;
+    while (valid && getline(&line_buf, &line_buf_size, fin) >= 0) {
+        if (count == capacity) {
+            capacity = capacity ? 2*capacity : 64;
+            if ((changes = (overlay_change*) realloc(changes, capacity*sizeof(overlay_change))) == NULL) ExitError("when allocating memory for an edge overlay", 59);
+        }
+        int kind = parse_overlay_line(g, line_buf, &changes[count], reason);
+        if (kind == OVERLAY_EDGE) count += 1;
+        else if (kind == OVERLAY_RESET) { reset = true; count = 0; }     // the changes before it are cleared too
+        else if (kind < 0) {
+            fprintf(stderr, "Patch file line (%s): %s", *reason, line_buf);
+            valid = false;
+        }
+    }
+    fclose(fin);
+    free(line_buf);
+    unsigned long version = valid ? apply_overlay(g->overlay, g, changes, count, reset) : 0;
+    free(changes);
+    return version;
+}
+
+/*** detach_overlay() removes the overlay from g and frees it; no search may be running on it ***/
+void detach_overlay(graph* g, edge_overlay* overlay) {
+    if (!overlay->attached) return;
+    if (g->overlay == overlay) g->overlay = NULL;
+    if (overlay->current != NULL) free_overlay_snapshot(overlay->current);
+    overlay->current = NULL;
+    overlay->attached = false;
+    pthread_mutex_destroy(&overlay->update_lock);
+    pthread_mutex_destroy(&overlay->pin_lock);
+}
+
+/*** init_extras() empties the extra structures a tool can load with load_extra(), so that they can be given to it and to unload_landmarks(), unload_ch(), unload_profile() and detach_overlay() whatever files were given ***/
+void init_extras(landmarks* lm, ch_graph* ch, cost_profile* profile, edge_overlay* overlay) {
+    memset(lm, 0, sizeof(landmarks));
+    memset(ch, 0, sizeof(ch_graph));
+    memset(profile, 0, sizeof(cost_profile));
+    memset(overlay, 0, sizeof(edge_overlay));
+}
+
+/*** load_extra() attaches an optional file to g, chosen by its extension: a contraction hierarchy (.ch), a cost profile (.profile), a patch file for the edge overlay (.patch) or landmarks (anything else). The structures must have been emptied by init_extras(), so that unload_landmarks(), unload_ch(), unload_profile() and detach_overlay() can always be called afterwards. ***/
+void load_extra(const char* filename, graph* g, landmarks* lm, ch_graph* ch, cost_profile* profile, edge_overlay* overlay) {
+    const char* dot = strrchr(filename, '.');
+    if (dot != NULL && strcmp(dot, ".ch") == 0) load_ch(filename, g, ch);
+    else if (dot != NULL && strcmp(dot, ".profile") == 0) load_profile(filename, g, profile);
+    else if (dot != NULL && strcmp(dot, ".patch") == 0) {
+        const char* reason = NULL;
+        if (g->overlay == NULL) attach_overlay(g, overlay);
+        if (read_overlay_patch(filename, g, &reason) == 0) ExitError("the patch file cannot be opened or has a line that is not a valid change of an existing edge", 58);
+    }
+    else load_landmarks(filename, g, lm);
+}
+
+/*** Haversine distance: great-circle distance between two points given by their latitude and longitude in degrees. ***/
+double haversine (double lat_u, double lon_u, double lat_v, double lon_v) {
+    double diff_lat = (lat_u - lat_v) * pi / 180.f;
+    double diff_lon = (lon_u - lon_v) * pi / 180.f;
+    double a = pow(sin(diff_lat/2), 2) + cos(lat_u * pi / 180.f) * cos(lat_v * pi / 180.f) * pow(sin(diff_lon/2), 2);
     double c = 2 * atan2(sqrt(a), sqrt(1-a));
     double d = R * c;
     return d;
 }
 
-/*** evaluation_function() computes the f() function for a node given the type of evaluation we are working with, the current state of the g and h functions (argument info), the nodes vector (only necessary for dynamic weighting) and the indices of the node to be updated, as well as those of the source and destination. ***/
-double evaluation_function (int mode, double param, AStarStatus* info, node* nodes, unsigned long cur_index, unsigned long src_index, unsigned long dest_index) {
+/*** unit_vector() returns the position on the unit sphere of a point given by its latitude and longitude in degrees. ***/
+point3 unit_vector (double lat, double lon) {
+    double phi = lat * pi / 180.f;
+    double lambda = lon * pi / 180.f;
+    point3 p = { cos(phi) * cos(lambda), cos(phi) * sin(lambda), sin(phi) };
+    return p;
+}
+
+/*** distance_bound() is the length of the chord between the nodes of the graph at positions u and v, times the least cost of a km when a cost profile is loaded. It never exceeds the haversine distance and satisfies the triangle inequality, so as a heuristic it is admissible and monotone, and it costs a square root instead of the trigonometric functions of haversine(). ***/
+double distance_bound (const graph* g, unsigned long u, unsigned long v) {
+    double dx = g->unit[u].x - g->unit[v].x;
+    double dy = g->unit[u].y - g->unit[v].y;
+    double dz = g->unit[u].z - g->unit[v].z;
+    return g->bound_scale * sqrt(dx*dx + dy*dy + dz*dz);
+}
+
+/*** grid_row() and grid_col() are the row and column of the cell that holds a point, clamped to the grid for points outside it; grid_cell() is its number ***/
+unsigned long grid_row (const node_grid* grid, double lat) {
+    double row = floor((lat - grid->min_lat) / grid->cell_lat);
+    return row < 0 ? 0 : row >= grid->rows ? grid->rows - 1 : (unsigned long)row;
+}
+
+unsigned long grid_col (const node_grid* grid, double lon) {
+    double col = floor((lon - grid->min_lon) / grid->cell_lon);
+    return col < 0 ? 0 : col >= grid->cols ? grid->cols - 1 : (unsigned long)col;
+}
+
+unsigned long grid_cell (const node_grid* grid, double lat, double lon) {
+    return grid_row(grid, lat) * grid->cols + grid_col(grid, lon);
+}
+
+/*** build_node_grid() sizes the grid of n nodes at lat, lon and fills it, allocating first and nodes (to be freed by the caller). Within a cell nodes keep their order. ***/
+void build_node_grid (node_grid* grid, const double* lat, const double* lon, uint64_t n) {
+    double min_lat = INFINITY, max_lat = -INFINITY, min_lon = INFINITY, max_lon = -INFINITY;
+    uint64_t i;
+    for (i = 0; i < n; i++) {
+        if (lat[i] < min_lat) min_lat = lat[i];
+        if (lat[i] > max_lat) max_lat = lat[i];
+        if (lon[i] < min_lon) min_lon = lon[i];
+        if (lon[i] > max_lon) max_lon = lon[i];
+    }
+    if (n == 0) min_lat = max_lat = min_lon = max_lon = 0;
+    double height = max_lat - min_lat, width = (max_lon - min_lon) * cos((min_lat + max_lat) / 2 * pi / 180);   // in degrees of latitude
+    double cells = (n > GRID_NODES_PER_CELL) ? (double)n / GRID_NODES_PER_CELL : 1;
+    if (height > 0 && width > 0) {
+        grid->rows = (unsigned long)ceil(sqrt(cells * height / width));
+        grid->cols = (unsigned long)ceil(cells / grid->rows);
+    }
+    else if (height > 0) { grid->rows = (unsigned long)ceil(cells); grid->cols = 1; }
+    else if (width > 0) { grid->rows = 1; grid->cols = (unsigned long)ceil(cells); }
+    else grid->rows = grid->cols = 1;
+    grid->min_lat = min_lat;
+    grid->min_lon = min_lon;
+    grid->cell_lat = height > 0 ? height / grid->rows : 1;
+    grid->cell_lon = max_lon > min_lon ? (max_lon - min_lon) / grid->cols : 1;
+    
+// counting sort of the nodes on their cell
+    unsigned long ncells = grid->rows * grid->cols;
+    uint64_t* first = NULL;
+    uint64_t* nodes = NULL;
+    uint64_t* next = NULL;
+    if ((first = (uint64_t*) calloc(ncells + 1, sizeof(uint64_t))) == NULL ||
+        (nodes = (uint64_t*) malloc((n > 0 ? n : 1)*sizeof(uint64_t))) == NULL ||
+        (next = (uint64_t*) malloc((ncells + 1)*sizeof(uint64_t))) == NULL) ExitError("when allocating memory for the node grid", 56);
+    for (i = 0; i < n; i++) first[grid_cell(grid, lat[i], lon[i]) + 1] += 1;
+    for (i = 0; i < ncells; i++) first[i+1] += first[i];
+    memcpy(next, first, (ncells + 1)*sizeof(uint64_t));
+    for (i = 0; i < n; i++) nodes[next[grid_cell(grid, lat[i], lon[i])]++] = i;
+    free(next);
+    grid->first = first;
+    grid->nodes = nodes;
+}
+
+/*** grid_scan() offers the nodes of cell (row, col) to the k nearest found so far, kept sorted by squared chord in best and chords (ties by position) ***/
+void grid_scan (const graph* g, unsigned long row, unsigned long col, point3 q, unsigned long k, unsigned long* found, unsigned long* best, double* chords) {
+    uint64_t c = row * g->grid.cols + col, e;
+    for (e = g->grid.first[c]; e < g->grid.first[c+1]; e++) {
+        unsigned long v = g->grid.nodes[e];
+        double dx = g->unit[v].x - q.x, dy = g->unit[v].y - q.y, dz = g->unit[v].z - q.z;
+        double chord = dx*dx + dy*dy + dz*dz;
+        if (*found == k && (chord > chords[k-1] || (chord == chords[k-1] && v > best[k-1]))) continue;
+        unsigned long j = (*found < k) ? (*found)++ : k - 1;
+        while (j > 0 && (chords[j-1] > chord || (chords[j-1] == chord && best[j-1] > v))) { chords[j] = chords[j-1]; best[j] = best[j-1]; j--; }
+        chords[j] = chord;
+        best[j] = v;
+    }
+}
+
+/*** k_nearest_nodes() finds the k nodes of g nearest to the point (lat, lon) in degrees: positions[0] ... are their positions in the graph, closest first, and distances their great-circle distances in km (distances may be NULL). It returns how many were found, fewer than k only if the graph has fewer nodes. The search scans the cell of the point and then rings of cells around it, and stops once the k-th node found is nearer than anything outside the cells scanned: a point beyond a parallel is at least R times the difference of latitudes away, and one beyond a meridian at least R asin(cos(lat) sin(difference of longitudes)). ***/
+unsigned long k_nearest_nodes (const graph* g, double lat, double lon, unsigned long k, unsigned long* positions, double* distances) {
+    const node_grid* grid = &g->grid;
+    if (k == 0) return 0;
+    double* chords = NULL;
+    if ((chords = (double*) malloc(k*sizeof(double))) == NULL) ExitError("when allocating memory for a nearest node query", 57);
+    point3 q = unit_vector(lat, lon);
+    double cos_lat = cos(lat * pi / 180);
+    unsigned long found = 0, row = grid_row(grid, lat), col = grid_col(grid, lon);
+    unsigned long r0 = row, r1 = row, c0 = col, c1 = col, r, c;       // cells scanned so far: rows r0 to r1, columns c0 to c1
+    grid_scan(g, row, col, q, k, &found, positions, chords);
+    while (r0 > 0 || r1 + 1 < grid->rows || c0 > 0 || c1 + 1 < grid->cols) {
+    // lower bound on the distance to the cells not scanned yet
+        double bound = INFINITY;
+        if (r0 > 0) bound = fmin(bound, R * fmax(0, lat - (grid->min_lat + r0 * grid->cell_lat)) * pi / 180);
+        if (r1 + 1 < grid->rows) bound = fmin(bound, R * fmax(0, grid->min_lat + (r1 + 1) * grid->cell_lat - lat) * pi / 180);
+        if (c0 > 0) bound = fmin(bound, R * asin(fmax(0, cos_lat) * sin(fmin(90, fmax(0, lon - (grid->min_lon + c0 * grid->cell_lon))) * pi / 180)));
+        if (c1 + 1 < grid->cols) bound = fmin(bound, R * asin(fmax(0, cos_lat) * sin(fmin(90, fmax(0, grid->min_lon + (c1 + 1) * grid->cell_lon - lon)) * pi / 180)));
+        if (found == k) {
+            double chord = 2 * sin(fmin(bound / R, pi) / 2);
+            if (chords[k-1] <= chord * chord) break;
+        }
+    // next ring
+        unsigned long n0 = r0 > 0 ? r0 - 1 : 0, n1 = r1 + 1 < grid->rows ? r1 + 1 : r1;
+        unsigned long m0 = c0 > 0 ? c0 - 1 : 0, m1 = c1 + 1 < grid->cols ? c1 + 1 : c1;
+        for (r = n0; r <= n1; r++) {
+            bool inside = (r >= r0 && r <= r1);                     // row already scanned between c0 and c1
+            for (c = m0; c <= m1; c++) {
+                if (inside && c >= c0 && c <= c1) { c = c1; continue; }
+                grid_scan(g, r, c, q, k, &found, positions, chords);
+            }
+        }
+        r0 = n0; r1 = n1; c0 = m0; c1 = m1;
+    }
+    unsigned long j;
+    if (distances != NULL)
+        for (j = 0; j < found; j++) distances[j] = 2 * R * asin(fmin(1, sqrt(chords[j]) / 2));
+    free(chords);
+    return found;
+}
+
+/*** nearest_nodes() snaps count points (lats[i], lons[i]) to their nearest nodes, written to positions. Points are taken in the order of their cells, so that consecutive queries find the cells they scan in cache. ***/
+void nearest_nodes (const graph* g, const double* lats, const double* lons, unsigned long count, unsigned long* positions) {
+    id_slot* order = NULL;
+    if ((order = (id_slot*) malloc((count > 0 ? count : 1)*sizeof(id_slot))) == NULL) ExitError("when allocating memory for a nearest node query", 57);
+    unsigned long i;
+    for (i = 0; i < count; i++) {
+        order[i].id = grid_cell(&g->grid, lats[i], lons[i]);
+        order[i].index = i;
+    }
+    qsort(order, count, sizeof(id_slot), compare_id_slots);
+    for (i = 0; i < count; i++) {
+        unsigned long k = order[i].index;
+        k_nearest_nodes(g, lats[k], lons[k], 1, &positions[k], NULL);
+    }
+    free(order);
+}
+
+/*** landmark_bound() is the ALT lower bound on the distance from node u to node v: by the triangle inequality, d(u,v) >= d(L,v) - d(L,u) and d(u,v) >= d(u,L) - d(v,L) for every landmark L. Infinite differences mean that v cannot be reached from u, and undefined ones (both distances infinite) are ignored by fmax(). The loop has no branches so that the compiler can vectorize it. ***/
+double landmark_bound (const landmarks* lm, unsigned long u, unsigned long v) {
+    unsigned long K = lm->nlandmarks, k;
+    const float* row_u = lm->table + 2*K*u;
+    const float* row_v = lm->table + 2*K*v;
+    double bound = 0;
+    for (k = 0; k < K; k++) {
+        double from_landmark = (1 - LANDMARK_SLACK) * (double)row_v[k] - (1 + LANDMARK_SLACK) * (double)row_u[k];
+        double to_landmark = (1 - LANDMARK_SLACK) * (double)row_u[K+k] - (1 + LANDMARK_SLACK) * (double)row_v[K+k];
+        bound = fmax(bound, fmax(from_landmark, to_landmark));
+    }
+    return bound;
+}
+
+/*** heuristic() is the lower bound on the distance from node u to node v used by the searches: the chord bound, strengthened with the landmark bound when landmarks are loaded. The landmark bound is admissible but, because of the rounding of the stored distances, only consistent up to LANDMARK_SLACK, so searches that use it reopen CLOSED nodes when they find a shorter path to them. ***/
+double heuristic (const graph* g, unsigned long u, unsigned long v) {
+    double bound = distance_bound(g, u, v);
+    if (g->lm != NULL) bound = fmax(bound, landmark_bound(g->lm, u, v));
+    return bound;
+}
+
+/*** evaluation_function() computes the f() function for a node given the type of evaluation we are working with, the current state of the g and h functions (argument info), the graph (only necessary for dynamic weighting) and the indices of the node to be updated, as well as those of the source and destination. ***/
+double evaluation_function (int mode, double param, AStarStatus* info, const graph* g, unsigned long cur_index, unsigned long src_index, unsigned long dest_index) {
 // default evaluation
     if (mode == 1) return info[cur_index].g + info[cur_index].h;
 // weighted evaluation
     else if (mode == 2) return (1-param)*info[cur_index].g + param*info[cur_index].h;
 // dynamic weighting
     else if (mode == 3) {
-        double extra = 1 - haversine(nodes[cur_index], nodes[src_index]) / (haversine(nodes[cur_index], nodes[dest_index]) + haversine(nodes[cur_index], nodes[src_index]));
+        double extra = 1 - distance_bound(g, cur_index, src_index) / (distance_bound(g, cur_index, dest_index) + distance_bound(g, cur_index, src_index));
         return info[cur_index].g + info[cur_index].h + param*extra*info[cur_index].h;
     }
     ExitError("Invalid choice of evaluation function.", 22);
     return 0.f;
 }
 
-/*** Auxiliary function to keep track of the OPEN list. Used for debugging. Recommended to use only when testing the algorithm to compute the route between two close-by nodes. ***/
-void print_OPEN (open_node* OPEN) {
-    open_node* TEMP = OPEN;
+/*** dynamic_extra() is the factor 1-d/N of the dynamic weighting (mode 3) for node v, with both distances measured by the chord bound: d from the source to v and N from the source to the destination through v. h is the heuristic of v, which is the chord bound to the destination when there are no landmarks and is then reused. ***/
+double dynamic_extra (const graph* g, unsigned long v, unsigned long src_index, unsigned long dest_index, double h) {
+    double to_dest = (g->lm == NULL) ? h : distance_bound(g, v, dest_index);
+    double from_src = distance_bound(g, v, src_index);
+    return 1 - from_src / (to_dest + from_src);
+}
+
+/*** Auxiliary function to keep track of the OPEN list. Used for debugging. Recommended to use only when testing the algorithm to compute the route between two close-by nodes. Nodes are printed in heap order, not sorted by f. ***/
+void print_OPEN (OpenList* OPEN) {
     printf("\nOPEN list:\nNode index\tf\n");
-    while (TEMP != NULL) {
-        printf("%lu\t\t%f\n", (TEMP)->index, TEMP->f);
-        TEMP = TEMP->next;
-    }
+    unsigned long i;
+    for (i = 0; i < OPEN->size; i++) printf("%lu\t\t%f\n", (unsigned long)OPEN->heap[i].index, OPEN->heap[i].f);
     printf("\n");
 }
 
-/*** insert_to_OPEN() takes in a node with a given index and inserts it in the OPEN list. It dynamically allocates memory for the node in the OPEN list and inserts it by preserving the ordering of the f value. It computes such f value by reading g and h values from the progress vector. Tie break rule: a new node that is inserted and has the same f as a node already in the OPEN list. Then, the incoming node is inserted behind the node already in the OPEN list. ***/
-void insert_to_OPEN (unsigned long index, AStarStatus* progress, open_node* OPEN, node* nodes, int mode, double param, unsigned long src_index, unsigned long dest_index) {
-    (progress + index)->whq = 1;
-    open_node* TEMP = OPEN;                                                                 // copy of the OPEN list
-    open_node* new_node = NULL;                                                             // new node in the OPEN list
-    if ((new_node = (open_node*) malloc(sizeof(open_node))) == NULL) ExitError("when allocating memory for a new node in the OPEN list", 21);
-    new_node->index = index;                                                                // index of new_node
-    new_node->f = evaluation_function (mode, param, progress, nodes, index, src_index, dest_index); // f function of new node
-    new_node->next = NULL;                                                                  // for the moment new node is not allocated in the OPEN list
-    while ( (TEMP->next != NULL) && ((TEMP->next)->f <= new_node->f ) ) TEMP = TEMP->next;  // find position in OPEN (TEMP) list to insert new_node
-    if (TEMP->next == NULL) TEMP->next = new_node;                                          // if new_node has to be allocated at the end of OPEN
-    else if ((TEMP->next)->f > new_node->f) {                                               // if new_node has to be allocated in the middle of OPEN
-        new_node->next = TEMP->next;
-        TEMP->next = new_node;
-    }
-}
-
-/*** delete_from_OPEN() deletes a node from the OPEN list, when we find that its cost is cheaper after reaching it from the current node. It will never delete the first node in the OPEN list because the first node in OPEN is the node being currently expanded, which cannot be a successor of itself. ***/
-void delete_from_OPEN (unsigned long target, AStarStatus* progress, open_node* OPEN) {
-    open_node* TEMP = OPEN;
-    open_node* PREV = NULL;
-    while (TEMP != NULL && TEMP->index != target) {
-        PREV = TEMP;
-        TEMP = TEMP->next;
-    }
-    PREV->next = TEMP->next;
-    free(TEMP);
-}
-
-/*** is_path_correct() checks that a computed path makes sense. Given a sequence of unsigned long indices, check that for all i, element (i+1) is a successor of element i. ***/
-bool is_path_correct (unsigned long* path, node* nodes) {
-    unsigned long current;
-    unsigned long next;
-    size_t len = sizeof(path) / sizeof(unsigned long);
+/*** open_less() is the ordering of the OPEN heap: smaller f first and, for equal f, the node that was inserted (or last updated) earlier. ***/
+bool open_less (open_node* a, open_node* b) {
+    if (a->f != b->f) return a->f < b->f;
+    return a->stamp < b->stamp;
+}
+
+/*** open_sift_up() and open_sift_down() restore the heap property for the entry at position pos, keeping heap_pos in the progress vector up to date. ***/
+void open_sift_up (OpenList* OPEN, AStarStatus* progress, unsigned long pos) {
+    open_node moving = OPEN->heap[pos];
+    while (pos > 0) {
+        unsigned long up = (pos - 1) / 2;
+        if (!open_less(&moving, &OPEN->heap[up])) break;
+        OPEN->heap[pos] = OPEN->heap[up];
+        progress[OPEN->heap[pos].index].heap_pos = pos;
+        pos = up;
+    }
+    OPEN->heap[pos] = moving;
+    progress[moving.index].heap_pos = pos;
+}
+
+void open_sift_down (OpenList* OPEN, AStarStatus* progress, unsigned long pos) {
+    open_node moving = OPEN->heap[pos];
+    unsigned long child;
+    while ((child = 2*pos + 1) < OPEN->size) {
+        if (child + 1 < OPEN->size && open_less(&OPEN->heap[child+1], &OPEN->heap[child])) child += 1;
+        if (!open_less(&OPEN->heap[child], &moving)) break;
+        OPEN->heap[pos] = OPEN->heap[child];
+        progress[OPEN->heap[pos].index].heap_pos = pos;
+        pos = child;
+    }
+    OPEN->heap[pos] = moving;
+    progress[moving.index].heap_pos = pos;
+}
+
+/*** init_OPEN() allocates the heap of the OPEN list with an initial capacity. The heap grows when needed. ***/
+void init_OPEN (OpenList* OPEN, unsigned long capacity) {
+    if (capacity == 0) capacity = 1;
+    if ((OPEN->heap = (open_node*) malloc(capacity*sizeof(open_node))) == NULL) ExitError("when allocating memory for the OPEN list", 20);
+    OPEN->size = 0;
+    OPEN->capacity = capacity;
+    OPEN->next_stamp = 0;
+    OPEN->decrease_keys = 0;
+    OPEN->peak_size = 0;
+}
+
+void free_OPEN (OpenList* OPEN) {
+    free(OPEN->heap);
+    OPEN->heap = NULL;
+    OPEN->size = OPEN->capacity = 0;
+}
+
+/*** push_to_OPEN() inserts a node in the OPEN list with key f. If the node is already in the OPEN list its key is updated in place (decrease-key), which replaces the former delete-and-reinsert. Tie break rule: a new node that is inserted and has the same f as a node already in the OPEN list is extracted after the node already in the OPEN list. An updated node counts as newly inserted for this rule. ***/
+void push_to_OPEN (unsigned long index, double f, AStarStatus* progress, OpenList* OPEN) {
+    unsigned long pos;
+    if (progress[index].whq == 1) {                                                // node already in the OPEN list: update its key
+        pos = progress[index].heap_pos;
+        OPEN->heap[pos].f = f;
+        OPEN->heap[pos].stamp = OPEN->next_stamp++;
+        open_sift_up(OPEN, progress, pos);
+        open_sift_down(OPEN, progress, progress[index].heap_pos);
+        OPEN->decrease_keys += 1;
+        return;
+    }
+    if (OPEN->size == OPEN->capacity) {                                                     // grow the heap
+        open_node* grown = NULL;
+        if ((grown = (open_node*) realloc(OPEN->heap, 2*OPEN->capacity*sizeof(open_node))) == NULL) ExitError("when allocating memory for a new node in the OPEN list", 21);
+        OPEN->heap = grown;
+        OPEN->capacity *= 2;
+    }
+    progress[index].whq = 1;
+    pos = OPEN->size++;
+    if (OPEN->size > OPEN->peak_size) OPEN->peak_size = OPEN->size;
+    OPEN->heap[pos].f = f;
+    OPEN->heap[pos].stamp = OPEN->next_stamp++;
+    OPEN->heap[pos].index = index;
+    open_sift_up(OPEN, progress, pos);
+}
+
+/*** insert_to_OPEN() takes in a node with a given index and inserts it in the OPEN list (see push_to_OPEN()), computing its f value by reading g and h values from the progress vector. ***/
+void insert_to_OPEN (unsigned long index, AStarStatus* progress, OpenList* OPEN, const graph* g, int mode, double param, unsigned long src_index, unsigned long dest_index) {
+    push_to_OPEN(index, evaluation_function (mode, param, progress, g, index, src_index, dest_index), progress, OPEN);
+}
+
+/*** pop_from_OPEN() removes the node with minimal f from the OPEN list and returns its index. The OPEN list must not be empty. The node keeps whq == 1 until the caller moves it to CLOSED. ***/
+unsigned long pop_from_OPEN (OpenList* OPEN, AStarStatus* progress) {
+    unsigned long index = OPEN->heap[0].index;
+    OPEN->size -= 1;
+    if (OPEN->size > 0) {
+        OPEN->heap[0] = OPEN->heap[OPEN->size];
+        open_sift_down(OPEN, progress, 0);
+    }
+    return index;
+}
+
+/*** statistics of one query, filled in by run_search() in its forward context. For the searches on two contexts the counts of both sides are added up. ***/
+typedef struct {
+    double seconds;                 // wall time of the search
+    unsigned long expanded;         // nodes taken out of OPEN
+    unsigned long relaxed;          // edges scanned from the expanded nodes
+    unsigned long decrease_keys;    // keys of nodes already in OPEN lowered in place
+    unsigned long peak_open;        // largest size reached by OPEN
+    unsigned long bytes_allocated;  // memory held by the search contexts used by the query
+} SearchStats;
+
+/*** structure to hold the state of a search so that it can be reused across queries: one per thread. The progress vector is initialized once; afterwards only the nodes reached by a search are recorded in touched and reset before the next one, so a short query costs nothing for the rest of the graph. ***/
+typedef struct {
+    unsigned long nnodes;
+    AStarStatus* progress;      // g, h, parent and queue location for all nodes
+    OpenList OPEN;
+    node_index* touched;        // nodes whose progress entry has been modified since the last reset
+    unsigned long ntouched;
+    unsigned long touched_capacity;
+    double deadline;            // monotonic time in seconds at which searches on this context give up, 0 for none
+    bool expired;               // the last search gave up at the deadline
+    SearchStats stats;          // statistics of the last search run with this context as forward context
+    uint8_t* marks;             // per-node flags of one_to_many_search(), allocated on first use
+} SearchContext;
+
+/*** Tracing hooks, compiled in only with -DASTAR_TRACE: the searches call astar_trace_hook, if it is set, when a query starts (node is the source), for every expanded node and when the query ends (node is the destination, ctx->stats is filled in), so that an embedding program can export metrics. Without ASTAR_TRACE the calls compile to nothing. ***/
+enum traceEvent {TRACE_START, TRACE_EXPAND, TRACE_END};
+#ifdef ASTAR_TRACE
+typedef void (*trace_hook)(int event, const SearchContext* ctx, unsigned long node);
+trace_hook astar_trace_hook = NULL;
+#define TRACE(event, ctx, node) do { if (astar_trace_hook != NULL) astar_trace_hook(event, ctx, node); } while (0)
+#else
+#define TRACE(event, ctx, node) ((void)0)
+#endif
+
+/*** report() prints the progress messages of AStar(); compile with -DASTAR_QUIET to leave them out, e.g. when the routes are only read from the returned statistics and the route file. ***/
+#ifdef ASTAR_QUIET
+#define report(...) ((void)0)
+#else
+#define report(...) printf(__VA_ARGS__)
+#endif
+
+#define DEADLINE_CHECK_INTERVAL 1024    // expanded nodes between two looks at the clock
+
+/*** monotonic_seconds() is the time in seconds of a clock that never goes back, for deadlines and latencies ***/
+double monotonic_seconds (void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + 1e-9 * (double)now.tv_nsec;
+}
+
+/*** search_expired() is called by the search loops for every expanded node: every DEADLINE_CHECK_INTERVAL nodes it checks the deadline of ctx and, once it has passed, marks the context as expired and returns true so that the search gives up. ***/
+bool search_expired (SearchContext* ctx, unsigned long expanded) {
+    if (ctx->deadline <= 0 || expanded % DEADLINE_CHECK_INTERVAL != 0) return false;
+    if (monotonic_seconds() < ctx->deadline) return false;
+    ctx->expired = true;
+    return true;
+}
+
+void init_search_context (SearchContext* ctx, const graph* g) {
+    if (g->nnodes >= MAX_SEARCH_NODES) ExitError("the graph has too many nodes for the search state", 19);
+    ctx->nnodes = g->nnodes;
+    if ((ctx->progress = (AStarStatus*) malloc(g->nnodes*sizeof(AStarStatus))) == NULL) ExitError("when allocating memory for the progress vector", 19);
+    unsigned long i;
+    for (i = 0; i < ctx->nnodes; i++) {
+        ctx->progress[i].whq = 0;                                       // all nodes start neither in OPEN nor CLOSED list
+        ctx->progress[i].g = INFINITY;                                  // all nodes start with INF g function
+    }
+    init_OPEN(&ctx->OPEN, 1024);
+    ctx->touched_capacity = 1024;
+    ctx->ntouched = 0;
+    ctx->deadline = 0;
+    ctx->expired = false;
+    memset(&ctx->stats, 0, sizeof(SearchStats));
+    ctx->marks = NULL;
+    if ((ctx->touched = (node_index*) malloc(ctx->touched_capacity*sizeof(node_index))) == NULL) ExitError("when allocating memory for the touched nodes", 19);
+}
+
+void free_search_context (SearchContext* ctx) {
+    free(ctx->progress);
+    ctx->progress = NULL;
+    free_OPEN(&ctx->OPEN);
+    free(ctx->touched);
+    ctx->touched = NULL;
+    free(ctx->marks);
+    ctx->marks = NULL;
+}
+
+/*** touch_node() records that the progress entry of a node is about to be modified for the first time in this search. ***/
+void touch_node (SearchContext* ctx, unsigned long index) {
+    if (ctx->ntouched == ctx->touched_capacity) {
+        node_index* grown = NULL;
+        if ((grown = (node_index*) realloc(ctx->touched, 2*ctx->touched_capacity*sizeof(node_index))) == NULL) ExitError("when allocating memory for the touched nodes", 19);
+        ctx->touched = grown;
+        ctx->touched_capacity *= 2;
+    }
+    ctx->touched[ctx->ntouched++] = index;
+}
+
+/*** reset_search_context() prepares the context for a new query by restoring only the nodes touched by the previous one. ***/
+void reset_search_context (SearchContext* ctx) {
     unsigned long i;
-    unsigned short j;
-    for (i = 0; i < len-1; i++) {
-        current = path[i];
-        next = path[i+1];
-        for (j = 0; j < nodes[current].nsucc; j++) if ( (nodes[current].successors)[j] == next ) break;
-        if (j == nodes[current].nsucc) return false;
+    for (i = 0; i < ctx->ntouched; i++) {
+        ctx->progress[ctx->touched[i]].whq = 0;
+        ctx->progress[ctx->touched[i]].g = INFINITY;
+    }
+    ctx->ntouched = 0;
+    ctx->OPEN.size = 0;
+    ctx->OPEN.next_stamp = 0;
+    ctx->OPEN.decrease_keys = 0;
+    ctx->OPEN.peak_size = 0;
+    ctx->expired = false;
+    memset(&ctx->stats, 0, sizeof(SearchStats));
+}
+
+/*** search_context_bytes() is the memory held by a search context: its progress vector, OPEN heap and list of touched nodes ***/
+unsigned long search_context_bytes (const SearchContext* ctx) {
+    return ctx->nnodes * sizeof(AStarStatus) + ctx->OPEN.capacity * sizeof(open_node) + ctx->touched_capacity * sizeof(node_index);
+}
+
+/*** structure to hold a path as node positions from the source to the destination. It is meant to be reused across queries, so it only grows. ***/
+typedef struct {
+    unsigned long* nodes;
+    unsigned long length;
+    unsigned long capacity;
+} PathBuffer;
+
+void init_path_buffer (PathBuffer* path) {
+    path->capacity = 256;
+    path->length = 0;
+    if ((path->nodes = (unsigned long*) malloc(path->capacity*sizeof(unsigned long))) == NULL) ExitError("when allocating memory for the path vector", 24);
+}
+
+void free_path_buffer (PathBuffer* path) {
+    free(path->nodes);
+    path->nodes = NULL;
+    path->length = path->capacity = 0;
+}
+
+/*** build_path() reads the path to dest_index from the parent chain in info with a single walk: the nodes are stored from the destination back and the buffer is then reversed in place. A chain longer than the graph has nodes is a cycle and stops the program. ***/
+void build_path (const AStarStatus* info, unsigned long nnodes, unsigned long source_index, unsigned long dest_index, PathBuffer* path) {
+    unsigned long cur_index = dest_index, i;
+    path->length = 0;
+    while (true) {
+        if (path->length == path->capacity) {
+            unsigned long* grown = NULL;
+            if ((grown = (unsigned long*) realloc(path->nodes, 2*path->capacity*sizeof(unsigned long))) == NULL) ExitError("when allocating memory for the path vector", 24);
+            path->nodes = grown;
+            path->capacity *= 2;
+        }
+        path->nodes[path->length++] = cur_index;
+        if (cur_index == source_index) break;
+        if (path->length > nnodes) ExitError("the parent chain of the destination does not lead to the source", 25);
+        cur_index = info[cur_index].parent;
+    }
+    for (i = 0; i < path->length/2; i++) {
+        unsigned long tmp = path->nodes[i];
+        path->nodes[i] = path->nodes[path->length-1-i];
+        path->nodes[path->length-1-i] = tmp;
+    }
+}
+
+/*** is_path_correct() checks that a computed path makes sense: it goes from source_index to dest_index and, for all i, element (i+1) is a successor of element i. Each step looks only at the adjacency list of one node, so the check is linear in the length of the path. ***/
+bool is_path_correct (const PathBuffer* path, const graph* g, unsigned long source_index, unsigned long dest_index) {
+    if (path->length == 0 || path->nodes[0] != source_index || path->nodes[path->length-1] != dest_index) return false;
+    unsigned long i;
+    uint64_t j;
+    for (i = 0; i + 1 < path->length; i++) {
+        unsigned long current = path->nodes[i];
+        unsigned long next = path->nodes[i+1];
+        for (j = g->first[current]; j < g->first[current+1]; j++) if ( g->targets[j] == next ) break;
+        if (j == g->first[current+1]) return false;
     }
     return true;
 }
 
-/*** path_to_file() creates an output file with the sequence of nodes that make up the path. For each node in the path, the following information is written: ID, lat, lon, g, h, f and name. ***/
-void path_to_file(node* nodes, unsigned long* path, unsigned long length, AStarStatus* info, char* name, int evaluation, double param) {
-// modify name to the following format (map)_(id of source)_(id of destination)_(evaluation mode)_(parameters if any).csv. Map is either spain or cataluna
-    char ending[257] = "_";
-    char buffer[11];
-    sprintf(buffer, "%lu", nodes[path[0]].id);
-    strcat(ending, buffer);
-    strcat(ending, "_");
-    sprintf(buffer, "%lu", nodes[path[length-1]].id);
-    strcat(ending, buffer);
-    if (evaluation == 1) strcat(ending, "_default");
-    else if (evaluation == 2) {
-        strcat(ending, "_weighted_");
-        sprintf(buffer, "%.2f", param);
-        strcat(ending, buffer);
-    }
-    else if (evaluation == 3) {
-        strcat(ending, "_dynamic_");
-        sprintf(buffer, "%.4f", param);
-        strcat(ending, buffer);
-    }
-    else ExitError("Invalid choice of evaluation function.", 26);     
-    strcat(ending, ".csv");
-    strcpy(strrchr(name, '.'), ending);
-    FILE *fout;
-    if ((fout = fopen (name, "w+")) == NULL) ExitError("the output data file cannot be created", 27);   
-    fprintf(fout, "step|id|lat|lon|g|h|name\n");
+/*** Route output. A RouteWriter formats routes into its own buffer, without going through printf for every field, and writes the buffer to its stream in large blocks, so that many routes can be appended to one stream. With ROUTE_CSV every node is a line "step|id|lat|lon|g|h|name", preceded by the number of the route if the writer is numbered; with ROUTE_POLYLINE every route is one line "route|source|dest|distance|nodes|polyline", where polyline encodes the coordinates of the nodes with the Google polyline algorithm (1e-5 degrees); it is the last field because its characters include '|'. A writer without a stream (out == NULL) only fills its buffer, for a caller that writes the text itself. ***/
+enum routeFormat {ROUTE_CSV, ROUTE_POLYLINE};
+#define ROUTE_FLUSH_SIZE (1 << 20)      // buffered bytes that trigger a write to the stream
+
+typedef struct {
+    FILE* out;
+    int format;
+    bool numbered;              // ROUTE_CSV lines start with the number of the route
+    char* buffer;
+    size_t used, capacity;
+} RouteWriter;
+
+/*** route_reserve() makes room for bytes more characters in the buffer of w ***/
+void route_reserve (RouteWriter* w, size_t bytes) {
+    if (w->used + bytes <= w->capacity) return;
+    while (w->used + bytes > w->capacity) w->capacity *= 2;
+    if ((w->buffer = (char*) realloc(w->buffer, w->capacity)) == NULL) ExitError("when allocating memory for the route output", 28);
+}
+
+void route_text (RouteWriter* w, const char* text, size_t length) {
+    route_reserve(w, length);
+    memcpy(w->buffer + w->used, text, length);
+    w->used += length;
+}
+
+/*** route_unsigned() appends an unsigned integer in decimal ***/
+void route_unsigned (RouteWriter* w, uint64_t value) {
+    char digits[20];
+    int n = 0;
+    do { digits[n++] = (char)('0' + value % 10); value /= 10; } while (value > 0);
+    route_reserve(w, (size_t)n);
+    while (n > 0) w->buffer[w->used++] = digits[--n];
+}
+
+/*** route_fixed() appends a number with 7 decimals, exactly as printf("%.7f"): the value is scaled and rounded to an integer, and printf itself is used only for values it cannot represent that way or that are too close to a rounding tie for the scaled product to be trusted. ***/
+void route_fixed (RouteWriter* w, double value) {
+    double scaled = fabs(value) * 1e7;
+    double fraction = scaled - floor(scaled);
+    if (!(scaled < 9e15) || fabs(fraction - 0.5) < 1e-3) {
+        char text[64];
+        int n = snprintf(text, sizeof(text), "%.7f", value);
+        route_text(w, text, (size_t)n);
+        return;
+    }
+    uint64_t units = (uint64_t)llround(scaled);
+    if (signbit(value)) route_text(w, "-", 1);                          // printf keeps the sign of values that round to zero
+    route_unsigned(w, units / 10000000);
+    char decimals[8];
+    uint64_t rest = units % 10000000;
+    int k;
+    decimals[0] = '.';
+    for (k = 7; k >= 1; k--) { decimals[k] = (char)('0' + rest % 10); rest /= 10; }
+    route_text(w, decimals, 8);
+}
+
+/*** route_polyline_value() appends one signed delta of the polyline encoding ***/
+void route_polyline_value (RouteWriter* w, int64_t delta) {
+    uint64_t v = delta < 0 ? ~((uint64_t)delta << 1) : (uint64_t)delta << 1;
+    route_reserve(w, 13);
+    while (v >= 0x20) { w->buffer[w->used++] = (char)((0x20 | (v & 0x1f)) + 63); v >>= 5; }
+    w->buffer[w->used++] = (char)(v + 63);
+}
+
+/*** flush_route_writer() writes the buffered text to the stream of w ***/
+void flush_route_writer (RouteWriter* w) {
+    if (w->out == NULL || w->used == 0) return;
+    if (fwrite(w->buffer, 1, w->used, w->out) != w->used) ExitError("when writing the route output", 28);
+    w->used = 0;
+}
+
+/*** init_route_writer() prepares a writer on the stream out (or NULL) and, if there is a stream, writes the header line of the format ***/
+void init_route_writer (RouteWriter* w, FILE* out, int format, bool numbered) {
+    w->out = out;
+    w->format = format;
+    w->numbered = numbered;
+    w->used = 0;
+    w->capacity = 1 << 16;
+    if ((w->buffer = (char*) malloc(w->capacity)) == NULL) ExitError("when allocating memory for the route output", 28);
+    if (out == NULL) return;
+    if (format == ROUTE_POLYLINE) route_text(w, "route|source|dest|distance|nodes|polyline\n", strlen("route|source|dest|distance|nodes|polyline\n"));
+    else if (numbered) route_text(w, "route|step|id|lat|lon|g|h|name\n", strlen("route|step|id|lat|lon|g|h|name\n"));
+    else route_text(w, "step|id|lat|lon|g|h|name\n", strlen("step|id|lat|lon|g|h|name\n"));
+}
+
+/*** close_route_writer() flushes the writer and frees its buffer; the stream is left open ***/
+void close_route_writer (RouteWriter* w) {
+    flush_route_writer(w);
+    free(w->buffer);
+    w->buffer = NULL;
+}
+
+/*** write_route() appends route number route, whose nodes are in path and whose g and h are in info, to the writer ***/
+void write_route (RouteWriter* w, const graph* g, const PathBuffer* path, const AStarStatus* info, unsigned long route) {
     unsigned long i;
-    for (i = 0; i < length; i++) {
-        fprintf(fout, "%lu|%lu|%.7f|%.7f|%.7f|%.7f|%s\n", i, nodes[path[i]].id, nodes[path[i]].lat, nodes[path[i]].lon, info[path[i]].g, info[path[i]].h, nodes[path[i]].name);
+    if (w->format == ROUTE_POLYLINE) {
+        unsigned long source = path->nodes[0], dest = path->nodes[path->length-1];
+        route_unsigned(w, route); route_text(w, "|", 1);
+        route_unsigned(w, g->ids[source]); route_text(w, "|", 1);
+        route_unsigned(w, g->ids[dest]); route_text(w, "|", 1);
+        route_fixed(w, info[dest].g); route_text(w, "|", 1);
+        route_unsigned(w, path->length); route_text(w, "|", 1);
+        int64_t last_lat = 0, last_lon = 0;
+        for (i = 0; i < path->length; i++) {
+            int64_t lat = llround(g->lat[path->nodes[i]] * 1e5), lon = llround(g->lon[path->nodes[i]] * 1e5);
+            route_polyline_value(w, lat - last_lat);
+            route_polyline_value(w, lon - last_lon);
+            last_lat = lat;
+            last_lon = lon;
+        }
+        route_text(w, "\n", 1);
     }
-    
+    else {
+        for (i = 0; i < path->length; i++) {
+            unsigned long u = path->nodes[i];
+            if (w->numbered) { route_unsigned(w, route); route_text(w, "|", 1); }
+            route_unsigned(w, i); route_text(w, "|", 1);
+            route_unsigned(w, g->ids[u]); route_text(w, "|", 1);
+            route_fixed(w, g->lat[u]); route_text(w, "|", 1);
+            route_fixed(w, g->lon[u]); route_text(w, "|", 1);
+            route_fixed(w, info[u].g); route_text(w, "|", 1);
+            route_fixed(w, info[u].h); route_text(w, "|", 1);
+            route_text(w, g->names + g->name_first[u], (size_t)(g->name_first[u+1] - g->name_first[u]));
+            route_text(w, "\n", 1);
+        }
+    }
+    if (w->used >= ROUTE_FLUSH_SIZE) flush_route_writer(w);
+}
+
+/*** path_to_file() creates an output file with the sequence of nodes that make up the path. For each node in the path, the following information is written: ID, lat, lon, g, h and name (see write_route()). ***/
+void path_to_file(const graph* g, const PathBuffer* path, const AStarStatus* info, const char* name, int evaluation, double param) {
+// the file is named (map)_(id of source)_(id of destination)_(evaluation mode)_(parameters if any).csv, after the map file without its extension
+    const char* mode_name;
+    char param_text[512] = "";                  // %f of any double fits
+    if (evaluation == 1) mode_name = "default";
+    else if (evaluation == 2) { mode_name = "weighted_"; snprintf(param_text, sizeof(param_text), "%.2f", param); }
+    else if (evaluation == 3) { mode_name = "dynamic_"; snprintf(param_text, sizeof(param_text), "%.4f", param); }
+    else if (evaluation == 4) mode_name = "bidirectional";
+    else if (evaluation == 5) mode_name = "ch";
+    else if (evaluation == 6) mode_name = "parallel";
+    else ExitError("Invalid choice of evaluation function.", 26);
+    const char *dot = strrchr(name, '.'), *slash = strrchr(name, '/');
+    int stem = (dot != NULL && (slash == NULL || dot > slash)) ? (int)(dot - name) : (int)strlen(name);
+    size_t size = stem + 2*21 + strlen(mode_name) + strlen(param_text) + 8;
+    char* filename;
+    if ((filename = (char*) malloc(size)) == NULL) ExitError("when allocating memory for the output file name", 63);
+    snprintf(filename, size, "%.*s_%lu_%lu_%s%s.csv", stem, name, (unsigned long)g->ids[path->nodes[0]], (unsigned long)g->ids[path->nodes[path->length-1]], mode_name, param_text);
+    FILE *fout;
+    if ((fout = fopen (filename, "w+")) == NULL) ExitError("the output data file cannot be created", 27);
+    free(filename);
+    RouteWriter writer;
+    init_route_writer(&writer, fout, ROUTE_CSV, false);
+    write_route(&writer, g, path, info, 0);
+    close_route_writer(&writer);
     fclose(fout);
 }
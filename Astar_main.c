@@ -3,57 +3,21 @@
 
 int main (int argc, char *argv[]) {
     
-    FILE *fin;
-    if ((fin = fopen (argv[1], "rb")) == NULL)
-        ExitError("the data file does not exist or cannot be opened", 1);
+// Map the graph: no data is read or copied, pages are loaded on demand
+    graph g;
+    load_graph(argv[1], &g);
     
-// Global data --- header    
-    unsigned long nnodes;
-    unsigned long ntotnsucc;
-    unsigned long totnamelen;
-    if( fread(&nnodes, sizeof(unsigned long), 1, fin) +
-        fread(&ntotnsucc, sizeof(unsigned long), 1, fin) +
-        fread(&totnamelen, sizeof(unsigned long), 1, fin) != 3 )
-            ExitError("when reading the header of the binary data file", 2);
-    
-// Getting memory for all data
-    node* nodes;
-    if ((nodes = (node*) malloc(nnodes*sizeof(node))) == NULL)
-        ExitError("when allocating memory for the nodes vector", 3);
-    
-    unsigned long* allsuccessors;
-    if ((allsuccessors = (unsigned long*) malloc(ntotnsucc*sizeof(unsigned long))) == NULL)
-        ExitError("when allocating memory for the edges vector", 4);
-    
-    char* allnames = NULL;
-    if((allnames = (char*) malloc((totnamelen)*sizeof(char))) == NULL) ExitError("when allocating memory for allnames vector", 5);
-    char* allnames_aux = allnames; 
-    
-// Reading all data from file
-    if( fread(nodes, sizeof(node), nnodes, fin) != nnodes )
-        ExitError("when reading nodes from the binary data file", 6);
-    
-    if( fread(allsuccessors, sizeof(unsigned long), ntotnsucc, fin) != ntotnsucc)
-        ExitError("when reading sucessors from the binary data file", 7);
-
-    if( fread(allnames, sizeof(char), totnamelen, fin) != totnamelen)
-        ExitError("when reading names from the binary data file", 8);
-    
-    fclose(fin);
-    
-// Setting pointers to successors and copying the names of all the nodes
-    unsigned long i;
-    for (i = 0; i < nnodes; i++) {
-        if(nodes[i].nsucc) {
-            nodes[i].successors = allsuccessors;
-            allsuccessors += nodes[i].nsucc;
-        }
-        if ((nodes[i].name = (char*) malloc(nodes[i].namelen + 1)) == NULL) ExitError("when allocating memory for a node name", 9);
-        strncpy(nodes[i].name, allnames, nodes[i].namelen);
-        memset(nodes[i].name + nodes[i].namelen, '\0', 1);
-        allnames += nodes[i].namelen;
-    }
-    free(allnames_aux);
+// Optional landmark file (written by landmarks_main) to strengthen the heuristic, contraction hierarchy (written by ch_main), cost profile (.profile) and patch files for the edge overlay (.patch)
+    landmarks lm;
+    ch_graph ch;
+    cost_profile profile;
+    edge_overlay overlay;
+    init_extras(&lm, &ch, &profile, &overlay);
+    int k;
+    for (k = 2; k < argc; k++) load_extra(argv[k], &g, &lm, &ch, &profile, &overlay);
+    if (g.lm != NULL) printf("\nUsing %lu landmarks.\n", lm.nlandmarks);
+    if (g.ch != NULL) printf("\nUsing the contraction hierarchy.\n");
+    if (g.profile != NULL) printf("\nUsing a cost profile: edge costs are in minutes.\n");
     
 // User chooses IDs of source and destination nodes:
     unsigned long source;             // id of source
@@ -74,14 +38,14 @@ int main (int argc, char *argv[]) {
 // input ID of starting node
     printf("ID of starting node: ");  
     if (scanf("%lu", &source) != 1) ExitError("when reading the id of starting node", 10);
-    while ( binary_search(nodes, source, 0, nnodes-1) == -1 ) {
+    while ( find_node(&g, source) == -1 ) {
         printf("Invalid choice of starting node. Please enter starting node ID again: ");
         if (scanf("%lu", &source) != 1) ExitError("when reading the ID of starting node", 11);
     }
 // input ID of destination node
     printf("ID of destination node: ");
     if (scanf("%lu", &dest) != 1) ExitError("when reading the id of destination node", 12);
-    while ( binary_search(nodes, dest, 0, nnodes-1) == -1 ) {
+    while ( find_node(&g, dest) == -1 ) {
         printf("Invalid choice of destination node. Please enter destination node ID again: ");
         if (scanf("%lu", &dest) != 1) ExitError("when reading the ID of destination node", 13);
     }
@@ -91,9 +55,12 @@ int main (int argc, char *argv[]) {
     printf("\t1 - Default:              f = g + h\n");
     printf("\t2 - Weighted:             f = (1-w)·g + w·h\n");
     printf("\t3 - Dynamic weighting:    f = g + h + e·(1-d/N)·h\n");
+    printf("\t4 - Bidirectional:        f = g + h, searching from both ends\n");
+    if (g.ch != NULL) printf("\t5 - Contraction hierarchy: bidirectional search on the hierarchy\n");
+    printf("\t6 - Parallel bidirectional: both ends searched at the same time on two threads\n");
     int evaluation = 0;
     if (scanf("%d", &evaluation) != 1) ExitError("when reading the evaluation function", 14);
-    while ( evaluation < 1 || evaluation > 3) {
+    while ( evaluation < 1 || evaluation > 6 || (evaluation == 5 && g.ch == NULL)) {
         printf("Invalid choice of evaluation function. Please enter your choice of evaluation again: ");
         if (scanf("%d", &evaluation) != 1) ExitError("when reading the evaluation function", 15);
     }
@@ -111,15 +78,19 @@ int main (int argc, char *argv[]) {
         printf("You have chosen dynamic weighting evaluation. Please input parameter e (epsilon): ");
         if (scanf("%lf", &param) != 1) ExitError("when reading the parameter for weighted evaluation", 18);
     }
+    else if (evaluation == 4) printf("You have chosen bidirectional evaluation.\n");
+    else if (evaluation == 5) printf("You have chosen the contraction hierarchy.\n");
+    else if (evaluation == 6) printf("You have chosen parallel bidirectional evaluation.\n");
     printf("\n");
     
-    AStar(nodes, source, dest, nnodes, argv[1], evaluation, param);
+    AStar(&g, source, dest, argv[1], evaluation, param);
     
-/*** Free all allocated memory ***/
-    for (i = 0; i < nnodes; i++) free(nodes[i].name);
-    free(nodes);
-    allsuccessors -= ntotnsucc;     // rewind allsuccessors pointer back to the beginning of the vector
-    free(allsuccessors);
+/*** Release the mappings ***/
+    unload_ch(&g, &ch);
+    detach_overlay(&g, &overlay);
+    unload_profile(&g, &profile);
+    unload_landmarks(&g, &lm);
+    unload_graph(&g);
             
     return 0;
 }
@@ -0,0 +1,260 @@
+#include "Astar_header.h"
+#include "Astar_func.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*** Batch routing: the graph is mapped once and a stream of queries is answered by a pool of worker threads.
+     Usage: batch_main <map.bin> <queries file or - for stdin> [number of threads] [landmark file] [hierarchy file] [cost profile] [patch file] [cache:MB] [routes file]
+     Every input line is "source_id dest_id mode [param]", with mode 1 to 6 as in Astar_main (5 needs a .ch file) (lines starting with # are skipped). Instead of
+     an id, an end of the query can be given as "lat,lon" in degrees, without spaces: it is snapped to the nearest node, whose id is then reported. Queries are numbered from 0 in input order
+     and results are written to stdout in the same order, one line per query: query|source|dest|mode|param|status|distance|expanded.
+     Status is ok, unknown_node, bad_mode or unreachable. Throughput is reported on stderr.
+     If a routes file is given (a name ending in .csv or .polyline), the route of every query that is answered is appended to it, in query
+     order, as lines "query|step|id|lat|lon|g|h|name" (.csv) or as one line "query|source|dest|distance|nodes|polyline" (.polyline), see
+     write_route(). Every worker formats its routes into its own buffer, so the output stage runs in parallel too.
+     With cache:MB, mode-1 queries go through a search cache of that many megabytes shared by the workers (see search_cache): queries
+     from a source searched before resume its search, and report only the nodes expanded to resume it. ***/
+
+#define BATCH_SIZE 8192     // number of queries read before they are dispatched to the workers
+
+/*** structure to represent a query and its result ***/
+typedef struct {
+    unsigned long source, dest;     // node ids
+    double coords[4];               // latitude and longitude of the source and of the destination when given instead of an id, NAN otherwise
+    signed long source_index, dest_index;   // their positions in the graph, -1 if unknown
+    int mode;
+    double param;
+    const char* status;
+    double distance;
+    unsigned long expanded;
+    long route_worker;              // worker whose route buffer holds the route, -1 if none
+    size_t route_start, route_end;  // position of the route in that buffer
+} batch_query;
+
+/*** state shared by the workers of one batch ***/
+typedef struct {
+    const graph* g;
+    batch_query* queries;
+    unsigned long nqueries;
+    unsigned long first;            // number of the first query of the batch
+    bool routes;                    // the routes are written out
+    search_cache* cache;            // searches kept for mode-1 queries, NULL if none
+    atomic_ulong next;              // next query to be claimed by a worker
+} batch_state;
+
+typedef struct {
+    batch_state* state;
+    SearchContext ctx;              // search state of the worker, reused for all its queries
+    SearchContext bwd;              // backward search state for bidirectional queries
+    long id;
+    PathBuffer path;                // route of the last query
+    RouteWriter routes;             // routes of the worker in the current batch, written out by the main thread
+} batch_worker;
+
+/*** answer_query() solves one query, whose nodes have already been looked up, with the search context of the calling worker or, for mode 1 with a cache, with an entry of the cache, which is stored in entry (NULL otherwise) and must be released once the route is read ***/
+void answer_query (const graph* g, search_cache* cache, SearchContext* ctx, SearchContext* bwd, batch_query* q, cached_search** entry) {
+    q->distance = INFINITY;
+    q->expanded = 0;
+    *entry = NULL;
+    signed long source_index = q->source_index;
+    signed long dest_index = q->dest_index;
+    if (source_index == -1 || dest_index == -1) { q->status = "unknown_node"; return; }
+    if (q->mode < 1 || q->mode > 6 || (q->mode == 5 && g->ch == NULL)) { q->status = "bad_mode"; return; }
+    bool found;
+    if (cache != NULL && q->mode == 1) {
+        *entry = run_cached_search(cache, g, ctx, bwd, (unsigned long)source_index, (unsigned long)dest_index, &found, &q->expanded);
+        if (*entry != NULL) ctx = &(*entry)->ctx;
+    }
+    else found = run_search(g, ctx, bwd, (unsigned long)source_index, (unsigned long)dest_index, q->mode, q->param, &q->expanded);
+    if (!found) { q->status = "unreachable"; return; }
+    q->status = "ok";
+    q->distance = ctx->progress[dest_index].g;
+}
+
+/*** worker() claims queries of the current batch one at a time until none is left ***/
+void* worker (void* arg) {
+    batch_worker* self = (batch_worker*) arg;
+    batch_state* state = self->state;
+    unsigned long k;
+    while ((k = atomic_fetch_add(&state->next, 1)) < state->nqueries) {
+        batch_query* q = &state->queries[k];
+        cached_search* entry;
+        answer_query(state->g, state->cache, &self->ctx, &self->bwd, q, &entry);
+        const AStarStatus* progress = entry != NULL ? entry->ctx.progress : self->ctx.progress;
+        q->route_worker = -1;
+        if (state->routes && strcmp(q->status, "ok") == 0) {
+            build_path(progress, state->g->nnodes, (unsigned long)q->source_index, (unsigned long)q->dest_index, &self->path);
+            if (!is_path_correct(&self->path, state->g, (unsigned long)q->source_index, (unsigned long)q->dest_index)) ExitError("the computed path is not correct", 25);
+            q->route_worker = self->id;
+            q->route_start = self->routes.used;
+            write_route(&self->routes, state->g, &self->path, progress, state->first + k);
+            q->route_end = self->routes.used;
+        }
+        release_cached_search(state->cache, state->g, entry);
+    }
+    return NULL;
+}
+
+/*** resolve_queries() looks up the source and destination ids of n queries with one batched index lookup, and snaps the ends given as coordinates with one batched nearest_nodes() ***/
+void resolve_queries (const graph* g, batch_query* queries, unsigned long n, uint64_t* ids, signed long* positions, double* lats, double* lons, unsigned long* snapped) {
+    unsigned long k, nsnap = 0;
+    int end;
+    for (k = 0; k < n; k++) { ids[2*k] = queries[k].source; ids[2*k+1] = queries[k].dest; }
+    find_nodes(g, ids, positions, 2*n);
+    for (k = 0; k < n; k++) { queries[k].source_index = positions[2*k]; queries[k].dest_index = positions[2*k+1]; }
+    for (k = 0; k < n; k++)
+        for (end = 0; end < 2; end++)
+            if (!isnan(queries[k].coords[2*end])) { lats[nsnap] = queries[k].coords[2*end]; lons[nsnap] = queries[k].coords[2*end+1]; nsnap += 1; }
+    if (nsnap == 0) return;
+    nearest_nodes(g, lats, lons, nsnap, snapped);
+    nsnap = 0;
+    for (k = 0; k < n; k++) {
+        batch_query* q = &queries[k];
+        if (!isnan(q->coords[0])) { q->source_index = (signed long)snapped[nsnap++]; q->source = g->ids[q->source_index]; }
+        if (!isnan(q->coords[2])) { q->dest_index = (signed long)snapped[nsnap++]; q->dest = g->ids[q->dest_index]; }
+    }
+}
+
+/*** parse_end() reads an end of a query, a node id or "lat,lon" ***/
+void parse_end (const char* token, unsigned long* id, double* coords) {
+    const char* comma = strchr(token, ',');
+    coords[0] = coords[1] = NAN;
+    *id = 0;
+    if (comma == NULL) { *id = strtoul(token, NULL, 10); return; }
+    coords[0] = strtod(token, NULL);
+    coords[1] = strtod(comma + 1, NULL);
+}
+
+/*** read_queries() reads up to max queries from fin and returns how many were read ***/
+unsigned long read_queries (FILE* fin, batch_query* queries, unsigned long max, char** line_buf, size_t* line_buf_size) {
+    unsigned long n = 0;
+    while (n < max && getline(line_buf, line_buf_size, fin) >= 0) {
+        if (**line_buf == '#' || **line_buf == '\n') continue;
+        batch_query* q = &queries[n];
+        q->param = 0;
+        char source[64], dest[64];
+        int fields = sscanf(*line_buf, "%63s %63s %d %lf", source, dest, &q->mode, &q->param);
+        if (fields < 3) ExitError("when reading a query: expected source id, destination id and mode", 31);
+        parse_end(source, &q->source, &q->coords[0]);
+        parse_end(dest, &q->dest, &q->coords[2]);
+        n += 1;
+    }
+    return n;
+}
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 3) ExitError("usage: batch_main <map.bin> <queries file or -> [number of threads] [landmark file] [hierarchy file] [cost profile] [patch file] [cache:MB] [routes file]", 30);
+    graph g;
+    load_graph(argv[1], &g);
+    landmarks lm;
+    ch_graph ch;
+    cost_profile profile;
+    edge_overlay overlay;
+    init_extras(&lm, &ch, &profile, &overlay);
+    int extra;
+    FILE* routes_file = NULL;
+    RouteWriter routes;
+    search_cache cache;
+    long cache_mb = -1;
+    for (extra = 4; extra < argc; extra++) {
+        if (strncmp(argv[extra], "cache:", 6) == 0) { cache_mb = atol(argv[extra] + 6); continue; }
+        size_t len = strlen(argv[extra]);
+        bool csv = len >= 4 && strcmp(argv[extra] + len - 4, ".csv") == 0;
+        bool polyline = len >= 9 && strcmp(argv[extra] + len - 9, ".polyline") == 0;
+        if (!csv && !polyline) { load_extra(argv[extra], &g, &lm, &ch, &profile, &overlay); continue; }
+        if (routes_file != NULL) ExitError("only one routes file can be given", 29);
+        if ((routes_file = fopen(argv[extra], "w")) == NULL) ExitError("the routes file cannot be created", 29);
+        init_route_writer(&routes, routes_file, polyline ? ROUTE_POLYLINE : ROUTE_CSV, true);
+    }
+
+    FILE* fin = stdin;
+    if (strcmp(argv[2], "-") != 0 && (fin = fopen(argv[2], "r")) == NULL) ExitError("the queries file does not exist or cannot be opened", 32);
+    long nthreads = (argc > 3) ? atol(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+
+// one search context per worker, allocated once
+    batch_state state;
+    state.g = &g;
+    state.routes = routes_file != NULL;
+    state.cache = NULL;
+    if (cache_mb >= 0) {
+        init_search_cache(&cache, (unsigned long)cache_mb << 20);
+        state.cache = &cache;
+    }
+    batch_worker* workers = NULL;
+    pthread_t* threads = NULL;
+    if ((workers = (batch_worker*) malloc(nthreads*sizeof(batch_worker))) == NULL ||
+        (threads = (pthread_t*) malloc(nthreads*sizeof(pthread_t))) == NULL) ExitError("when allocating memory for the workers", 33);
+    long t;
+    for (t = 0; t < nthreads; t++) {
+        workers[t].state = &state;
+        workers[t].id = t;
+        init_search_context(&workers[t].ctx, &g);
+        init_search_context(&workers[t].bwd, &g);
+        init_path_buffer(&workers[t].path);
+        init_route_writer(&workers[t].routes, NULL, routes_file != NULL ? routes.format : ROUTE_CSV, true);
+    }
+    uint64_t* lookup_ids = NULL;
+    signed long* lookup_positions = NULL;
+    double* snap_lats = NULL;
+    double* snap_lons = NULL;
+    unsigned long* snapped = NULL;
+    if ((state.queries = (batch_query*) malloc(BATCH_SIZE*sizeof(batch_query))) == NULL ||
+        (lookup_ids = (uint64_t*) malloc(2*BATCH_SIZE*sizeof(uint64_t))) == NULL ||
+        (lookup_positions = (signed long*) malloc(2*BATCH_SIZE*sizeof(signed long))) == NULL ||
+        (snap_lats = (double*) malloc(2*BATCH_SIZE*sizeof(double))) == NULL ||
+        (snap_lons = (double*) malloc(2*BATCH_SIZE*sizeof(double))) == NULL ||
+        (snapped = (unsigned long*) malloc(2*BATCH_SIZE*sizeof(unsigned long))) == NULL) ExitError("when allocating memory for the queries", 33);
+
+    char* line_buf = NULL;
+    size_t line_buf_size = 0;
+    unsigned long total = 0, expanded = 0, k;
+    double start = monotonic_seconds();
+    printf("query|source|dest|mode|param|status|distance|expanded\n");
+    while ((state.nqueries = read_queries(fin, state.queries, BATCH_SIZE, &line_buf, &line_buf_size)) > 0) {
+        resolve_queries(&g, state.queries, state.nqueries, lookup_ids, lookup_positions, snap_lats, snap_lons, snapped);
+        atomic_store(&state.next, 0);
+        state.first = total;
+        for (t = 0; t < nthreads; t++)
+            if (pthread_create(&threads[t], NULL, worker, &workers[t]) != 0) ExitError("when creating a worker thread", 34);
+        for (t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+        for (k = 0; k < state.nqueries; k++) {                      // results of the batch, in input order
+            batch_query* q = &state.queries[k];
+            printf("%lu|%lu|%lu|%d|%g|%s|%.7f|%lu\n", total + k, q->source, q->dest, q->mode, q->param, q->status, q->distance, q->expanded);
+            expanded += q->expanded;
+            if (q->route_worker >= 0) {
+                route_text(&routes, workers[q->route_worker].routes.buffer + q->route_start, q->route_end - q->route_start);
+                if (routes.used >= ROUTE_FLUSH_SIZE) flush_route_writer(&routes);
+            }
+        }
+        for (t = 0; t < nthreads; t++) workers[t].routes.used = 0;
+        total += state.nqueries;
+    }
+    fflush(stdout);
+    if (routes_file != NULL) { close_route_writer(&routes); fclose(routes_file); }
+    double seconds = monotonic_seconds() - start;
+    fprintf(stderr, "%lu queries in %.3f s with %ld threads: %.1f queries/s, %.1f queries/s per thread, %.0f expanded nodes/s\n",
+            total, seconds, nthreads, total / seconds, total / seconds / nthreads, expanded / seconds);
+    if (state.cache != NULL)
+        fprintf(stderr, "Search cache: %lu searches resumed, %lu started, %lu queries without the cache, %lu entries in %lu bytes\n",
+                cache.hits, cache.misses, cache.bypasses, cache.nentries, cache.bytes);
+
+/*** Free all allocated memory ***/
+    for (t = 0; t < nthreads; t++) {
+        free_search_context(&workers[t].ctx);
+        free_search_context(&workers[t].bwd);
+        free_path_buffer(&workers[t].path);
+        close_route_writer(&workers[t].routes);
+    }
+    free(workers); free(threads); free(state.queries); free(lookup_ids); free(lookup_positions); free(line_buf);
+    free(snap_lats); free(snap_lons); free(snapped);
+    if (state.cache != NULL) free_search_cache(&cache, &g);
+    if (fin != stdin) fclose(fin);
+    unload_ch(&g, &ch);
+    detach_overlay(&g, &overlay);
+    unload_profile(&g, &profile);
+    unload_landmarks(&g, &lm);
+    unload_graph(&g);
+    return 0;
+}
@@ -0,0 +1,300 @@
+#include "Astar_header.h"
+#include "Astar_func.h"
+#include <sys/resource.h>
+
+/*** Benchmark of the search modes on reproducible query sets, with the results written as JSON to stdout.
+     Usage: bench_main <map.bin or grid:WIDTH> [queries per set, default 100] [seed, default 1] [landmark, hierarchy, cost profile and patch files...]
+     With grid:WIDTH the map is a WIDTH x WIDTH grid generated in memory (each node linked to its four neighbours, every edge longer than
+     the straight line by a random factor of up to BENCH_GRID_DETOUR), so the benchmark runs without any data file. All randomness comes
+     from the seed, so the same arguments give the same queries on every machine.
+     Query sets: "uniform" pairs nodes drawn uniformly, and "rank_2^k" pairs each of its random sources with the node settled in position
+     2^k by a Dijkstra search from it (the Dijkstra rank), which groups queries by how far apart their nodes are in the search order.
+     Every set is answered with modes 1 to 4 and 6, and 5 if a hierarchy file is given. For every set and mode the report has the latency
+     percentiles, the speedup of the mean latency over mode 1 (the serial search of AStar()), the expanded nodes, scanned (relaxed) edges and decrease-keys per query, the largest OPEN list, the memory of the search
+     contexts after the set, the number of routes found and how their distances compare with mode 1 (mismatches for the exact modes, mean
+     excess for the weighted ones). The peak resident memory of the process is reported at the end. ***/
+
+#define BENCH_GRID_DETOUR 0.5       // grid edges are up to 50% longer than the distance between their nodes
+#define BENCH_WEIGHT 0.6            // parameter of the weighted evaluation (mode 2)
+#define BENCH_EPSILON 0.5           // parameter of the dynamic weighting (mode 3)
+#define BENCH_TOLERANCE 1e-9        // relative difference allowed between the distances of two exact modes
+
+/*** structure to represent a query of a set, with the distance found by mode 1 as reference ***/
+typedef struct {
+    unsigned long source_index, dest_index;
+    double reference;
+} bench_query;
+
+typedef struct {
+    char name[32];
+    bench_query* queries;
+    unsigned long nqueries;
+    double reference_seconds;       // time taken by mode 1 on the set
+} bench_set;
+
+/*** structure to hold a node reached by a Dijkstra search, to sort them by distance ***/
+typedef struct {
+    double g;
+    node_index index;
+} bench_reached;
+
+/*** bench_random() is the splitmix64 generator: small, fast and the same on every platform ***/
+uint64_t bench_random (uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/*** bench_uniform() is a random number in [0, 1) ***/
+double bench_uniform (uint64_t* state) {
+    return (double)(bench_random(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/*** build_grid_graph() fills g with a width x width grid held in memory (g->map stays NULL, see free_grid_graph()). Node k is at row k / width and column k % width, about 200 m apart, and has id 1000 + 7k. ***/
+void build_grid_graph (graph* g, unsigned long width, uint64_t seed) {
+    unsigned long n = width * width, k, e = 0;
+    uint64_t state = seed;
+    uint64_t *ids = NULL, *index_ids = NULL, *index_pos = NULL, *first = NULL, *rfirst = NULL, *name_first = NULL;
+    edge_target *targets = NULL, *rtargets = NULL;
+    double *lat = NULL, *lon = NULL, *weights = NULL, *rweights = NULL;
+    point3* unit = NULL;
+    char* names = NULL;
+    unsigned long max_edges = 4 * n;
+    if ((ids = (uint64_t*) malloc(n*sizeof(uint64_t))) == NULL ||
+        (index_ids = (uint64_t*) malloc((n+1)*sizeof(uint64_t))) == NULL ||
+        (index_pos = (uint64_t*) malloc((n+1)*sizeof(uint64_t))) == NULL ||
+        (lat = (double*) malloc(n*sizeof(double))) == NULL ||
+        (lon = (double*) malloc(n*sizeof(double))) == NULL ||
+        (unit = (point3*) malloc(n*sizeof(point3))) == NULL ||
+        (first = (uint64_t*) malloc((n+1)*sizeof(uint64_t))) == NULL ||
+        (targets = (edge_target*) malloc(max_edges*sizeof(edge_target))) == NULL ||
+        (weights = (double*) malloc(max_edges*sizeof(double))) == NULL ||
+        (rfirst = (uint64_t*) calloc(n+1, sizeof(uint64_t))) == NULL ||
+        (rtargets = (edge_target*) malloc(max_edges*sizeof(edge_target))) == NULL ||
+        (rweights = (double*) malloc(max_edges*sizeof(double))) == NULL ||
+        (name_first = (uint64_t*) calloc(n+1, sizeof(uint64_t))) == NULL ||
+        (names = (char*) calloc(1, 1)) == NULL) ExitError("when allocating memory for the grid graph", 60);
+    for (k = 0; k < n; k++) {
+        ids[k] = 1000 + 7*k;
+        lat[k] = 41.0 + 0.0018 * (double)(k / width) + 0.0005 * (bench_uniform(&state) - 0.5);
+        lon[k] = 1.5 + 0.0024 * (double)(k % width) + 0.0005 * (bench_uniform(&state) - 0.5);
+        unit[k] = unit_vector(lat[k], lon[k]);
+    }
+    for (k = 0; k < n; k++) {
+        unsigned long row = k / width, col = k % width, neighbour[4], d, m = 0;
+        if (row > 0) neighbour[m++] = k - width;
+        if (col > 0) neighbour[m++] = k - 1;
+        if (col + 1 < width) neighbour[m++] = k + 1;
+        if (row + 1 < width) neighbour[m++] = k + width;
+        first[k] = e;
+        for (d = 0; d < m; d++) {
+            targets[e] = neighbour[d];
+            weights[e] = haversine(lat[k], lon[k], lat[neighbour[d]], lon[neighbour[d]]) * (1 + BENCH_GRID_DETOUR * bench_uniform(&state));
+            rfirst[neighbour[d] + 1] += 1;
+            e += 1;
+        }
+    }
+    first[n] = e;
+// reverse adjacency by counting sort on the targets
+    for (k = 0; k < n; k++) rfirst[k+1] += rfirst[k];
+    uint64_t* fill = NULL;
+    if ((fill = (uint64_t*) malloc(n*sizeof(uint64_t))) == NULL) ExitError("when allocating memory for the grid graph", 60);
+    memcpy(fill, rfirst, n*sizeof(uint64_t));
+    for (k = 0; k < n; k++) {
+        uint64_t j;
+        for (j = first[k]; j < first[k+1]; j++) {
+            rtargets[fill[targets[j]]] = k;
+            rweights[fill[targets[j]]] = weights[j];
+            fill[targets[j]] += 1;
+        }
+    }
+    free(fill);
+    build_id_index(ids, n, index_ids, index_pos);
+    build_node_grid(&g->grid, lat, lon, n);
+    g->nnodes = n;
+    g->nedges = e;
+    g->ids = ids; g->index_ids = index_ids; g->index_pos = index_pos;
+    g->lat = lat; g->lon = lon; g->unit = unit;
+    g->first = first; g->targets = targets; g->weights = weights;
+    g->rfirst = rfirst; g->rtargets = rtargets; g->rweights = rweights;
+    g->name_first = name_first; g->names = names;
+    g->map = NULL;
+    g->map_size = 0;
+    g->lm = NULL;
+    g->ch = NULL;
+    g->attrs = g->rattrs = NULL;        // no road classes: cost profiles cannot be applied to the grid
+    g->profile = NULL;
+    g->overlay = NULL;
+    g->penalties = NULL;
+    g->bound_scale = R;
+}
+
+void free_grid_graph (graph* g) {
+    free((void*)g->ids); free((void*)g->index_ids); free((void*)g->index_pos);
+    free((void*)g->lat); free((void*)g->lon); free((void*)g->unit);
+    free((void*)g->first); free((void*)g->targets); free((void*)g->weights);
+    free((void*)g->rfirst); free((void*)g->rtargets); free((void*)g->rweights);
+    free((void*)g->name_first); free((void*)g->names);
+    free((void*)g->grid.first); free((void*)g->grid.nodes);
+}
+
+int compare_reached (const void* a, const void* b) {
+    const bench_reached* x = (const bench_reached*)a;
+    const bench_reached* y = (const bench_reached*)b;
+    if (x->g != y->g) return (x->g > y->g) - (x->g < y->g);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+int compare_doubles (const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+/*** make_sets() draws the uniform set and the Dijkstra rank sets, nqueries each (rank sets may have fewer when a source reaches fewer nodes than the rank). It returns the number of sets. ***/
+unsigned long make_sets (const graph* g, SearchContext* ctx, unsigned long nqueries, uint64_t seed, bench_set** sets) {
+    unsigned long nranks = 0, nsets, i, r;
+    while ((1UL << (nranks + 1)) < g->nnodes) nranks += 1;                 // ranks 2^1 ... 2^nranks
+    nsets = 1 + nranks;
+    if ((*sets = (bench_set*) calloc(nsets, sizeof(bench_set))) == NULL) ExitError("when allocating memory for the query sets", 61);
+    for (i = 0; i < nsets; i++)
+        if (((*sets)[i].queries = (bench_query*) malloc((nqueries ? nqueries : 1)*sizeof(bench_query))) == NULL) ExitError("when allocating memory for the query sets", 61);
+    uint64_t state = seed;
+    strcpy((*sets)[0].name, "uniform");
+    for (i = 0; i < nqueries; i++) {
+        bench_query* q = &(*sets)[0].queries[(*sets)[0].nqueries++];
+        q->source_index = bench_random(&state) % g->nnodes;
+        q->dest_index = bench_random(&state) % g->nnodes;
+    }
+    for (r = 1; r <= nranks; r++) sprintf((*sets)[r].name, "rank_2^%lu", r);
+    bench_reached* reached = NULL;
+    if ((reached = (bench_reached*) malloc(g->nnodes*sizeof(bench_reached))) == NULL) ExitError("when allocating memory for the query sets", 61);
+    for (i = 0; i < nqueries; i++) {
+        unsigned long source_index = bench_random(&state) % g->nnodes, nreached = 0, k;
+        dijkstra_search(g, ctx, source_index, false);
+        for (k = 0; k < ctx->ntouched; k++) {
+            node_index v = ctx->touched[k];
+            if (ctx->progress[v].g < INFINITY) { reached[nreached].g = ctx->progress[v].g; reached[nreached].index = v; nreached += 1; }
+        }
+        qsort(reached, nreached, sizeof(bench_reached), compare_reached);
+        for (r = 1; r <= nranks && (1UL << r) < nreached; r++) {
+            bench_query* q = &(*sets)[r].queries[(*sets)[r].nqueries++];
+            q->source_index = source_index;
+            q->dest_index = reached[1UL << r].index;
+        }
+    }
+    free(reached);
+    return nsets;
+}
+
+/*** run_set() answers all queries of a set with one mode on fresh search contexts and writes its JSON object. Mode 1 stores its distances and its time as the reference of the other modes. ***/
+void run_set (const graph* g, bench_set* set, int mode, double param, double* latencies, bool last) {
+    SearchContext fwd, bwd;
+    init_search_context(&fwd, g);
+    init_search_context(&bwd, g);
+    unsigned long i, expanded, total_expanded = 0, total_relaxed = 0, total_decrease_keys = 0, peak_open = 0, found = 0, mismatches = 0;
+    double total_seconds = 0, excess = 0;
+    for (i = 0; i < set->nqueries; i++) {
+        bench_query* q = &set->queries[i];
+        double start = monotonic_seconds();
+        bool ok = run_search(g, &fwd, &bwd, q->source_index, q->dest_index, mode, param, &expanded);
+        latencies[i] = monotonic_seconds() - start;
+        total_seconds += latencies[i];
+        total_expanded += expanded;
+        total_relaxed += fwd.stats.relaxed;
+        total_decrease_keys += fwd.stats.decrease_keys;
+        if (fwd.stats.peak_open > peak_open) peak_open = fwd.stats.peak_open;
+        double distance = ok ? fwd.progress[q->dest_index].g : INFINITY;
+        if (mode == 1) q->reference = distance;
+        if (ok) found += 1;
+        if (mode == 2 || mode == 3) { if (ok && q->reference > 0) excess += distance / q->reference - 1; }
+        else if (!(distance == q->reference || fabs(distance - q->reference) <= BENCH_TOLERANCE * fmax(1, q->reference))) mismatches += 1;
+    }
+    if (mode == 1) set->reference_seconds = total_seconds;
+    qsort(latencies, set->nqueries, sizeof(double), compare_doubles);
+    unsigned long n = set->nqueries ? set->nqueries : 1, top = set->nqueries ? set->nqueries - 1 : 0;
+    double p50 = set->nqueries ? latencies[top * 50 / 100] : 0, p90 = set->nqueries ? latencies[top * 90 / 100] : 0;
+    double p99 = set->nqueries ? latencies[top * 99 / 100] : 0, max = set->nqueries ? latencies[top] : 0;
+    printf("        {\"mode\": %d, \"param\": %g, \"found\": %lu, ", mode, param, found);
+    if (mode == 2 || mode == 3) printf("\"mean_excess\": %.6g, ", found ? excess / found : 0);
+    else printf("\"mismatches\": %lu, ", mismatches);
+    printf("\"latency_ms\": {\"mean\": %.4f, \"p50\": %.4f, \"p90\": %.4f, \"p99\": %.4f, \"max\": %.4f}, \"speedup\": %.3f, ",
+           1e3 * total_seconds / n, 1e3 * p50, 1e3 * p90, 1e3 * p99, 1e3 * max, total_seconds > 0 ? set->reference_seconds / total_seconds : 0);
+    printf("\"expanded_nodes\": %.1f, \"relaxed_edges\": %.1f, \"decrease_keys\": %.1f, \"peak_open\": %lu, \"search_state_bytes\": %lu}%s\n",
+           (double)total_expanded / n, (double)total_relaxed / n, (double)total_decrease_keys / n, peak_open,
+           search_context_bytes(&fwd) + search_context_bytes(&bwd), last ? "" : ",");
+    free_search_context(&fwd);
+    free_search_context(&bwd);
+}
+
+/*** print_json_string() prints text as a JSON string, quotes included, escaping quotes, backslashes and control characters ***/
+void print_json_string (const char* text) {
+    putchar('"');
+    for (; *text != '\0'; text++) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') printf("\\%c", c);
+        else if (c < 0x20) printf("\\u%04x", c);
+        else putchar(c);
+    }
+    putchar('"');
+}
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 2) ExitError("usage: bench_main <map.bin or grid:WIDTH> [queries per set] [seed] [landmark, hierarchy, cost profile and patch files...]", 1);
+    graph g;
+    bool grid = strncmp(argv[1], "grid:", 5) == 0;
+    unsigned long nqueries = (argc > 2) ? strtoul(argv[2], NULL, 10) : 100;
+    uint64_t seed = (argc > 3) ? strtoull(argv[3], NULL, 10) : 1;
+    if (grid) {
+        unsigned long width = strtoul(argv[1] + 5, NULL, 10);
+        if (width < 2) ExitError("the grid must be at least 2 nodes wide", 60);
+        build_grid_graph(&g, width, seed);
+    }
+    else load_graph(argv[1], &g);
+    landmarks lm;
+    ch_graph ch;
+    cost_profile profile;
+    edge_overlay overlay;
+    init_extras(&lm, &ch, &profile, &overlay);
+    int extra;
+    for (extra = 4; extra < argc; extra++) load_extra(argv[extra], &g, &lm, &ch, &profile, &overlay);
+
+    SearchContext ctx;
+    init_search_context(&ctx, &g);
+    bench_set* sets = NULL;
+    unsigned long nsets = make_sets(&g, &ctx, nqueries, seed, &sets), s;
+    free_search_context(&ctx);
+    double* latencies = NULL;
+    if ((latencies = (double*) malloc((nqueries ? nqueries : 1)*sizeof(double))) == NULL) ExitError("when allocating memory for the latencies", 61);
+
+    int modes[6] = {1, 2, 3, 4, 6, 5};
+    double params[6] = {0, BENCH_WEIGHT, BENCH_EPSILON, 0, 0, 0};
+    int nmodes = (g.ch != NULL) ? 6 : 5, m;
+    printf("{\n  \"graph\": {\"source\": ");
+    print_json_string(argv[1]);
+    printf(", \"nodes\": %lu, \"edges\": %lu, \"landmarks\": %s, \"hierarchy\": %s},\n",
+           g.nnodes, g.nedges, g.lm != NULL ? "true" : "false", g.ch != NULL ? "true" : "false");
+    printf("  \"seed\": %llu,\n  \"queries_per_set\": %lu,\n  \"sets\": [\n", (unsigned long long)seed, nqueries);
+    for (s = 0; s < nsets; s++) {
+        printf("    {\"name\": \"%s\", \"queries\": %lu, \"results\": [\n", sets[s].name, sets[s].nqueries);
+        for (m = 0; m < nmodes; m++) run_set(&g, &sets[s], modes[m], params[m], latencies, m == nmodes - 1);
+        printf("    ]}%s\n", s + 1 < nsets ? "," : "");
+        fflush(stdout);
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    printf("  ],\n  \"peak_rss_kb\": %ld\n}\n", usage.ru_maxrss);
+
+/*** Free all allocated memory ***/
+    for (s = 0; s < nsets; s++) free(sets[s].queries);
+    free(sets);
+    free(latencies);
+    unload_ch(&g, &ch);
+    detach_overlay(&g, &overlay);
+    unload_profile(&g, &profile);
+    unload_landmarks(&g, &lm);
+    if (grid) free_grid_graph(&g);
+    else unload_graph(&g);
+    return 0;
+}
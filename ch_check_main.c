@@ -0,0 +1,81 @@
+#include "Astar_header.h"
+#include "Astar_func.h"
+
+/*** Cross-check of the contraction hierarchy against plain A*.
+     Usage: ch_check_main <map.bin> <map.ch> [number of pairs, default 1000] [seed]
+     Random pairs of nodes are answered with astar_search() in mode 1 and with ch_search(). Both must agree on whether the destination is
+     reachable and on the distance (up to rounding, since the hierarchy adds weights in a different order); the path unpacked from the
+     hierarchy must be made of edges of the graph and add up to the same distance. Average query times and the speedup are reported and
+     the program exits with status 1 if any pair disagrees. ***/
+
+#define CH_CHECK_TOLERANCE 1e-9     // relative difference allowed between the two distances
+
+/*** unpacked_length() adds up the original edge weights along the parent chain of dest in ctx, or returns -1 if some step is not an edge of the graph ***/
+double unpacked_length (const graph* g, SearchContext* ctx, unsigned long source_index, unsigned long dest_index) {
+    double length = 0;
+    unsigned long cur_index = dest_index;
+    while (cur_index != source_index) {
+        unsigned long parent = ctx->progress[cur_index].parent;
+        double best = INFINITY;
+        uint64_t k;
+        for (k = g->first[parent]; k < g->first[parent+1]; k++)
+            if (g->targets[k] == cur_index && g->weights[k] < best) best = g->weights[k];
+        if (best == INFINITY) return -1;
+        length += best;
+        cur_index = parent;
+    }
+    return length;
+}
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 3) ExitError("usage: ch_check_main <map.bin> <map.ch> [number of pairs] [seed]", 1);
+    graph g;
+    load_graph(argv[1], &g);
+    ch_graph ch;
+    load_ch(argv[2], &g, &ch);
+    unsigned long npairs = (argc > 3) ? strtoul(argv[3], NULL, 10) : 1000;
+    srand((argc > 4) ? (unsigned)strtoul(argv[4], NULL, 10) : 1);
+
+    SearchContext fwd, bwd;
+    init_search_context(&fwd, &g);
+    init_search_context(&bwd, &g);
+    unsigned long i, mismatches = 0, unreachable = 0, astar_expanded = 0, ch_expanded = 0, expanded;
+    double astar_seconds = 0, ch_seconds = 0;
+    double start;
+    for (i = 0; i < npairs; i++) {
+        unsigned long s = (unsigned long)rand() % g.nnodes;
+        unsigned long t = (unsigned long)rand() % g.nnodes;
+        start = monotonic_seconds();
+        bool astar_found = astar_search(&g, &fwd, s, t, 1, 0, &expanded);
+        astar_seconds += monotonic_seconds() - start;
+        astar_expanded += expanded;
+        double astar_distance = astar_found ? fwd.progress[t].g : INFINITY;
+        start = monotonic_seconds();
+        bool ch_found = ch_search(&g, &fwd, &bwd, s, t, &expanded);
+        ch_seconds += monotonic_seconds() - start;
+        ch_expanded += expanded;
+        double ch_distance = ch_found ? fwd.progress[t].g : INFINITY;
+        if (!astar_found) unreachable += 1;
+        bool agree = astar_found == ch_found;
+        if (agree && ch_found) {
+            double path_length = unpacked_length(&g, &fwd, s, t);
+            double tolerance = CH_CHECK_TOLERANCE * (astar_distance > 1 ? astar_distance : 1);
+            agree = fabs(ch_distance - astar_distance) <= tolerance && path_length >= 0 && fabs(path_length - astar_distance) <= tolerance;
+        }
+        if (!agree) {
+            mismatches += 1;
+            printf("Mismatch: ID %lu to ID %lu, A* %.7f km, hierarchy %.7f km.\n", (unsigned long)g.ids[s], (unsigned long)g.ids[t], astar_distance, ch_distance);
+        }
+    }
+    printf("%lu pairs checked (%lu unreachable), %lu mismatches.\n", npairs, unreachable, mismatches);
+    printf("A*:        %.3f ms and %.1f expanded nodes per query.\n", 1e3 * astar_seconds / npairs, (double)astar_expanded / npairs);
+    printf("Hierarchy: %.3f ms and %.1f settled nodes per query, %.1f times faster.\n", 1e3 * ch_seconds / npairs, (double)ch_expanded / npairs, astar_seconds / ch_seconds);
+
+/*** Free all allocated memory ***/
+    free_search_context(&fwd);
+    free_search_context(&bwd);
+    unload_ch(&g, &ch);
+    unload_graph(&g);
+    return mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,227 @@
+#include "Astar_header.h"
+#include "Astar_func.h"
+
+/*** Contraction hierarchy preprocessing.
+     Usage: ch_main <map.bin>
+     Nodes are contracted one by one in the order of their priority: edge difference (shortcuts added minus edges removed) plus the number of
+     neighbours already contracted. Witness searches stop once all the successors of the contracted node are settled. Contracting v adds a shortcut u->x for every pair of edges u->v->x unless a witness search from u that
+     avoids v finds a path to x that is not longer. The rank of every node and the edges of the hierarchy are written to <map>.ch
+     (see CHFileHeader), which Astar_main, batch_main and ch_check_main can load. ***/
+
+#define WITNESS_SETTLE_LIMIT 500    // nodes settled by a witness search before giving up and adding the shortcut
+#define PRIORITY_SETTLE_LIMIT 50    // the same when the search only estimates the priority of a node
+#define NEIGHBOUR_UPDATE_DEGREE 8   // neighbours of a contracted node with more edges than this are left to the lazy update
+
+/*** list of the edges of a node to (or from) nodes that are not contracted yet. Once the node is contracted its lists are final and become its upward and downward edges. ***/
+typedef struct {
+    CHEdge* edges;
+    unsigned long n, capacity;
+} edge_list;
+
+/*** add_edge() adds an edge to node with the given weight to the list, or lowers the weight of the existing one if the new edge is shorter. ***/
+void add_edge (edge_list* list, unsigned long node, double weight, uint64_t middle) {
+    unsigned long k;
+    for (k = 0; k < list->n; k++) {
+        if (list->edges[k].node != node) continue;
+        if (weight < list->edges[k].weight) { list->edges[k].weight = weight; list->edges[k].middle = middle; }
+        return;
+    }
+    if (list->n == list->capacity) {
+        list->capacity = list->capacity ? 2*list->capacity : 4;
+        if ((list->edges = (CHEdge*) realloc(list->edges, list->capacity*sizeof(CHEdge))) == NULL) ExitError("when allocating memory for the hierarchy edges", 2);
+    }
+    list->edges[list->n].node = node;
+    list->edges[list->n].middle = middle;
+    list->edges[list->n].weight = weight;
+    list->n += 1;
+}
+
+void remove_edge (edge_list* list, unsigned long node) {
+    unsigned long k;
+    for (k = 0; k < list->n; k++) if (list->edges[k].node == node) { list->edges[k] = list->edges[--list->n]; return; }
+}
+
+/*** state of the contraction: the remaining graph, as lists of edges to and from every node, and the scratch space of the witness searches ***/
+typedef struct {
+    const graph* g;
+    edge_list* out;
+    edge_list* in;
+    unsigned long* deleted;     // number of neighbours of every node already contracted
+    bool* is_target;            // marks the successors of the node being contracted, false everywhere between contractions
+    SearchContext witness;
+} contraction;
+
+/*** witness_search() runs a Dijkstra search from source along the remaining graph that avoids node skip. It stops after settling limit nodes, once every node left in OPEN is farther than max_cost, or once the targets nodes marked in is_target are all settled. Any finite g in the witness context afterwards is the length of an actual path, so it can serve as a witness. ***/
+void witness_search (contraction* c, unsigned long source, unsigned long skip, double max_cost, unsigned long limit, unsigned long targets) {
+    SearchContext* ctx = &c->witness;
+    reset_search_context(ctx);
+    AStarStatus* progress = ctx->progress;
+    touch_node(ctx, source);
+    progress[source].g = 0;
+    progress[source].h = 0;
+    insert_to_OPEN(source, progress, &ctx->OPEN, c->g, 1, 0, source, source);
+    unsigned long settled = 0;
+    while (ctx->OPEN.size > 0 && ctx->OPEN.heap[0].f <= max_cost && settled < limit) {
+        unsigned long cur = pop_from_OPEN(&ctx->OPEN, progress);
+        progress[cur].whq = 2;
+        settled += 1;
+        if (c->is_target[cur] && --targets == 0) break;                 // every target has its final distance
+        unsigned long k;
+        for (k = 0; k < c->out[cur].n; k++) {
+            unsigned long next = c->out[cur].edges[k].node;
+            double cost = progress[cur].g + c->out[cur].edges[k].weight;
+            if (next == skip || progress[next].whq == 2) continue;
+            if (progress[next].whq == 1 && progress[next].g <= cost) continue;
+            if (progress[next].whq == 0) { touch_node(ctx, next); progress[next].h = 0; }
+            progress[next].g = cost;
+            insert_to_OPEN(next, progress, &ctx->OPEN, c->g, 1, 0, source, source);
+        }
+    }
+}
+
+/*** contract() counts the shortcuts needed to contract v and, unless simulate is set, adds them to the remaining graph. ***/
+unsigned long contract (contraction* c, unsigned long v, bool simulate) {
+    edge_list* out = c->out;
+    edge_list* in = c->in;
+    unsigned long shortcuts = 0, i, j;
+    for (j = 0; j < out[v].n; j++) c->is_target[out[v].edges[j].node] = true;
+    for (i = 0; i < in[v].n; i++) {
+        unsigned long u = in[v].edges[i].node;
+        double w1 = in[v].edges[i].weight;
+        double max_cost = 0;
+        for (j = 0; j < out[v].n; j++) if (out[v].edges[j].node != u && w1 + out[v].edges[j].weight > max_cost) max_cost = w1 + out[v].edges[j].weight;
+        if (max_cost == 0) continue;                                    // no path u->v->x to replace
+        witness_search(c, u, v, max_cost, simulate ? PRIORITY_SETTLE_LIMIT : WITNESS_SETTLE_LIMIT, out[v].n);
+        for (j = 0; j < out[v].n; j++) {
+            unsigned long x = out[v].edges[j].node;
+            double via = w1 + out[v].edges[j].weight;
+            if (x == u || c->witness.progress[x].g <= via) continue;  // there is a witness path as short as u->v->x
+            shortcuts += 1;
+            if (!simulate) {
+                add_edge(&out[u], x, via, v);
+                add_edge(&in[x], u, via, v);
+            }
+        }
+    }
+    for (j = 0; j < out[v].n; j++) c->is_target[out[v].edges[j].node] = false;
+    return shortcuts;
+}
+
+double priority (contraction* c, unsigned long v) {
+    return (double)contract(c, v, true) - (double)(c->in[v].n + c->out[v].n) + (double)c->deleted[v];
+}
+
+/*** set_priority() puts v in the priority queue (a second search context, whose g is the priority) or updates its key ***/
+void set_priority (const graph* g, SearchContext* queue, unsigned long v, double key) {
+    if (queue->progress[v].whq == 0) touch_node(queue, v);
+    queue->progress[v].g = key;
+    queue->progress[v].h = 0;
+    insert_to_OPEN(v, queue->progress, &queue->OPEN, g, 1, 0, v, v);
+}
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 2) ExitError("usage: ch_main <map.bin>", 1);
+    graph g;
+    load_graph(argv[1], &g);
+    unsigned long nnodes = g.nnodes, v, k;
+
+// Remaining graph: the original edges, keeping the shortest of parallel edges and dropping loops
+    contraction c;
+    c.g = &g;
+    edge_list* out = NULL;
+    edge_list* in = NULL;
+    uint64_t* rank = NULL;
+    if ((c.out = out = (edge_list*) calloc(nnodes, sizeof(edge_list))) == NULL ||
+        (c.in = in = (edge_list*) calloc(nnodes, sizeof(edge_list))) == NULL ||
+        (c.deleted = (unsigned long*) calloc(nnodes, sizeof(unsigned long))) == NULL ||
+        (c.is_target = (bool*) calloc(nnodes, sizeof(bool))) == NULL ||
+        (rank = (uint64_t*) malloc(nnodes*sizeof(uint64_t))) == NULL) ExitError("when allocating memory for the hierarchy", 2);
+    for (v = 0; v < nnodes; v++)
+        for (k = g.first[v]; k < g.first[v+1]; k++) {
+            if (g.targets[k] == v) continue;
+            add_edge(&out[v], g.targets[k], g.weights[k], CH_NO_MIDDLE);
+            add_edge(&in[g.targets[k]], v, g.weights[k], CH_NO_MIDDLE);
+        }
+
+    SearchContext queue;
+    init_search_context(&c.witness, &g);
+    init_search_context(&queue, &g);
+    clock_t start = clock();
+    for (v = 0; v < nnodes; v++) set_priority(&g, &queue, v, priority(&c, v));
+
+// Contract nodes in order of priority. The priority of the node on top is recomputed first (lazy update) and it is only contracted if it stays on top.
+    unsigned long order = 0, shortcuts = 0;
+    while (queue.OPEN.size > 0) {
+        v = queue.OPEN.heap[0].index;
+        double current = priority(&c, v);
+        if (current > queue.progress[v].g && queue.OPEN.size > 1) {
+            set_priority(&g, &queue, v, current);
+            if (queue.OPEN.heap[0].index != v) continue;
+        }
+        pop_from_OPEN(&queue.OPEN, queue.progress);
+        queue.progress[v].whq = 2;
+        shortcuts += contract(&c, v, false);
+        rank[v] = order++;
+    // v is now above nothing that remains: detach it from its neighbours, whose lists lose an edge
+        for (k = 0; k < out[v].n; k++) { remove_edge(&in[out[v].edges[k].node], v); c.deleted[out[v].edges[k].node] += 1; }
+        for (k = 0; k < in[v].n; k++) { remove_edge(&out[in[v].edges[k].node], v); c.deleted[in[v].edges[k].node] += 1; }
+    // and update their priorities, unless v is in the dense core left at the end, where that would cost more than the whole contraction
+        if (out[v].n + in[v].n <= NEIGHBOUR_UPDATE_DEGREE) {
+            for (k = 0; k < out[v].n; k++) set_priority(&g, &queue, out[v].edges[k].node, priority(&c, out[v].edges[k].node));
+            for (k = 0; k < in[v].n; k++) set_priority(&g, &queue, in[v].edges[k].node, priority(&c, in[v].edges[k].node));
+        }
+        if (order % (nnodes/10 + 1) == 0) printf("%lu of %lu nodes contracted, %lu shortcuts so far.\n", order, nnodes, shortcuts);
+    }
+    printf("\nContraction finished in %.3f seconds: %lu shortcuts added.\n", ((double)(clock() - start)) / CLOCKS_PER_SEC, shortcuts);
+
+// The lists of every contracted node now hold its upward (out) and downward (in) edges
+    CHFileHeader header;
+    memset(&header, 0, sizeof(CHFileHeader));
+    memcpy(header.magic, CH_MAGIC, sizeof(header.magic));
+    header.version = CH_VERSION;
+    header.header_size = sizeof(CHFileHeader);
+    header.nnodes = nnodes;
+    header.nedges = g.nedges;
+    uint64_t* up_first = NULL;
+    uint64_t* down_first = NULL;
+    if ((up_first = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL ||
+        (down_first = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL) ExitError("when allocating memory for the hierarchy", 2);
+    up_first[0] = down_first[0] = 0;
+    for (v = 0; v < nnodes; v++) {
+        up_first[v+1] = up_first[v] + out[v].n;
+        down_first[v+1] = down_first[v] + in[v].n;
+    }
+    header.nup = up_first[nnodes];
+    header.ndown = down_first[nnodes];
+    ch_layout(&header);
+
+    char name[257];
+    strncpy(name, argv[1], 250); name[250] = '\0';
+    char* dot = strrchr(name, '.');
+    if (dot == NULL) dot = name + strlen(name);
+    strcpy(dot, ".ch");
+    FILE* fout;
+    if ((fout = fopen(name, "wb")) == NULL) ExitError("the output contraction hierarchy file cannot be opened", 3);
+    if (fwrite(&header, sizeof(CHFileHeader), 1, fout) != 1) ExitError("when writing the contraction hierarchy file", 4);
+    write_section(fout, header.rank_offset, rank, nnodes*sizeof(uint64_t));
+    write_section(fout, header.up_first_offset, up_first, (nnodes+1)*sizeof(uint64_t));
+    write_section(fout, header.up_offset, NULL, 0);
+    for (v = 0; v < nnodes; v++)
+        if (out[v].n && fwrite(out[v].edges, sizeof(CHEdge), out[v].n, fout) != out[v].n) ExitError("when writing the contraction hierarchy file", 4);
+    write_section(fout, header.down_first_offset, down_first, (nnodes+1)*sizeof(uint64_t));
+    write_section(fout, header.down_offset, NULL, 0);
+    for (v = 0; v < nnodes; v++)
+        if (in[v].n && fwrite(in[v].edges, sizeof(CHEdge), in[v].n, fout) != in[v].n) ExitError("when writing the contraction hierarchy file", 4);
+    if ((uint64_t)ftell(fout) != header.file_size) ExitError("the size of the contraction hierarchy file does not match its header", 4);
+    fclose(fout);
+    printf("Hierarchy with %lu upward and %lu downward edges written to %s.\n", (unsigned long)header.nup, (unsigned long)header.ndown, name);
+
+/*** Free all allocated memory ***/
+    for (v = 0; v < nnodes; v++) { free(out[v].edges); free(in[v].edges); }
+    free(out); free(in); free(c.deleted); free(c.is_target); free(rank); free(up_first); free(down_first);
+    free_search_context(&c.witness);
+    free_search_context(&queue);
+    unload_graph(&g);
+    return 0;
+}
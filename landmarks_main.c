@@ -0,0 +1,87 @@
+#include "Astar_header.h"
+#include "Astar_func.h"
+
+/*** Landmark preprocessing for the ALT heuristic.
+     Usage: landmarks_main <map.bin> [number of landmarks, default 16] [seed]
+     Landmarks are chosen by farthest selection: the first one is the node farthest from a random node, and every next one is the node
+     farthest from all landmarks chosen so far. For each landmark one Dijkstra search is run from it and one towards it along the reverse
+     adjacency. The distance tables are written to <map>.lmk (see LandmarkFileHeader), which Astar_main and batch_main can load. ***/
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 2) ExitError("usage: landmarks_main <map.bin> [number of landmarks] [seed]", 1);
+    graph g;
+    load_graph(argv[1], &g);
+    unsigned long K = (argc > 2) ? strtoul(argv[2], NULL, 10) : 16;
+    if (K == 0 || K > 256) ExitError("the number of landmarks must be between 1 and 256", 2);
+    srand((argc > 3) ? (unsigned)strtoul(argv[3], NULL, 10) : 1);
+    unsigned long nnodes = g.nnodes;
+
+// Setting the name of the landmark file and mapping it for writing
+    char name[257];
+    strncpy(name, argv[1], 250); name[250] = '\0';
+    char* dot = strrchr(name, '.');
+    if (dot == NULL) dot = name + strlen(name);
+    strcpy(dot, ".lmk");
+    LandmarkFileHeader header;
+    memset(&header, 0, sizeof(LandmarkFileHeader));
+    memcpy(header.magic, LANDMARK_MAGIC, sizeof(header.magic));
+    header.version = LANDMARK_VERSION;
+    header.header_size = sizeof(LandmarkFileHeader);
+    header.nnodes = nnodes;
+    header.nedges = g.nedges;
+    header.nlandmarks = K;
+    landmark_layout(&header);
+    int fd;
+    if ((fd = open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) ExitError("the output landmark file cannot be opened", 3);
+    if (ftruncate(fd, (off_t)header.file_size) != 0) ExitError("when setting the size of the output landmark file", 4);
+    char* out = (char*) mmap(NULL, header.file_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (out == MAP_FAILED) ExitError("when mapping the output landmark file", 5);
+    close(fd);
+    uint64_t* chosen = (uint64_t*) (out + header.landmarks_offset);
+    float* table = (float*) (out + header.table_offset);
+
+// mindist[v]: distance to v from the closest landmark chosen so far
+    double* mindist = NULL;
+    if ((mindist = (double*) malloc(nnodes*sizeof(double))) == NULL) ExitError("when allocating memory for the landmark distances", 6);
+    unsigned long i, k;
+    for (i = 0; i < nnodes; i++) mindist[i] = INFINITY;
+    SearchContext ctx;
+    init_search_context(&ctx, &g);
+
+// first landmark: the node farthest from a random node
+    unsigned long start = (unsigned long)rand() % nnodes;
+    dijkstra_search(&g, &ctx, start, false);
+    unsigned long next = start;
+    for (i = 0; i < nnodes; i++) if (ctx.progress[i].g != INFINITY && ctx.progress[i].g > ctx.progress[next].g) next = i;
+
+    clock_t begin = clock();
+    for (k = 0; k < K; k++) {
+        chosen[k] = next;
+    // distances from the landmark
+        unsigned long settled = dijkstra_search(&g, &ctx, next, false);
+        for (i = 0; i < nnodes; i++) {
+            double d = ctx.progress[i].g;
+            table[2*K*i + k] = (float)d;
+            if (d < mindist[i]) mindist[i] = d;
+        }
+    // distances to the landmark
+        dijkstra_search(&g, &ctx, next, true);
+        for (i = 0; i < nnodes; i++) table[2*K*i + K + k] = (float)ctx.progress[i].g;
+        printf("Landmark %lu: ID %lu, reaches %lu nodes.\n", k, (unsigned long)g.ids[next], settled);
+    // next landmark: the node farthest from all landmarks chosen so far
+        next = chosen[k];
+        for (i = 0; i < nnodes; i++) if (mindist[i] != INFINITY && mindist[i] > mindist[next]) next = i;
+    }
+    printf("\nLandmark distances computed in %.3f seconds and written to %s.\n", ((double)(clock() - begin)) / CLOCKS_PER_SEC, name);
+
+    memcpy(out, &header, sizeof(LandmarkFileHeader));
+    if (msync(out, header.file_size, MS_SYNC) != 0) ExitError("when writing the output landmark file", 7);
+    munmap(out, header.file_size);
+
+/*** Free all allocated memory ***/
+    free(mindist);
+    free_search_context(&ctx);
+    unload_graph(&g);
+    return 0;
+}
@@ -0,0 +1,170 @@
+#include "Astar_header.h"
+#include <pthread.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*** Load generator for server_main.
+     Usage: loadgen_main <socket path or TCP port> <queries file> [number of connections, default 4] [requests per connection, default 1000]
+     The queries file has the format of batch_main ("source_id dest_id mode [param]", lines starting with # are skipped). Every connection is
+     a thread that sends one request, waits for its response and sends the next one, going through the queries from a different starting
+     point. The latency of every request is measured from sending it to receiving its response; the counts of every response status, the
+     throughput and the 50th, 90th and 99th percentiles and maximum of the latency are reported. ***/
+
+#define LOADGEN_MAX_RESPONSE 65536      // longest response line kept; the rest of longer lines is skipped
+
+/*** state of one connection ***/
+typedef struct {
+    const char* address;
+    char** queries;
+    unsigned long nqueries, first, nrequests;
+    double* latencies;                  // seconds, one per request
+    unsigned long ok, timeout, busy, other;
+} loadgen_conn;
+
+/*** connect_to() opens a connection to a TCP port on 127.0.0.1 if address is a number, to a Unix domain socket at that path otherwise ***/
+int connect_to (const char* address) {
+    int fd;
+    if (address[strspn(address, "0123456789")] != '\0') {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) ExitError("the socket path is too long", 47);
+        strcpy(addr.sun_path, address);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ExitError("when creating the socket", 48);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ExitError("when connecting to the server", 49);
+    }
+    else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ExitError("when creating the socket", 48);
+        if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ExitError("when connecting to the server", 49);
+    }
+    return fd;
+}
+
+/*** run_conn() sends the requests of one connection in a closed loop ***/
+void* run_conn (void* arg) {
+    loadgen_conn* self = (loadgen_conn*) arg;
+    int fd = connect_to(self->address);
+    char* response = NULL;
+    if ((response = (char*) malloc(LOADGEN_MAX_RESPONSE)) == NULL) ExitError("when allocating memory for the responses", 44);
+    char buffer[4096];
+    size_t buffered = 0, consumed = 0;
+    unsigned long i;
+    for (i = 0; i < self->nrequests; i++) {
+        const char* query = self->queries[(self->first + i) % self->nqueries];
+        size_t length = strlen(query), sent = 0;
+        double start = monotonic_seconds();
+        while (sent < length) {
+            ssize_t n = write(fd, query + sent, length - sent);
+            if (n < 0) { if (errno == EINTR) continue; ExitError("when sending a request", 50); }
+            sent += (size_t)n;
+        }
+    // read up to the end of the response line
+        size_t response_len = 0;
+        bool complete = false;
+        while (!complete) {
+            if (consumed == buffered) {
+                ssize_t n = read(fd, buffer, sizeof(buffer));
+                if (n < 0 && errno == EINTR) continue;
+                if (n <= 0) ExitError("the server closed the connection", 50);
+                buffered = (size_t)n;
+                consumed = 0;
+            }
+            while (consumed < buffered) {
+                char ch = buffer[consumed++];
+                if (ch == '\n') { complete = true; break; }
+                if (response_len < LOADGEN_MAX_RESPONSE - 1) response[response_len++] = ch;
+            }
+        }
+        self->latencies[i] = monotonic_seconds() - start;
+        response[response_len] = '\0';
+        if (strncmp(response, "ok", 2) == 0) self->ok += 1;
+        else if (strcmp(response, "error timeout") == 0) self->timeout += 1;
+        else if (strcmp(response, "error busy") == 0) self->busy += 1;
+        else self->other += 1;
+    }
+    free(response);
+    close(fd);
+    return NULL;
+}
+
+int compare_doubles (const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 3) ExitError("usage: loadgen_main <socket path or TCP port> <queries file> [number of connections] [requests per connection]", 30);
+    FILE* fin;
+    if ((fin = fopen(argv[2], "r")) == NULL) ExitError("the queries file does not exist or cannot be opened", 32);
+    long nconns = (argc > 3) ? atol(argv[3]) : 4;
+    if (nconns < 1) nconns = 1;
+    unsigned long nrequests = (argc > 4) ? strtoul(argv[4], NULL, 10) : 1000;
+
+// queries are kept as the request lines sent to the server
+    char** queries = NULL;
+    unsigned long nqueries = 0, capacity = 0;
+    char* line_buf = NULL;
+    size_t line_buf_size = 0;
+    while (getline(&line_buf, &line_buf_size, fin) >= 0) {
+        if (*line_buf == '#' || *line_buf == '\n') continue;
+        if (nqueries == capacity) {
+            capacity = capacity ? 2*capacity : 1024;
+            if ((queries = (char**) realloc(queries, capacity*sizeof(char*))) == NULL) ExitError("when allocating memory for the queries", 33);
+        }
+        size_t length = strcspn(line_buf, "\r\n");
+        if ((queries[nqueries] = (char*) malloc(length + 2)) == NULL) ExitError("when allocating memory for the queries", 33);
+        memcpy(queries[nqueries], line_buf, length);
+        strcpy(queries[nqueries] + length, "\n");
+        nqueries += 1;
+    }
+    fclose(fin);
+    if (nqueries == 0) ExitError("the queries file has no queries", 31);
+
+    loadgen_conn* conns = NULL;
+    pthread_t* threads = NULL;
+    if ((conns = (loadgen_conn*) calloc(nconns, sizeof(loadgen_conn))) == NULL ||
+        (threads = (pthread_t*) malloc(nconns*sizeof(pthread_t))) == NULL) ExitError("when allocating memory for the connections", 33);
+    long t;
+    double start = monotonic_seconds();
+    for (t = 0; t < nconns; t++) {
+        conns[t].address = argv[1];
+        conns[t].queries = queries;
+        conns[t].nqueries = nqueries;
+        conns[t].first = (unsigned long)t * (nqueries / nconns);
+        conns[t].nrequests = nrequests;
+        if ((conns[t].latencies = (double*) malloc((nrequests ? nrequests : 1)*sizeof(double))) == NULL) ExitError("when allocating memory for the latencies", 33);
+        if (pthread_create(&threads[t], NULL, run_conn, &conns[t]) != 0) ExitError("when creating a connection thread", 34);
+    }
+    for (t = 0; t < nconns; t++) pthread_join(threads[t], NULL);
+    double seconds = monotonic_seconds() - start;
+
+// all latencies together, sorted for the percentiles
+    unsigned long total = (unsigned long)nconns * nrequests, ok = 0, timeout = 0, busy = 0, other = 0, i;
+    double* latencies = NULL;
+    if ((latencies = (double*) malloc((total ? total : 1)*sizeof(double))) == NULL) ExitError("when allocating memory for the latencies", 33);
+    for (t = 0; t < nconns; t++) {
+        memcpy(latencies + (unsigned long)t * nrequests, conns[t].latencies, nrequests*sizeof(double));
+        ok += conns[t].ok; timeout += conns[t].timeout; busy += conns[t].busy; other += conns[t].other;
+    }
+    qsort(latencies, total, sizeof(double), compare_doubles);
+    printf("%lu requests over %ld connections in %.3f s: %.1f requests/s.\n", total, nconns, seconds, total / seconds);
+    printf("Responses: %lu ok, %lu timeout, %lu busy, %lu other errors.\n", ok, timeout, busy, other);
+    if (total > 0)
+        printf("Latency: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms.\n", 1e3 * latencies[(total - 1) * 50 / 100],
+               1e3 * latencies[(total - 1) * 90 / 100], 1e3 * latencies[(total - 1) * 99 / 100], 1e3 * latencies[total - 1]);
+
+/*** Free all allocated memory ***/
+    for (t = 0; t < nconns; t++) free(conns[t].latencies);
+    for (i = 0; i < nqueries; i++) free(queries[i]);
+    free(queries); free(conns); free(threads); free(latencies); free(line_buf);
+    return 0;
+}
@@ -0,0 +1,252 @@
+#include "Astar_header.h"
+#include "Astar_func.h"
+#include <pthread.h>
+#include <stdatomic.h>
+
+/*** Distance matrices: the shortest distance from every source to every target, written as a dense matrix.
+     Usage: matrix_main <map.bin> <sources file> <targets file> <output file> [number of threads] [hierarchy file, cost profile or patch file]
+     The sources and targets files have one node id per line (lines starting with # are skipped). With a hierarchy file (.ch) the matrix
+     is computed with buckets: a backward search of the hierarchy from every target leaves (target, distance) entries at the nodes it
+     settles, then a forward search from every source combines its distances with the entries found at the nodes it settles. Without one,
+     every row is a one_to_many_search() from its source. Either way the searches are shared among the worker threads.
+     If the output file name ends in .csv the matrix is written as text: a header line "source|<target ids>" and then one line per source
+     with its id and the distances in km (inf when unreachable). Otherwise it is binary: the number of sources and the number of targets
+     as uint64_t, then the distances as doubles, row by row (INFINITY when unreachable). The time taken is reported on stderr. ***/
+
+/*** structure to represent an entry of a bucket: a target reaches the node of the bucket at this distance in the hierarchy ***/
+typedef struct {
+    unsigned long column;           // position of the target in the targets list
+    double distance;
+} bucket_entry;
+
+/*** search space of one target, kept until the buckets are built ***/
+typedef struct {
+    node_index* nodes;
+    double* distances;
+    unsigned long size;
+} target_space;
+
+/*** state shared by the workers ***/
+typedef struct {
+    const graph* g;
+    const unsigned long* sources;
+    unsigned long nsources;
+    const unsigned long* targets;
+    unsigned long ntargets;
+    double* matrix;                 // nsources x ntargets, row by row
+    target_space* spaces;           // backward search spaces of the targets, NULL without hierarchy
+    const uint64_t* bucket_first;   // buckets of all nodes in CSR form
+    const bucket_entry* buckets;
+    bool backward;                  // the workers are running the backward searches of the targets
+    atomic_ulong next;              // next source (or target) to be claimed by a worker
+} matrix_state;
+
+typedef struct {
+    matrix_state* state;
+    SearchContext ctx;
+} matrix_worker;
+
+/*** backward_space() runs the backward search of the hierarchy from a target and keeps the nodes it settles with their distances ***/
+void backward_space (const graph* g, SearchContext* ctx, unsigned long target_index, target_space* space) {
+    ch_upward_search(g, ctx, target_index, false);
+    unsigned long k, n = 0;
+    if ((space->nodes = (node_index*) malloc(ctx->ntouched*sizeof(node_index))) == NULL ||
+        (space->distances = (double*) malloc(ctx->ntouched*sizeof(double))) == NULL) ExitError("when allocating memory for the buckets", 72);
+    for (k = 0; k < ctx->ntouched; k++) {
+        node_index v = ctx->touched[k];
+        if (ctx->progress[v].whq != 2) continue;
+        space->nodes[n] = v;
+        space->distances[n] = ctx->progress[v].g;
+        n += 1;
+    }
+    space->size = n;
+}
+
+/*** bucket_row() fills the row of a source: a forward search of the hierarchy, whose settled nodes are combined with their buckets ***/
+void bucket_row (const matrix_state* state, SearchContext* ctx, unsigned long source_index, double* row) {
+    unsigned long j, k;
+    for (j = 0; j < state->ntargets; j++) row[j] = INFINITY;
+    ch_upward_search(state->g, ctx, source_index, true);
+    for (k = 0; k < ctx->ntouched; k++) {
+        node_index v = ctx->touched[k];
+        if (ctx->progress[v].whq != 2) continue;
+        double d = ctx->progress[v].g;
+        uint64_t b;
+        for (b = state->bucket_first[v]; b < state->bucket_first[v+1]; b++) {
+            const bucket_entry* e = &state->buckets[b];
+            if (d + e->distance < row[e->column]) row[e->column] = d + e->distance;
+        }
+    }
+}
+
+/*** worker() claims targets (backward phase) or sources until none is left ***/
+void* worker (void* arg) {
+    matrix_worker* self = (matrix_worker*) arg;
+    matrix_state* state = self->state;
+    unsigned long k;
+    if (state->backward) {
+        while ((k = atomic_fetch_add(&state->next, 1)) < state->ntargets)
+            backward_space(state->g, &self->ctx, state->targets[k], &state->spaces[k]);
+        return NULL;
+    }
+    while ((k = atomic_fetch_add(&state->next, 1)) < state->nsources) {
+        double* row = state->matrix + k * state->ntargets;
+        if (state->spaces != NULL) bucket_row(state, &self->ctx, state->sources[k], row);
+        else one_to_many_search(state->g, &self->ctx, state->sources[k], state->targets, state->ntargets, row);
+    }
+    return NULL;
+}
+
+/*** run_workers() runs worker() on all threads and waits for them ***/
+void run_workers (matrix_state* state, matrix_worker* workers, pthread_t* threads, long nthreads, bool backward) {
+    long t;
+    state->backward = backward;
+    atomic_store(&state->next, 0);
+    for (t = 0; t < nthreads; t++)
+        if (pthread_create(&threads[t], NULL, worker, &workers[t]) != 0) ExitError("when creating a worker thread", 34);
+    for (t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+}
+
+/*** read_nodes() reads a file of node ids and returns their positions in the graph ***/
+unsigned long* read_nodes (const graph* g, const char* filename, unsigned long* n) {
+    FILE* fin;
+    if ((fin = fopen(filename, "r")) == NULL) ExitError("a node ids file does not exist or cannot be opened", 70);
+    uint64_t* ids = NULL;
+    unsigned long capacity = 0, k;
+    char* line_buf = NULL;
+    size_t line_buf_size = 0;
+    *n = 0;
+    while (getline(&line_buf, &line_buf_size, fin) >= 0) {
+        if (*line_buf == '#' || *line_buf == '\n') continue;
+        if (*n == capacity) {
+            capacity = capacity ? 2*capacity : 1024;
+            if ((ids = (uint64_t*) realloc(ids, capacity*sizeof(uint64_t))) == NULL) ExitError("when allocating memory for the node ids", 71);
+        }
+        ids[(*n)++] = strtoull(line_buf, NULL, 10);
+    }
+    fclose(fin);
+    free(line_buf);
+    if (*n == 0) ExitError("a node ids file has no ids", 70);
+    signed long* positions = NULL;
+    unsigned long* nodes = NULL;
+    if ((positions = (signed long*) malloc(*n*sizeof(signed long))) == NULL ||
+        (nodes = (unsigned long*) malloc(*n*sizeof(unsigned long))) == NULL) ExitError("when allocating memory for the node ids", 71);
+    find_nodes(g, ids, positions, *n);
+    for (k = 0; k < *n; k++) {
+        if (positions[k] == -1) {
+            fprintf(stderr, "Node id %lu of %s is not in the graph.\n", (unsigned long)ids[k], filename);
+            ExitError("unknown node id", 70);
+        }
+        nodes[k] = (unsigned long)positions[k];
+    }
+    free(ids);
+    free(positions);
+    return nodes;
+}
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 5) ExitError("usage: matrix_main <map.bin> <sources file> <targets file> <output file> [number of threads] [hierarchy file, cost profile or patch file]", 1);
+    graph g;
+    load_graph(argv[1], &g);
+    landmarks lm;
+    ch_graph ch;
+    cost_profile profile;
+    edge_overlay overlay;
+    init_extras(&lm, &ch, &profile, &overlay);
+    int extra;
+    for (extra = 6; extra < argc; extra++) load_extra(argv[extra], &g, &lm, &ch, &profile, &overlay);
+    long nthreads = (argc > 5) ? atol(argv[5]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+
+// the whole matrix is computed on one snapshot of the edge overlay, if a patch file is given
+    graph view;
+    overlay_snapshot* snapshot;
+    matrix_state state;
+    state.g = pin_overlay(&g, &view, &snapshot);
+    state.sources = read_nodes(&g, argv[2], &state.nsources);
+    state.targets = read_nodes(&g, argv[3], &state.ntargets);
+    if ((state.matrix = (double*) malloc(state.nsources*state.ntargets*sizeof(double))) == NULL) ExitError("when allocating memory for the matrix", 71);
+    state.spaces = NULL;
+    state.bucket_first = NULL;
+    state.buckets = NULL;
+    matrix_worker* workers = NULL;
+    pthread_t* threads = NULL;
+    if ((workers = (matrix_worker*) malloc(nthreads*sizeof(matrix_worker))) == NULL ||
+        (threads = (pthread_t*) malloc(nthreads*sizeof(pthread_t))) == NULL) ExitError("when allocating memory for the workers", 33);
+    long t;
+    for (t = 0; t < nthreads; t++) {
+        workers[t].state = &state;
+        init_search_context(&workers[t].ctx, &g);
+    }
+
+    double start = monotonic_seconds();
+    uint64_t* bucket_first = NULL;
+    bucket_entry* buckets = NULL;
+    if (g.ch != NULL) {
+    // backward search spaces of the targets, then grouped by node (counting sort) into the buckets
+        if ((state.spaces = (target_space*) malloc(state.ntargets*sizeof(target_space))) == NULL ||
+            (bucket_first = (uint64_t*) calloc(g.nnodes + 1, sizeof(uint64_t))) == NULL) ExitError("when allocating memory for the buckets", 72);
+        run_workers(&state, workers, threads, nthreads, true);
+        unsigned long j, k, v;
+        for (j = 0; j < state.ntargets; j++)
+            for (k = 0; k < state.spaces[j].size; k++) bucket_first[state.spaces[j].nodes[k] + 1] += 1;
+        for (v = 0; v < g.nnodes; v++) bucket_first[v+1] += bucket_first[v];
+        if ((buckets = (bucket_entry*) malloc((bucket_first[g.nnodes] ? bucket_first[g.nnodes] : 1)*sizeof(bucket_entry))) == NULL) ExitError("when allocating memory for the buckets", 72);
+        for (j = 0; j < state.ntargets; j++) {
+            for (k = 0; k < state.spaces[j].size; k++) {
+                bucket_entry* e = &buckets[bucket_first[state.spaces[j].nodes[k]]++];
+                e->column = j;
+                e->distance = state.spaces[j].distances[k];
+            }
+            free(state.spaces[j].nodes);
+            free(state.spaces[j].distances);
+        }
+        for (v = g.nnodes; v > 0; v--) bucket_first[v] = bucket_first[v-1];   // the fill moved every start to the next bucket
+        bucket_first[0] = 0;
+        state.bucket_first = bucket_first;
+        state.buckets = buckets;
+    }
+    run_workers(&state, workers, threads, nthreads, false);
+    double seconds = monotonic_seconds() - start;
+    fprintf(stderr, "%lu x %lu matrix in %.3f s with %ld threads (%s).\n", state.nsources, state.ntargets, seconds, nthreads,
+            g.ch != NULL ? "hierarchy buckets" : "one-to-many searches");
+
+/*** Write the matrix ***/
+    FILE* fout;
+    if ((fout = fopen(argv[4], "wb")) == NULL) ExitError("the output file cannot be opened", 73);
+    size_t len = strlen(argv[4]);
+    unsigned long i, j;
+    if (len >= 4 && strcmp(argv[4] + len - 4, ".csv") == 0) {
+        fprintf(fout, "source");
+        for (j = 0; j < state.ntargets; j++) fprintf(fout, "|%lu", (unsigned long)g.ids[state.targets[j]]);
+        fprintf(fout, "\n");
+        for (i = 0; i < state.nsources; i++) {
+            fprintf(fout, "%lu", (unsigned long)g.ids[state.sources[i]]);
+            for (j = 0; j < state.ntargets; j++) {
+                double d = state.matrix[i * state.ntargets + j];
+                if (d == INFINITY) fprintf(fout, "|inf");
+                else fprintf(fout, "|%.7f", d);
+            }
+            fprintf(fout, "\n");
+        }
+    }
+    else {
+        uint64_t dims[2] = {state.nsources, state.ntargets};
+        if (fwrite(dims, sizeof(uint64_t), 2, fout) != 2 ||
+            fwrite(state.matrix, sizeof(double), state.nsources*state.ntargets, fout) != state.nsources*state.ntargets) ExitError("when writing the matrix", 73);
+    }
+    if (fclose(fout) != 0) ExitError("when writing the matrix", 73);
+
+/*** Free all allocated memory ***/
+    for (t = 0; t < nthreads; t++) free_search_context(&workers[t].ctx);
+    unpin_overlay(g.overlay, snapshot);
+    free(workers); free(threads); free(state.spaces); free(bucket_first); free(buckets);
+    free((void*)state.sources); free((void*)state.targets); free(state.matrix);
+    unload_ch(&g, &ch);
+    detach_overlay(&g, &overlay);
+    unload_profile(&g, &profile);
+    unload_landmarks(&g, &lm);
+    unload_graph(&g);
+    return 0;
+}
@@ -0,0 +1,482 @@
+#include "Astar_header.h"
+#include "Astar_func.h"
+#include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*** Routing daemon: the graph is mapped once and route requests are served over a Unix domain socket or a localhost TCP port.
+     Usage: server_main <map.bin> <socket path or TCP port> [number of threads] [timeout in ms] [landmark, hierarchy, cost profile and patch files...] [cache:MB]
+     Protocol, one line per request and per response:
+         source_id dest_id mode [param] [path]
+         ok <distance> <expanded>                          the distance in km and the number of expanded nodes
+         ok <distance> <expanded> <n> <id_1> ... <id_n>    the same with the n node ids of the route, if the request ends with "path"
+         error <reason>                                    bad_request, unknown_node, bad_mode, unreachable, timeout or busy
+     Without a hierarchy file the server keeps an edge overlay, and the costs of the edges can be changed while it runs with the lines of a
+     patch file (see edge_overlay), or with "patch <file>" to apply a whole patch file on the server at once:
+         block <from id> <to id> | penalty <from id> <to id> <cost> | clear <from id> <to id> | reset | patch <file>
+         ok <version>                                      the version of the overlay that now answers new requests
+         error <reason>                                    bad_request, unknown_node, no_edge, bad_patch or no_overlay
+     Requests answered after the response to an update see it; requests being answered keep the costs they started with.
+     Modes are those of Astar_main (5 needs a hierarchy file). With cache:MB, mode-1 requests go through a search cache of that many megabytes
+     shared by the workers (see search_cache), so that requests from a source searched before resume its search. A client may send several requests without waiting: they are answered in
+     order, one at a time per connection, and the connection is not read while one of its requests is being answered.
+     One thread runs the event loop (poll) and hands requests to a pool of workers, each with its own search contexts. A request that is
+     not answered within the timeout (counted from its arrival, when the server reads it, including the time waiting behind earlier requests
+     of the same connection and for a worker) gets "error timeout". At most SERVER_QUEUE_CAPACITY requests are accepted at once; further
+     requests get "error busy" right away. ***/
+
+#define SERVER_MAX_CLIENTS 1024
+#define SERVER_QUEUE_CAPACITY 256       // requests accepted and not yet answered, over all connections
+#define SERVER_MAX_LINE 1024            // longest request line
+#define SERVER_MAX_OUTPUT (1 << 20)     // a connection with this much unsent output is not read until the client catches up
+#define SERVER_TIMEOUT_MS 1000
+
+/*** structure to represent a request and, once answered, its response line ***/
+typedef struct {
+    int client, generation;             // connection that sent the request
+    unsigned long source, dest;         // node ids
+    int mode;
+    double param;
+    bool want_path;
+    double deadline;                    // monotonic time after which the request gets "error timeout"
+    char* update;                       // line of an update of the edge overlay, NULL for a route request
+    char* response;
+    size_t response_len, response_cap;
+} server_job;
+
+/*** state shared by the event loop and the workers. Jobs go from pending (waiting for a worker) to done (waiting to be sent); both are rings of SERVER_QUEUE_CAPACITY entries, which is never exceeded since that is the limit of requests accepted at once. ***/
+typedef struct {
+    const graph* g;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;               // signalled when a job is pending or the server stops
+    server_job* pending[SERVER_QUEUE_CAPACITY];
+    unsigned long pending_head, npending;
+    server_job* done[SERVER_QUEUE_CAPACITY];
+    unsigned long done_head, ndone;
+    bool stopping;
+    int wake_fd;                        // written by the workers to wake the event loop when a job is done
+    double timeout;                     // seconds allowed to answer a request
+    search_cache* cache;                // searches kept for mode-1 requests, NULL if none
+} server_state;
+
+typedef struct {
+    server_state* state;
+    SearchContext fwd, bwd;
+} server_worker;
+
+/*** structure to represent a client connection ***/
+typedef struct {
+    int fd;                             // -1 if the slot is free
+    int generation;                     // increased when the slot is freed, so that late responses for a closed connection are dropped
+    char in[SERVER_MAX_LINE];
+    size_t in_len;
+    double in_time;                     // monotonic time of the last read; the complete lines in in all arrived with it, as a connection is read only once they are handed out
+    char* out;
+    size_t out_len, out_pos, out_cap;
+    bool waiting;                       // one of its requests is being answered
+    bool closing;                       // no more input is read: close once its requests are answered and the output is sent
+} server_conn;
+
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop (int signum) {
+    (void)signum;
+    stop_requested = 1;
+}
+
+/*** append_text() appends formatted text to a growable buffer ***/
+void append_text (char** buffer, size_t* length, size_t* capacity, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    int needed = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if (*length + needed + 1 > *capacity) {
+        size_t grown = *capacity ? *capacity : 256;
+        while (*length + needed + 1 > grown) grown *= 2;
+        if ((*buffer = (char*) realloc(*buffer, grown)) == NULL) ExitError("when allocating memory for a response", 45);
+        *capacity = grown;
+    }
+    va_start(args, format);
+    vsnprintf(*buffer + *length, needed + 1, format, args);
+    va_end(args);
+    *length += needed;
+}
+
+/*** answer_request() solves a request with the search contexts of the calling worker, or through the cache for mode 1, and writes its response line ***/
+void answer_request (const graph* g, search_cache* cache, SearchContext* fwd, SearchContext* bwd, server_job* job) {
+    if (monotonic_seconds() >= job->deadline) { append_text(&job->response, &job->response_len, &job->response_cap, "error timeout\n"); return; }
+    signed long source_index = find_node(g, job->source);
+    signed long dest_index = find_node(g, job->dest);
+    if (source_index == -1 || dest_index == -1) { append_text(&job->response, &job->response_len, &job->response_cap, "error unknown_node\n"); return; }
+    if (job->mode < 1 || job->mode > 6 || (job->mode == 5 && g->ch == NULL)) { append_text(&job->response, &job->response_len, &job->response_cap, "error bad_mode\n"); return; }
+    unsigned long expanded = 0;
+    fwd->deadline = job->deadline;
+    bool found;
+    cached_search* entry = NULL;
+    if (cache != NULL && job->mode == 1) entry = run_cached_search(cache, g, fwd, bwd, (unsigned long)source_index, (unsigned long)dest_index, &found, &expanded);
+    else found = run_search(g, fwd, bwd, (unsigned long)source_index, (unsigned long)dest_index, job->mode, job->param, &expanded);
+    fwd->deadline = 0;
+    if (!found) {
+        append_text(&job->response, &job->response_len, &job->response_cap, fwd->expired ? "error timeout\n" : "error unreachable\n");
+        release_cached_search(cache, g, entry);
+        return;
+    }
+    const AStarStatus* progress = entry != NULL ? entry->ctx.progress : fwd->progress;
+    append_text(&job->response, &job->response_len, &job->response_cap, "ok %.7f %lu", progress[dest_index].g, expanded);
+    if (job->want_path) {
+    // the parent chain runs from the destination back to the source: count it, then write the ids from the source on
+        unsigned long length = 1, cur_index = (unsigned long)dest_index, i;
+        while (cur_index != (unsigned long)source_index) { cur_index = progress[cur_index].parent; length += 1; }
+        unsigned long* path = NULL;
+        if ((path = (unsigned long*) malloc(length*sizeof(unsigned long))) == NULL) ExitError("when allocating memory for a response", 45);
+        cur_index = (unsigned long)dest_index;
+        for (i = length; i > 0; i--) { path[i-1] = cur_index; cur_index = progress[cur_index].parent; }
+        append_text(&job->response, &job->response_len, &job->response_cap, " %lu", length);
+        for (i = 0; i < length; i++) append_text(&job->response, &job->response_len, &job->response_cap, " %lu", (unsigned long)g->ids[path[i]]);
+        free(path);
+    }
+    append_text(&job->response, &job->response_len, &job->response_cap, "\n");
+    release_cached_search(cache, g, entry);
+}
+
+/*** answer_update() applies an update of the edge overlay and writes its response line. Updates are not subject to the timeout. ***/
+void answer_update (const graph* g, server_job* job) {
+    const char* reason = "bad_request";
+    unsigned long version = 0;
+    char filename[SERVER_MAX_LINE];
+    if (g->overlay == NULL) reason = "no_overlay";
+    else if (sscanf(job->update, "patch %1023s", filename) == 1) version = read_overlay_patch(filename, g, &reason);
+    else {
+        overlay_change change;
+        int kind = parse_overlay_line(g, job->update, &change, &reason);
+        if (kind == OVERLAY_EDGE || kind == OVERLAY_RESET) version = apply_overlay(g->overlay, g, &change, kind == OVERLAY_EDGE ? 1 : 0, kind == OVERLAY_RESET);
+    }
+    if (version == 0) append_text(&job->response, &job->response_len, &job->response_cap, "error %s\n", reason);
+    else append_text(&job->response, &job->response_len, &job->response_cap, "ok %lu\n", version);
+}
+
+/*** worker() takes pending jobs one at a time until the server stops ***/
+void* worker (void* arg) {
+    server_worker* self = (server_worker*) arg;
+    server_state* state = self->state;
+    while (true) {
+        pthread_mutex_lock(&state->lock);
+        while (state->npending == 0 && !state->stopping) pthread_cond_wait(&state->ready, &state->lock);
+        if (state->npending == 0) { pthread_mutex_unlock(&state->lock); break; }
+        server_job* job = state->pending[state->pending_head];
+        state->pending_head = (state->pending_head + 1) % SERVER_QUEUE_CAPACITY;
+        state->npending -= 1;
+        pthread_mutex_unlock(&state->lock);
+
+        if (job->update != NULL) answer_update(state->g, job);
+        else answer_request(state->g, state->cache, &self->fwd, &self->bwd, job);
+
+        pthread_mutex_lock(&state->lock);
+        state->done[(state->done_head + state->ndone) % SERVER_QUEUE_CAPACITY] = job;
+        state->ndone += 1;
+        pthread_mutex_unlock(&state->lock);
+        char wake = 1;
+        if (write(state->wake_fd, &wake, 1) < 0 && errno != EAGAIN) ExitError("when waking up the event loop", 46);
+    }
+    return NULL;
+}
+
+/*** parse_request() reads a request line into job and returns false if it is malformed. Lines that start with a letter are updates of the edge overlay, kept whole for answer_update(). ***/
+bool parse_request (char* line, server_job* job) {
+    if ((*line >= 'a' && *line <= 'z') || (*line >= 'A' && *line <= 'Z')) {
+        if ((job->update = strdup(line)) == NULL) ExitError("when allocating memory for a request", 44);
+        return true;
+    }
+    char* save = NULL;
+    char* token[6];
+    int ntokens = 0;
+    char* t;
+    for (t = strtok_r(line, " \t\r", &save); t != NULL; t = strtok_r(NULL, " \t\r", &save)) {
+        if (ntokens == 6) return false;
+        token[ntokens++] = t;
+    }
+    if (ntokens < 3) return false;
+    char* end;
+    job->source = strtoul(token[0], &end, 10);
+    if (*end != '\0') return false;
+    job->dest = strtoul(token[1], &end, 10);
+    if (*end != '\0') return false;
+    job->mode = (int)strtol(token[2], &end, 10);
+    if (*end != '\0') return false;
+    job->param = 0;
+    job->want_path = false;
+    int k = 3;
+    if (k < ntokens && strcmp(token[k], "path") != 0) {
+        job->param = strtod(token[k], &end);
+        if (*end != '\0') return false;
+        k += 1;
+    }
+    if (k < ntokens && strcmp(token[k], "path") == 0) { job->want_path = true; k += 1; }
+    return k == ntokens;
+}
+
+/*** close_conn() closes a connection and frees its slot ***/
+void close_conn (server_conn* conn) {
+    close(conn->fd);
+    conn->fd = -1;
+    conn->generation += 1;
+    conn->in_len = 0;
+    conn->out_len = conn->out_pos = 0;
+    conn->waiting = false;
+    conn->closing = false;
+}
+
+/*** process_lines() handles the complete request lines received on a connection, one at a time: it stops at the first one that is handed to a worker and is called again when that one is answered ***/
+void process_lines (server_state* state, server_conn* conns, int client, unsigned long* inflight) {
+    server_conn* conn = &conns[client];
+    while (!conn->waiting) {
+        char* eol = (char*) memchr(conn->in, '\n', conn->in_len);
+        if (eol == NULL) {
+            if (conn->in_len == SERVER_MAX_LINE) {                      // no end of line in sight: give up on this client
+                append_text(&conn->out, &conn->out_len, &conn->out_cap, "error bad_request\n");
+                conn->closing = true;
+                conn->in_len = 0;
+            }
+            return;
+        }
+        *eol = '\0';
+        server_job* job = NULL;
+        if ((job = (server_job*) calloc(1, sizeof(server_job))) == NULL) ExitError("when allocating memory for a request", 44);
+        bool valid = parse_request(conn->in, job);
+        size_t consumed = (size_t)(eol - conn->in) + 1;
+        memmove(conn->in, conn->in + consumed, conn->in_len - consumed);
+        conn->in_len -= consumed;
+        if (!valid || *inflight >= SERVER_QUEUE_CAPACITY) {
+            append_text(&conn->out, &conn->out_len, &conn->out_cap, valid ? "error busy\n" : "error bad_request\n");
+            free(job->update);
+            free(job);
+            continue;
+        }
+        job->client = client;
+        job->generation = conn->generation;
+        job->deadline = conn->in_time + state->timeout;        // a pipelined request waits behind the earlier ones in its own time
+        *inflight += 1;
+        conn->waiting = true;
+        pthread_mutex_lock(&state->lock);
+        state->pending[(state->pending_head + state->npending) % SERVER_QUEUE_CAPACITY] = job;
+        state->npending += 1;
+        pthread_cond_signal(&state->ready);
+        pthread_mutex_unlock(&state->lock);
+    }
+}
+
+/*** deliver_done() moves the responses of the answered jobs to the output of their connections and resumes reading those connections ***/
+void deliver_done (server_state* state, server_conn* conns, unsigned long* inflight) {
+    server_job* done[SERVER_QUEUE_CAPACITY];
+    unsigned long ndone, k;
+    pthread_mutex_lock(&state->lock);
+    for (ndone = 0; ndone < state->ndone; ndone++) done[ndone] = state->done[(state->done_head + ndone) % SERVER_QUEUE_CAPACITY];
+    state->done_head = (state->done_head + ndone) % SERVER_QUEUE_CAPACITY;
+    state->ndone = 0;
+    pthread_mutex_unlock(&state->lock);
+    for (k = 0; k < ndone; k++) {
+        server_job* job = done[k];
+        server_conn* conn = &conns[job->client];
+        *inflight -= 1;
+        if (conn->fd != -1 && conn->generation == job->generation) {     // otherwise the client went away while it was being answered
+            append_text(&conn->out, &conn->out_len, &conn->out_cap, "%s", job->response);
+            conn->waiting = false;
+            process_lines(state, conns, job->client, inflight);
+        }
+        free(job->response);
+        free(job->update);
+        free(job);
+    }
+}
+
+/*** open_listener() creates the listening socket: a TCP port on 127.0.0.1 if address is a number, a Unix domain socket at that path otherwise ***/
+int open_listener (const char* address, bool* is_unix) {
+    int fd;
+    *is_unix = address[strspn(address, "0123456789")] != '\0';
+    if (*is_unix) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        if (strlen(address) >= sizeof(addr.sun_path)) ExitError("the socket path is too long", 47);
+        strcpy(addr.sun_path, address);
+        unlink(address);                                                // left over by a previous run
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) ExitError("when creating the socket", 48);
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ExitError("when binding the socket", 49);
+    }
+    else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons((uint16_t)atoi(address));
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        int yes = 1;
+        if ((fd = socket(AF_INET, SOCK_STREAM, 0)) < 0) ExitError("when creating the socket", 48);
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ExitError("when binding the socket", 49);
+    }
+    if (listen(fd, 128) != 0) ExitError("when listening on the socket", 49);
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    return fd;
+}
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 3) ExitError("usage: server_main <map.bin> <socket path or TCP port> [number of threads] [timeout in ms] [landmark, hierarchy, cost profile and patch files...] [cache:MB]", 30);
+    graph g;
+    load_graph(argv[1], &g);
+    landmarks lm;
+    ch_graph ch;
+    cost_profile profile;
+    edge_overlay overlay;
+    init_extras(&lm, &ch, &profile, &overlay);
+    int extra;
+    search_cache cache;
+    long cache_mb = -1;
+    for (extra = 5; extra < argc; extra++) {
+        if (strncmp(argv[extra], "cache:", 6) == 0) cache_mb = atol(argv[extra] + 6);
+        else load_extra(argv[extra], &g, &lm, &ch, &profile, &overlay);
+    }
+    if (g.ch == NULL && g.overlay == NULL) attach_overlay(&g, &overlay);     // empty until the first update
+    long nthreads = (argc > 3) ? atol(argv[3]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    long timeout_ms = (argc > 4) ? atol(argv[4]) : SERVER_TIMEOUT_MS;
+    if (timeout_ms < 1) timeout_ms = SERVER_TIMEOUT_MS;
+
+// writes to a closed connection must fail with EPIPE instead of killing the server; SIGINT and SIGTERM stop it cleanly
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &action, NULL);
+    action.sa_handler = request_stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    bool is_unix;
+    int listen_fd = open_listener(argv[2], &is_unix);
+    int wake_pipe[2];
+    if (pipe(wake_pipe) != 0) ExitError("when creating the wake-up pipe", 48);
+    fcntl(wake_pipe[0], F_SETFL, fcntl(wake_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(wake_pipe[1], F_SETFL, fcntl(wake_pipe[1], F_GETFL) | O_NONBLOCK);
+
+// one search context pair per worker, allocated once
+    server_state state;
+    state.g = &g;
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.ready, NULL);
+    state.pending_head = state.npending = state.done_head = state.ndone = 0;
+    state.stopping = false;
+    state.wake_fd = wake_pipe[1];
+    state.timeout = 1e-3 * timeout_ms;
+    state.cache = NULL;
+    if (cache_mb >= 0) {
+        init_search_cache(&cache, (unsigned long)cache_mb << 20);
+        state.cache = &cache;
+    }
+    server_worker* workers = NULL;
+    pthread_t* threads = NULL;
+    server_conn* conns = NULL;
+    struct pollfd* fds = NULL;
+    int* fd_conn = NULL;                                                // connection polled at each entry of fds
+    if ((workers = (server_worker*) malloc(nthreads*sizeof(server_worker))) == NULL ||
+        (threads = (pthread_t*) malloc(nthreads*sizeof(pthread_t))) == NULL) ExitError("when allocating memory for the workers", 33);
+    if ((conns = (server_conn*) calloc(SERVER_MAX_CLIENTS, sizeof(server_conn))) == NULL ||
+        (fds = (struct pollfd*) malloc((SERVER_MAX_CLIENTS + 2)*sizeof(struct pollfd))) == NULL ||
+        (fd_conn = (int*) malloc((SERVER_MAX_CLIENTS + 2)*sizeof(int))) == NULL) ExitError("when allocating memory for the connections", 44);
+    long t;
+    for (t = 0; t < nthreads; t++) {
+        workers[t].state = &state;
+        init_search_context(&workers[t].fwd, &g);
+        init_search_context(&workers[t].bwd, &g);
+        if (pthread_create(&threads[t], NULL, worker, &workers[t]) != 0) ExitError("when creating a worker thread", 34);
+    }
+    int c, nconns = 0;
+    for (c = 0; c < SERVER_MAX_CLIENTS; c++) conns[c].fd = -1;
+    unsigned long inflight = 0;
+    fprintf(stderr, "Serving %lu nodes on %s with %ld threads, timeout %ld ms.\n", (unsigned long)g.nnodes, argv[2], nthreads, timeout_ms);
+
+/*** Event loop ***/
+    while (!stop_requested) {
+        int nfds = 0;
+        fds[nfds].fd = wake_pipe[0]; fds[nfds].events = POLLIN; fd_conn[nfds++] = -1;
+        fds[nfds].fd = listen_fd; fds[nfds].events = (nconns < SERVER_MAX_CLIENTS) ? POLLIN : 0; fd_conn[nfds++] = -1;
+        for (c = 0; c < SERVER_MAX_CLIENTS; c++) {
+            server_conn* conn = &conns[c];
+            if (conn->fd == -1) continue;
+            short events = 0;
+            if (!conn->waiting && !conn->closing && conn->out_len - conn->out_pos < SERVER_MAX_OUTPUT) events |= POLLIN;
+            if (conn->out_pos < conn->out_len) events |= POLLOUT;
+            fds[nfds].fd = conn->fd; fds[nfds].events = events; fd_conn[nfds++] = c;
+        }
+        if (poll(fds, nfds, -1) < 0) {
+            if (errno == EINTR) continue;
+            ExitError("when waiting for events", 50);
+        }
+        if (fds[0].revents & POLLIN) {
+            char drain[256];
+            while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+            deliver_done(&state, conns, &inflight);
+        }
+        if (fds[1].revents & POLLIN) {
+            int fd;
+            while (nconns < SERVER_MAX_CLIENTS && (fd = accept(listen_fd, NULL, NULL)) >= 0) {
+                fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+                for (c = 0; conns[c].fd != -1; c++);
+                conns[c].fd = fd;
+                nconns += 1;
+            }
+        }
+        int k;
+        for (k = 2; k < nfds; k++) {
+            server_conn* conn = &conns[fd_conn[k]];
+            if (conn->fd != fds[k].fd) continue;                        // closed and maybe reused earlier in this round
+            if ((fds[k].revents & (POLLHUP | POLLERR)) && !(fds[k].revents & POLLIN)) { close_conn(conn); nconns -= 1; continue; }
+            if (fds[k].revents & POLLIN) {
+                ssize_t got = read(conn->fd, conn->in + conn->in_len, SERVER_MAX_LINE - conn->in_len);
+                conn->in_time = monotonic_seconds();
+                if (got < 0 && errno != EAGAIN && errno != EINTR) { close_conn(conn); nconns -= 1; continue; }
+                if (got == 0) conn->closing = true;                     // the client is done sending: answer what is left, then close
+                if (got > 0) conn->in_len += (size_t)got;
+                process_lines(&state, conns, fd_conn[k], &inflight);
+            }
+            if (conn->out_pos < conn->out_len) {
+                ssize_t sent = write(conn->fd, conn->out + conn->out_pos, conn->out_len - conn->out_pos);
+                if (sent < 0 && errno != EAGAIN && errno != EINTR) { close_conn(conn); nconns -= 1; continue; }
+                if (sent > 0) conn->out_pos += (size_t)sent;
+                if (conn->out_pos == conn->out_len) conn->out_pos = conn->out_len = 0;
+            }
+            if (conn->closing && !conn->waiting && conn->out_len == 0) { close_conn(conn); nconns -= 1; }
+        }
+    }
+    fprintf(stderr, "Stopping.\n");
+
+/*** Free all allocated memory ***/
+    pthread_mutex_lock(&state.lock);
+    state.stopping = true;
+    pthread_cond_broadcast(&state.ready);
+    pthread_mutex_unlock(&state.lock);
+    for (t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+    deliver_done(&state, conns, &inflight);
+    for (c = 0; c < SERVER_MAX_CLIENTS; c++) {
+        if (conns[c].fd != -1) close_conn(&conns[c]);
+        free(conns[c].out);
+    }
+    for (t = 0; t < nthreads; t++) { free_search_context(&workers[t].fwd); free_search_context(&workers[t].bwd); }
+    free(workers); free(threads); free(conns); free(fds); free(fd_conn);
+    if (state.cache != NULL) free_search_cache(&cache, &g);
+    close(listen_fd); close(wake_pipe[0]); close(wake_pipe[1]);
+    if (is_unix) unlink(argv[2]);
+    pthread_mutex_destroy(&state.lock);
+    pthread_cond_destroy(&state.ready);
+    unload_ch(&g, &ch);
+    detach_overlay(&g, &overlay);
+    unload_profile(&g, &profile);
+    unload_landmarks(&g, &lm);
+    unload_graph(&g);
+    return 0;
+}
@@ -1,127 +1,555 @@
 #include "Astar_header.h"
+#include <stdatomic.h>
 
-int main (int argc, char *argv[]) {
-    
-// Open csv file and select what map we are working with
-    FILE *fmap;
-    if ((fmap = fopen(argv[1], "r")) == NULL) ExitError("when opening the csv file", 1);
-    
-// Variables related to getline()
-    char* line_buf = NULL;      // line that is being read from file
-    size_t line_buf_size = 0;   // size of allocated memory for line
-    ssize_t line_size = 0;      // size of line in number of characters
-    
-/*** Oth READ OF .csv FILE: Count the number of nodes ***/
-    unsigned long nnodes = 0UL;
-    while (line_size >= 0) {
-        line_size = getline(&line_buf, &line_buf_size, fmap);// read the line
-        if (*(line_buf) == '#') continue;                    // skip comment lines
-        else if (*(line_buf) == 'n') nnodes += 1;            // find a line that corresponds to node: add 1 to nnodes
-        else if (*(line_buf) == 'w') break;                  // exit loop when we get to ways                
-    }
-    
-// Vector of nodes
-    node *nodes;
-    if((nodes = (node *) malloc(nnodes*sizeof(node))) == NULL) ExitError("when allocating memory for the nodes vector", 2);
-    unsigned long i = 0;  // keep track of the position in nodes vector of the node being processed
-
-// Vector of number of successors of each node. calloc() initializes allocated memory to 0
-    unsigned short* nsuccdim = NULL;
-    if ((nsuccdim = (unsigned short*) calloc(nnodes, sizeof(unsigned short))) == NULL) ExitError("when allocating memory for nsuccdim", 3);
-        
-/*** FIRST READ OF .csv FILE: Lines that correspond to nodes get info on node id, name, lat and lon. Lines that correspond to ways are used to compute the elements of nsuccdim ***/
-    fseek(fmap, 0, SEEK_SET);                                // rewind to the begining of file for second round of reading
-    while (line_size >= 0) {
-        line_size = getline(&line_buf, &line_buf_size, fmap);// read the line
-        if (*(line_buf) == '#') continue;                    // skip comment lines
-        else if (*(line_buf) == 'n') {                       // process a line that corresponds to a node
-            process_node(nodes, line_buf, i);                // and move to next position in nodes vector
-            i += 1;
-            continue;
+/*** Conversion of the OSM-derived .csv map to the binary graph file.
+     Usage: write_main <map.csv> [number of threads]
+     The csv file is mapped and split into chunks at line boundaries, which are parsed in parallel in a single pass: node lines give the
+     node arrays and way lines the ids of their nodes, road class and maxspeed. Node ids are then resolved through a hash table (IdIndex) and edge lengths computed,
+     again in parallel per chunk, and the adjacency arrays are built with one counting sort over the edges in file order, so the successors
+     of every node keep the order of the ways in the csv file. Everything after the first relation line is ignored. The nodes are also sorted into the cells of the spatial index (build_node_grid()). The result is written
+     to <map>.bin and the throughput is reported in MB/s. ***/
+
+#define CHUNKS_PER_THREAD 4     // more chunks than threads, so that threads that finish early take more work
+
+/*** grow() reallocates array to hold capacity elements of the given size ***/
+void grow (void** array, unsigned long capacity, size_t size) {
+    if ((*array = realloc(*array, capacity*size)) == NULL) ExitError("when allocating memory while parsing the csv file", 2);
+}
+
+/*** next_capacity() doubles a capacity, starting from a reasonable size for a chunk ***/
+unsigned long next_capacity (unsigned long capacity) {
+    return capacity ? 2*capacity : 1024;
+}
+
+/*** structure to represent a way: its node ids are refs[previous way's refs_end] ... refs[refs_end-1] of its chunk ***/
+typedef struct {
+    unsigned long refs_end;
+    bool oneway;
+    EdgeAttr attr;              // given to all the edges of the way
+} csv_way;
+
+/*** everything read from one chunk of the csv file ***/
+typedef struct {
+    const char* begin;          // first line starting in the chunk
+    const char* end;            // end of the chunk
+    bool relations;             // a relation line was found: later chunks are ignored
+// node lines
+    unsigned long nnodes, nodes_capacity, first_node;   // first_node: position of the first node of the chunk in the graph
+    uint64_t* ids;
+    double* lat;
+    double* lon;
+    const char** names;         // names point into the mapped csv file
+    uint64_t* namelens;
+// way lines
+    unsigned long nways, ways_capacity, nrefs, refs_capacity;
+    csv_way* ways;
+    uint64_t* refs;
+// directed edges of the chunk in file order, filled once all node ids are known
+    unsigned long nedges, edges_capacity;
+    uint64_t* from;
+    uint64_t* to;
+    double* weights;
+    EdgeAttr* attrs;
+} csv_chunk;
+
+/*** state shared by the workers: chunks are claimed one at a time ***/
+typedef struct {
+    csv_chunk* chunks;
+    unsigned long nchunks;
+    atomic_ulong next;
+// graph being built, for the second phase
+    IdIndex* index;
+    double* lat;
+    double* lon;
+    point3* unit;
+} csv_state;
+
+/*** parse_chunk() reads the node and way lines that start in the chunk, stopping at the first relation line ***/
+void parse_chunk (csv_chunk* chunk) {
+    const char* line = chunk->begin;
+    while (line < chunk->end) {
+        const char* eol = (const char*) memchr(line, '\n', chunk->end - line);
+        const char* next = (eol == NULL) ? chunk->end : eol + 1;
+        const char* line_end = (eol == NULL) ? chunk->end : eol;
+        if (*line == 'r') { chunk->relations = true; return; }
+        if (*line == 'n') {                                                 // node|id|name|place|highway|route|ref|oneway|maxspeed|lat|lon
+            unsigned long i = chunk->nnodes;
+            if (i == chunk->nodes_capacity) {
+                chunk->nodes_capacity = next_capacity(chunk->nodes_capacity);
+                grow((void**)&chunk->ids, chunk->nodes_capacity, sizeof(uint64_t));
+                grow((void**)&chunk->lat, chunk->nodes_capacity, sizeof(double));
+                grow((void**)&chunk->lon, chunk->nodes_capacity, sizeof(double));
+                grow((void**)&chunk->names, chunk->nodes_capacity, sizeof(const char*));
+                grow((void**)&chunk->namelens, chunk->nodes_capacity, sizeof(uint64_t));
+            }
+            const char* field = next_csv_field(line, line_end);
+            chunk->ids[i] = parse_csv_id(field, line_end);
+            field = next_csv_field(field, line_end);
+            chunk->names[i] = field;
+            chunk->namelens[i] = csv_field_length(field, line_end);
+            unsigned short count;
+            for (count = 3; count < 10; count++) field = next_csv_field(field, line_end);     // 10th field: lat
+            chunk->lat[i] = parse_csv_double(field, line_end);
+            field = next_csv_field(field, line_end);                                          // 11th field: lon
+            chunk->lon[i] = parse_csv_double(field, line_end);
+            chunk->nnodes += 1;
+        }
+        else if (*line == 'w') {                                            // way|id|name|place|highway|route|ref|oneway|maxspeed|node ids...
+            const char* field = line;
+            unsigned short count;
+            EdgeAttr attr;
+            for (count = 1; count < 5; count++) field = next_csv_field(field, line_end);      // 5th field: highway
+            attr.road_class = parse_road_class(field, line_end);
+            for (; count < 8; count++) field = next_csv_field(field, line_end);               // 8th field: oneway
+            bool oneway = (field < line_end && *field == 'o');
+            field = next_csv_field(field, line_end);                                          // 9th field: maxspeed
+            attr.maxspeed = parse_maxspeed(field, line_end);
+            field = next_csv_field(field, line_end);
+            while (field < line_end || (field == line_end && field[-1] == '|')) {              // every field from the 10th on is a node id, even an empty last one
+                if (chunk->nrefs == chunk->refs_capacity) {
+                    chunk->refs_capacity = next_capacity(chunk->refs_capacity);
+                    grow((void**)&chunk->refs, chunk->refs_capacity, sizeof(uint64_t));
+                }
+                chunk->refs[chunk->nrefs++] = parse_csv_id(field, line_end);
+                if (field == line_end) break;
+                field = next_csv_field(field, line_end);
+            }
+            if (chunk->nways == chunk->ways_capacity) {
+                chunk->ways_capacity = next_capacity(chunk->ways_capacity);
+                grow((void**)&chunk->ways, chunk->ways_capacity, sizeof(csv_way));
+            }
+            chunk->ways[chunk->nways].refs_end = chunk->nrefs;
+            chunk->ways[chunk->nways].oneway = oneway;
+            chunk->ways[chunk->nways].attr = attr;
+            chunk->nways += 1;
+        }
+        line = next;                                                        // comment lines (#) and anything else are skipped
+    }
+}
+
+/*** add_csv_edge() appends the directed edge u->v with length w and attributes attr to the chunk ***/
+void add_csv_edge (csv_chunk* chunk, uint64_t u, uint64_t v, double w, EdgeAttr attr) {
+    unsigned long k = chunk->nedges;
+    if (k == chunk->edges_capacity) {
+        chunk->edges_capacity = next_capacity(chunk->edges_capacity);
+        grow((void**)&chunk->from, chunk->edges_capacity, sizeof(uint64_t));
+        grow((void**)&chunk->to, chunk->edges_capacity, sizeof(uint64_t));
+        grow((void**)&chunk->weights, chunk->edges_capacity, sizeof(double));
+        grow((void**)&chunk->attrs, chunk->edges_capacity, sizeof(EdgeAttr));
+    }
+    chunk->from[k] = u;
+    chunk->to[k] = v;
+    chunk->weights[k] = w;
+    chunk->attrs[k] = attr;
+    chunk->nedges += 1;
+}
+
+/*** resolve_chunk() computes the unit positions of the nodes of the chunk, and turns its ways into edges: node ids that are not in the graph are skipped, and every pair of consecutive nodes left gives an edge, in both directions unless the way is one-way. ***/
+void resolve_chunk (csv_state* state, csv_chunk* chunk) {
+    unsigned long i, w, r = 0;
+    for (i = 0; i < chunk->nnodes; i++) {
+        unsigned long position = chunk->first_node + i;
+        state->unit[position] = unit_vector(chunk->lat[i], chunk->lon[i]);
+    }
+    for (w = 0; w < chunk->nways; w++) {
+        signed long n = -1, m;
+        for (; r < chunk->ways[w].refs_end; r++) {
+            m = id_index_find(state->index, chunk->refs[r]);
+            if (m == -1) continue;                                          // node not in the graph: try the next one
+            if (n != -1) {
+                double length = haversine(state->lat[n], state->lon[n], state->lat[m], state->lon[m]);    // edge length, the same in both directions
+                add_csv_edge(chunk, (uint64_t)n, (uint64_t)m, length, chunk->ways[w].attr);
+                if (!chunk->ways[w].oneway) add_csv_edge(chunk, (uint64_t)m, (uint64_t)n, length, chunk->ways[w].attr);
+            }
+            n = m;
+        }
+    }
+}
+
+void* parse_worker (void* arg) {
+    csv_state* state = (csv_state*) arg;
+    unsigned long k;
+    while ((k = atomic_fetch_add(&state->next, 1)) < state->nchunks) parse_chunk(&state->chunks[k]);
+    return NULL;
+}
+
+void* resolve_worker (void* arg) {
+    csv_state* state = (csv_state*) arg;
+    unsigned long k;
+    while ((k = atomic_fetch_add(&state->next, 1)) < state->nchunks) resolve_chunk(state, &state->chunks[k]);
+    return NULL;
+}
+
+/*** run_workers() runs one phase on all chunks with nthreads threads ***/
+void run_workers (csv_state* state, long nthreads, void* (*phase)(void*)) {
+    pthread_t* threads = NULL;
+    if ((threads = (pthread_t*) malloc(nthreads*sizeof(pthread_t))) == NULL) ExitError("when allocating memory for the threads", 2);
+    atomic_store(&state->next, 0);
+    long t;
+    for (t = 0; t < nthreads; t++)
+        if (pthread_create(&threads[t], NULL, phase, state) != 0) ExitError("when creating a thread", 2);
+    for (t = 0; t < nthreads; t++) pthread_join(threads[t], NULL);
+    free(threads);
+}
+
+/*** transpose() builds the reverse adjacency (rfirst, rtargets, rweights, rattrs) of a graph in CSR form: the predecessors of every node, in increasing order ***/
+void transpose (uint64_t nnodes, const uint64_t* first, const edge_target* targets, const double* weights, const EdgeAttr* attrs, uint64_t* rfirst, edge_target* rtargets, double* rweights, EdgeAttr* rattrs) {
+    uint64_t i, e;
+    uint64_t* next = NULL;                                          // next free position in the list of predecessors of every node
+    if ((next = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL) ExitError("when allocating memory for the reverse adjacency", 7);
+    memset(rfirst, 0, (nnodes+1)*sizeof(uint64_t));
+    for (e = 0; e < first[nnodes]; e++) rfirst[targets[e] + 1] += 1;   // count the predecessors of every node
+    for (i = 0; i < nnodes; i++) rfirst[i+1] += rfirst[i];
+    memcpy(next, rfirst, nnodes*sizeof(uint64_t));
+    for (i = 0; i < nnodes; i++)                                    // place every edge in the list of its target
+        for (e = first[i]; e < first[i+1]; e++) {
+            uint64_t slot = next[targets[e]]++;
+            rtargets[slot] = i;
+            if (rweights != NULL) rweights[slot] = weights[e];
+            if (rattrs != NULL) rattrs[slot] = attrs[e];
         }
-        else if (*(line_buf) == 'w') {                        // process a line that corresponds to a way
-            update_nsuccs(nsuccdim, line_buf, nodes, nnodes); // update nsuccdim from info of the way line
-            continue;
+    free(next);
+}
+
+/*** Node orders. By default nodes keep the order of the csv file (sorted by osm id), which scatters neighbouring nodes all over the arrays. The converter can renumber them so that nodes close in the map are close in memory: along a Hilbert curve over their coordinates, or in breadth-first order of the graph. perm[v] is the csv position of the node that becomes node v. ***/
+#define ORDER_CSV 0
+#define ORDER_HILBERT 1
+#define ORDER_BFS 2
+#define HILBERT_BITS 16         // the bounding box of the map is divided in a grid of 2^16 x 2^16 cells
+
+/*** hilbert_index() is the position of cell (x, y) along the Hilbert curve that fills the grid ***/
+uint64_t hilbert_index (uint32_t x, uint32_t y) {
+    uint32_t n = 1u << HILBERT_BITS, s, rx, ry, t;
+    uint64_t d = 0;
+    for (s = n/2; s > 0; s /= 2) {
+        rx = (x & s) > 0;
+        ry = (y & s) > 0;
+        d += (uint64_t)s * s * ((3 * rx) ^ ry);
+        if (ry == 0) {                                              // rotate the quadrant so that the curve stays continuous
+            if (rx == 1) { x = n-1 - x; y = n-1 - y; }
+            t = x; x = y; y = t;
         }
-        else if (*(line_buf) == 'r') break;                   // exit loop when we get to relations                       
     }
-    
-// Allocate memory for the successors of every node.
+    return d;
+}
+
+void hilbert_order (uint64_t nnodes, const double* lat, const double* lon, uint64_t* perm) {
+    double min_lat = INFINITY, max_lat = -INFINITY, min_lon = INFINITY, max_lon = -INFINITY;
+    uint64_t i;
+    for (i = 0; i < nnodes; i++) {
+        if (lat[i] < min_lat) min_lat = lat[i];
+        if (lat[i] > max_lat) max_lat = lat[i];
+        if (lon[i] < min_lon) min_lon = lon[i];
+        if (lon[i] > max_lon) max_lon = lon[i];
+    }
+    double cells = (double)((1u << HILBERT_BITS) - 1);
+    double lat_scale = (max_lat > min_lat) ? cells / (max_lat - min_lat) : 0;
+    double lon_scale = (max_lon > min_lon) ? cells / (max_lon - min_lon) : 0;
+    id_slot* keys = NULL;
+    if ((keys = (id_slot*) malloc((nnodes > 0 ? nnodes : 1)*sizeof(id_slot))) == NULL) ExitError("when allocating memory to renumber the nodes", 16);
     for (i = 0; i < nnodes; i++) {
-        nodes[i].nsucc = nsuccdim[i];
-        if((nodes[i].successors = (unsigned long*) malloc(nsuccdim[i]*sizeof(unsigned long))) == NULL) ExitError("when allocating memory for the nodes successors", 5);
-    }
-    
-// Allocate memory for successors index counter. Use calloc() to initialize all counters to 0.
-    unsigned short* succ_counter = NULL;
-    if((succ_counter = (unsigned short*) calloc(nnodes, sizeof(unsigned short))) == NULL) ExitError("when allocating memory for the nodes successor counters", 6);
-    
-/*** SECOND READ OF .csv FILE: Construct adjacency list ***/
-    fseek(fmap, 0, SEEK_SET);                                      // rewind to the begining of file for second round of reading
-    while (line_size >= 0) {
-        line_size = getline(&line_buf, &line_buf_size, fmap);      // read the line
-        if (*(line_buf) == '#' || *(line_buf) == 'n') continue;    // skip comment lines and nodes
-        if (*(line_buf) == 'w') {                                  // process a line that corresponds to a way
-            update_successors(line_buf, nodes, nnodes, succ_counter);                                                   
+        keys[i].id = hilbert_index((uint32_t)((lon[i] - min_lon) * lon_scale), (uint32_t)((lat[i] - min_lat) * lat_scale));
+        keys[i].index = i;
+    }
+    qsort(keys, nnodes, sizeof(id_slot), compare_id_slots);         // ties keep the csv order
+    for (i = 0; i < nnodes; i++) perm[i] = keys[i].index;
+    free(keys);
+}
+
+/*** bfs_order() numbers the nodes in breadth-first order, following edges in both directions and starting a new search from the first node in csv order not reached yet ***/
+void bfs_order (uint64_t nnodes, const uint64_t* first, const edge_target* targets, uint64_t* perm) {
+    uint64_t* rfirst = NULL;
+    edge_target* rtargets = NULL;
+    bool* reached = NULL;
+    if ((rfirst = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL ||
+        (rtargets = (edge_target*) malloc((first[nnodes] > 0 ? first[nnodes] : 1)*sizeof(edge_target))) == NULL ||
+        (reached = (bool*) calloc(nnodes > 0 ? nnodes : 1, sizeof(bool))) == NULL) ExitError("when allocating memory to renumber the nodes", 16);
+    transpose(nnodes, first, targets, NULL, NULL, rfirst, rtargets, NULL, NULL);
+    uint64_t head = 0, tail = 0, root, e;                           // perm itself is the queue
+    for (root = 0; root < nnodes; root++) {
+        if (reached[root]) continue;
+        reached[root] = true;
+        perm[tail++] = root;
+        while (head < tail) {
+            uint64_t u = perm[head++];
+            for (e = first[u]; e < first[u+1]; e++) if (!reached[targets[e]]) { reached[targets[e]] = true; perm[tail++] = targets[e]; }
+            for (e = rfirst[u]; e < rfirst[u+1]; e++) if (!reached[rtargets[e]]) { reached[rtargets[e]] = true; perm[tail++] = rtargets[e]; }
+        }
+    }
+    free(rfirst); free(rtargets); free(reached);
+}
+
+/*** permute() reorders an array of n elements of the given size so that element v is the old element perm[v] ***/
+void permute (void** array, const uint64_t* perm, uint64_t n, size_t size) {
+    char* reordered = NULL;
+    if ((reordered = (char*) malloc((n > 0 ? n : 1)*size)) == NULL) ExitError("when allocating memory to renumber the nodes", 16);
+    uint64_t v;
+    for (v = 0; v < n; v++) memcpy(reordered + v*size, (char*)(*array) + perm[v]*size, size);
+    free(*array);
+    *array = reordered;
+}
+
+/*** renumber_adjacency() rewrites the adjacency for the new numbering: the successors of v are those of perm[v], renumbered and in the same order ***/
+void renumber_adjacency (uint64_t nnodes, const uint64_t* perm, uint64_t** first, edge_target** targets, double** weights, EdgeAttr** attrs) {
+    uint64_t* inverse = NULL;
+    uint64_t* new_first = NULL;
+    edge_target* new_targets = NULL;
+    double* new_weights = NULL;
+    EdgeAttr* new_attrs = NULL;
+    uint64_t nedges = (*first)[nnodes], v, e;
+    if ((inverse = (uint64_t*) malloc((nnodes > 0 ? nnodes : 1)*sizeof(uint64_t))) == NULL ||
+        (new_first = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL ||
+        (new_targets = (edge_target*) malloc((nedges > 0 ? nedges : 1)*sizeof(edge_target))) == NULL ||
+        (new_weights = (double*) malloc((nedges > 0 ? nedges : 1)*sizeof(double))) == NULL ||
+        (new_attrs = (EdgeAttr*) malloc((nedges > 0 ? nedges : 1)*sizeof(EdgeAttr))) == NULL) ExitError("when allocating memory to renumber the nodes", 16);
+    for (v = 0; v < nnodes; v++) inverse[perm[v]] = v;
+    new_first[0] = 0;
+    for (v = 0; v < nnodes; v++) {
+        uint64_t u = perm[v];
+        new_first[v+1] = new_first[v];
+        for (e = (*first)[u]; e < (*first)[u+1]; e++) {
+            new_targets[new_first[v+1]] = inverse[(*targets)[e]];
+            new_weights[new_first[v+1]] = (*weights)[e];
+            new_attrs[new_first[v+1]] = (*attrs)[e];
+            new_first[v+1] += 1;
+        }
+    }
+    free(inverse); free(*first); free(*targets); free(*weights); free(*attrs);
+    *first = new_first; *targets = new_targets; *weights = new_weights; *attrs = new_attrs;
+}
+
+int main (int argc, char *argv[]) {
+
+    if (argc < 2) ExitError("usage: write_main <map.csv> [number of threads] [csv|hilbert|bfs]", 1);
+    long nthreads = (argc > 2) ? atol(argv[2]) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (nthreads < 1) nthreads = 1;
+    int order = ORDER_CSV;
+    if (argc > 3) {
+        if (strcmp(argv[3], "hilbert") == 0) order = ORDER_HILBERT;
+        else if (strcmp(argv[3], "bfs") == 0) order = ORDER_BFS;
+        else if (strcmp(argv[3], "csv") != 0) ExitError("the node order must be csv, hilbert or bfs", 1);
+    }
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+// Map the csv file
+    int fd;
+    if ((fd = open(argv[1], O_RDONLY)) < 0) ExitError("when opening the csv file", 1);
+    struct stat st;
+    if (fstat(fd, &st) != 0) ExitError("when opening the csv file", 1);
+    size_t csv_size = (size_t)st.st_size;
+    const char* csv = "";
+    if (csv_size > 0) {
+        void* map = mmap(NULL, csv_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) ExitError("when mapping the csv file", 1);
+        madvise(map, csv_size, MADV_SEQUENTIAL);
+        csv = (const char*) map;
+    }
+    close(fd);
+
+// Split it into chunks that start at the beginning of a line
+    csv_state state;
+    state.nchunks = (unsigned long)nthreads * CHUNKS_PER_THREAD;
+    if ((state.chunks = (csv_chunk*) calloc(state.nchunks, sizeof(csv_chunk))) == NULL) ExitError("when allocating memory for the chunks", 2);
+    unsigned long k, i;
+    const char* csv_end = csv + csv_size;
+    for (k = 0; k < state.nchunks; k++) {
+        const char* begin = csv + csv_size * k / state.nchunks;
+        if (begin > csv && begin[-1] != '\n') {
+            const char* eol = (const char*) memchr(begin, '\n', csv_end - begin);
+            begin = (eol == NULL) ? csv_end : eol + 1;
+        }
+        state.chunks[k].begin = begin;
+        if (k > 0) state.chunks[k-1].end = begin;
+    }
+    state.chunks[state.nchunks-1].end = csv_end;
+
+/*** FIRST PHASE: parse the chunks in parallel ***/
+    run_workers(&state, nthreads, parse_worker);
+
+// Chunks after the first relation line are not part of the graph. Nodes are numbered in file order.
+    for (k = 0; k < state.nchunks; k++) if (state.chunks[k].relations) { state.nchunks = k + 1; break; }
+    unsigned long nnodes = 0;
+    for (k = 0; k < state.nchunks; k++) {
+        state.chunks[k].first_node = nnodes;
+        nnodes += state.chunks[k].nnodes;
+    }
+    if (nnodes >= MAX_SEARCH_NODES) ExitError("the map has too many nodes for the search state (at most 2^30 - 1)", 17);
+
+// Node arrays in csv order: ids, coordinates and names. The ids go to the hash table right away and all coordinates must be in place before edge lengths are computed.
+    GraphFileHeader header;
+    memset(&header, 0, sizeof(GraphFileHeader));
+    memcpy(header.magic, GRAPH_MAGIC, sizeof(header.magic));
+    header.version = GRAPH_VERSION;
+    header.header_size = sizeof(GraphFileHeader);
+    header.nnodes = nnodes;
+    uint64_t* ids = NULL;
+    const char** names = NULL;
+    uint64_t* namelens = NULL;
+    uint64_t* name_first = NULL;
+    if ((ids = (uint64_t*) malloc(nnodes*sizeof(uint64_t))) == NULL ||
+        (names = (const char**) malloc(nnodes*sizeof(const char*))) == NULL ||
+        (namelens = (uint64_t*) malloc(nnodes*sizeof(uint64_t))) == NULL ||
+        (state.lat = (double*) malloc(nnodes*sizeof(double))) == NULL ||
+        (state.lon = (double*) malloc(nnodes*sizeof(double))) == NULL ||
+        (state.unit = (point3*) malloc(nnodes*sizeof(point3))) == NULL ||
+        (name_first = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL)
+            ExitError("when allocating memory for the output arrays", 7);
+    IdIndex index;
+    init_id_index(&index, nnodes);
+    state.index = &index;
+    for (k = 0; k < state.nchunks; k++) {
+        csv_chunk* chunk = &state.chunks[k];
+        for (i = 0; i < chunk->nnodes; i++) {
+            unsigned long position = chunk->first_node + i;
+            ids[position] = chunk->ids[i];
+            state.lat[position] = chunk->lat[i];
+            state.lon[position] = chunk->lon[i];
+            id_index_insert(&index, chunk->ids[i], position);
+            names[position] = chunk->names[i];
+            namelens[position] = chunk->namelens[i];
+        }
+    }
+
+/*** SECOND PHASE: resolve the node ids of the ways into edges, in parallel ***/
+    run_workers(&state, nthreads, resolve_worker);
+
+// Adjacency in CSR form by a counting sort of the edges on their source, keeping file order within every node
+    uint64_t* first = NULL;
+    if ((first = (uint64_t*) calloc(nnodes+1, sizeof(uint64_t))) == NULL) ExitError("when allocating memory for the output arrays", 7);
+    for (k = 0; k < state.nchunks; k++)
+        for (i = 0; i < state.chunks[k].nedges; i++) first[state.chunks[k].from[i] + 1] += 1;
+    for (i = 0; i < nnodes; i++) first[i+1] += first[i];
+    header.nedges = first[nnodes];
+    edge_target* targets = NULL;
+    double* weights = NULL;
+    EdgeAttr* attrs = NULL;
+    uint64_t* next = NULL;                                          // next free position in the successors of every node
+    if ((targets = (edge_target*) malloc(header.nedges*sizeof(edge_target))) == NULL ||
+        (weights = (double*) malloc(header.nedges*sizeof(double))) == NULL ||
+        (attrs = (EdgeAttr*) malloc(header.nedges*sizeof(EdgeAttr))) == NULL ||
+        (next = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL)
+            ExitError("when allocating memory for the output arrays", 7);
+    memcpy(next, first, (nnodes+1)*sizeof(uint64_t));
+    for (k = 0; k < state.nchunks; k++) {
+        csv_chunk* chunk = &state.chunks[k];
+        for (i = 0; i < chunk->nedges; i++) {
+            uint64_t slot = next[chunk->from[i]]++;
+            targets[slot] = chunk->to[i];
+            weights[slot] = chunk->weights[i];
+            attrs[slot] = chunk->attrs[i];
         }
-        if (*(line_buf) == 'r') break;                              // exit loop when we get to relations
     }
-    free(succ_counter);     // free nodes successors counters, not necessary anymore
-    free(line_buf);         // free the allocated line buffer
-    fclose(fmap);           // close .csv file
-    
+
+// Renumber the nodes if asked to
+    if (order != ORDER_CSV) {
+        uint64_t* perm = NULL;
+        if ((perm = (uint64_t*) malloc((nnodes > 0 ? nnodes : 1)*sizeof(uint64_t))) == NULL) ExitError("when allocating memory to renumber the nodes", 16);
+        if (order == ORDER_HILBERT) hilbert_order(nnodes, state.lat, state.lon, perm);
+        else bfs_order(nnodes, first, targets, perm);
+        permute((void**)&ids, perm, nnodes, sizeof(uint64_t));
+        permute((void**)&state.lat, perm, nnodes, sizeof(double));
+        permute((void**)&state.lon, perm, nnodes, sizeof(double));
+        permute((void**)&state.unit, perm, nnodes, sizeof(point3));
+        permute((void**)&names, perm, nnodes, sizeof(const char*));
+        permute((void**)&namelens, perm, nnodes, sizeof(uint64_t));
+        renumber_adjacency(nnodes, perm, &first, &targets, &weights, &attrs);
+        free(perm);
+    }
+    name_first[0] = 0;
+    for (i = 0; i < nnodes; i++) name_first[i+1] = name_first[i] + namelens[i];
+    header.nameslen = name_first[nnodes];
+
+// Spatial index of the nodes in the final numbering
+    node_grid grid;
+    build_node_grid(&grid, state.lat, state.lon, nnodes);
+    header.grid_rows = grid.rows;
+    header.grid_cols = grid.cols;
+    header.grid_min_lat = grid.min_lat;
+    header.grid_min_lon = grid.min_lon;
+    header.grid_cell_lat = grid.cell_lat;
+    header.grid_cell_lon = grid.cell_lon;
+    graph_layout(&header);
+
+// Id index in the final numbering, so that external ids resolve whatever the order
+    uint64_t* index_ids = NULL;
+    uint64_t* index_pos = NULL;
+    if ((index_ids = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL ||
+        (index_pos = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL)
+            ExitError("when allocating memory for the output arrays", 7);
+    build_id_index(ids, nnodes, index_ids, index_pos);
+
+// Reverse adjacency: transpose the successor lists, so that one-way ways can be followed backwards
+    uint64_t* rfirst = NULL;
+    edge_target* rtargets = NULL;
+    double* rweights = NULL;
+    EdgeAttr* rattrs = NULL;
+    if ((rfirst = (uint64_t*) malloc((nnodes+1)*sizeof(uint64_t))) == NULL ||
+        (rtargets = (edge_target*) malloc(header.nedges*sizeof(edge_target))) == NULL ||
+        (rweights = (double*) malloc(header.nedges*sizeof(double))) == NULL ||
+        (rattrs = (EdgeAttr*) malloc(header.nedges*sizeof(EdgeAttr))) == NULL)
+            ExitError("when allocating memory for the reverse adjacency", 7);
+    transpose(nnodes, first, targets, weights, attrs, rfirst, rtargets, rweights, rattrs);
+
 /*** WRITE BINARY FILE ***/
     FILE *fin;
     char name[257];
-    
-// Computing the total number of successors and total length of names
-    unsigned long ntotnsucc = 0UL;
-    unsigned long totnamelen = 0UL;
-    for(i = 0; i < nnodes; i++) {
-        ntotnsucc += nodes[i].nsucc;
-        totnamelen += nodes[i].namelen;
-    }
-    totnamelen += 1;
-    
-// Allocate memory for a string consisting that will contain all names concatenated
-    char* allnames;
-    if((allnames = (char*) malloc((totnamelen)*sizeof(char))) == NULL) ExitError("when allocating memory for allnames vector", 7);
-    
+
 // Setting the name of the binary file
-    strcpy(name, argv[1]); strcpy(strrchr(name, '.'), ".bin");
+    strncpy(name, argv[1], 250); name[250] = '\0';
+    char* dot = strrchr(name, '.');
+    if (dot == NULL) dot = name + strlen(name);
+    strcpy(dot, ".bin");
     if ((fin = fopen (name, "wb")) == NULL)
         ExitError("the output binary data file cannot be opened", 8);
-    
+
 // Global data --- header
-    if( fwrite(&nnodes, sizeof(unsigned long), 1, fin) +
-        fwrite(&ntotnsucc, sizeof(unsigned long), 1, fin) +
-        fwrite(&totnamelen, sizeof(unsigned long), 1, fin) != 3 )
-            ExitError("when initializing the output binary data file", 9);
-
-// Writing all nodes
-    if( fwrite(nodes, sizeof(node), nnodes, fin) != nnodes )
-        ExitError("when writing nodes to the output binary data file", 10);
-       
-// Writing sucessors in blocks and making the allnames string
-    for(i = 0; i < nnodes; i++){
-        if(nodes[i].nsucc) {
-            if ( fwrite(nodes[i].successors, sizeof(unsigned long), nodes[i].nsucc, fin) != nodes[i].nsucc )
-                ExitError("when writing edges to the output binary data file", 11);
-        }
-        strcat(allnames, nodes[i].name);
-    }
-    
-// Writing all names
-    if ( fwrite(allnames, sizeof(char), totnamelen, fin) != totnamelen )
-            ExitError("when writing allnames to the output binary data file", 12);
-        
+    if( fwrite(&header, sizeof(GraphFileHeader), 1, fin) != 1 )
+        ExitError("when initializing the output binary data file", 9);
+
+// Writing the sections
+    write_section(fin, header.ids_offset, ids, nnodes*sizeof(uint64_t));
+    write_section(fin, header.index_ids_offset, index_ids, (nnodes+1)*sizeof(uint64_t));
+    write_section(fin, header.index_pos_offset, index_pos, (nnodes+1)*sizeof(uint64_t));
+    write_section(fin, header.lat_offset, state.lat, nnodes*sizeof(double));
+    write_section(fin, header.lon_offset, state.lon, nnodes*sizeof(double));
+    write_section(fin, header.unit_offset, state.unit, nnodes*sizeof(point3));
+    write_section(fin, header.first_offset, first, (nnodes+1)*sizeof(uint64_t));
+    write_section(fin, header.targets_offset, targets, header.nedges*sizeof(edge_target));
+    write_section(fin, header.weights_offset, weights, header.nedges*sizeof(double));
+    write_section(fin, header.attrs_offset, attrs, header.nedges*sizeof(EdgeAttr));
+    write_section(fin, header.rfirst_offset, rfirst, (nnodes+1)*sizeof(uint64_t));
+    write_section(fin, header.rtargets_offset, rtargets, header.nedges*sizeof(edge_target));
+    write_section(fin, header.rweights_offset, rweights, header.nedges*sizeof(double));
+    write_section(fin, header.rattrs_offset, rattrs, header.nedges*sizeof(EdgeAttr));
+    write_section(fin, header.name_first_offset, name_first, (nnodes+1)*sizeof(uint64_t));
+    write_section(fin, header.names_offset, NULL, 0);
+    for (i = 0; i < nnodes; i++)
+        if ( fwrite(names[i], sizeof(char), namelens[i], fin) != namelens[i] )
+            ExitError("when writing names to the output binary data file", 12);
+    write_section(fin, header.grid_first_offset, grid.first, (header.grid_rows * header.grid_cols + 1)*sizeof(uint64_t));
+    write_section(fin, header.grid_nodes_offset, grid.nodes, nnodes*sizeof(uint64_t));
+
+    if ( (uint64_t)ftell(fin) != header.file_size ) ExitError("the size of the output binary data file does not match its header", 13);
     fclose(fin);            // close .bin file
-                  
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double seconds = (double)(now.tv_sec - start.tv_sec) + 1e-9 * (double)(now.tv_nsec - start.tv_nsec);
+    printf("%lu nodes and %lu edges written to %s.\n", nnodes, (unsigned long)header.nedges, name);
+    printf("Converted %.1f MB in %.3f s with %ld threads: %.1f MB/s.\n", csv_size / 1e6, seconds, nthreads, csv_size / 1e6 / seconds);
+
 /*** Free all allocated memory ***/
-    for (i = 0; i < nnodes; i++) { free(nodes[i].name); free(nodes[i].successors); }
-    free(nodes);
-    free(nsuccdim);
-    free(allnames);
-    
+    for (k = 0; k < (unsigned long)nthreads * CHUNKS_PER_THREAD; k++) {
+        csv_chunk* chunk = &state.chunks[k];
+        free(chunk->ids); free(chunk->lat); free(chunk->lon); free(chunk->names); free(chunk->namelens);
+        free(chunk->ways); free(chunk->refs); free(chunk->from); free(chunk->to); free(chunk->weights); free(chunk->attrs);
+    }
+    free(state.chunks);
+    free(ids); free(names); free(namelens); free(index_ids); free(index_pos); free(state.lat); free(state.lon); free(state.unit); free(name_first);
+    free(first); free(targets); free(weights); free(attrs); free(next);
+    free(rfirst); free(rtargets); free(rweights); free(rattrs);
+    free((void*)grid.first); free((void*)grid.nodes);
+    free_id_index(&index);
+    if (csv_size > 0) munmap((void*)csv, csv_size);
+
     return 0;
 }